@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+
+#include "surf.h"
+#include "types.h"
+
+// Alias table slot, matches the std430 GLSL AliasEntry
+struct AliasEntry
+{
+	ALIGN(4) F32 threshold;		// The slot keeps its own index below this, above it picks the alias
+	ALIGN(4) U32 alias;
+	ALIGN(4) F32 probability;	// Probability of picking the index of this slot, through any slot
+};
+
+// Picks indices proportional to a set of weights in constant time, built with Vose's method
+class AliasTable
+{
+public:
+	AliasTable() = default;
+
+	// Weights must not be negative, a zero total weight picks all indices uniformly
+	void build(const F32* weights, U32 count);
+
+	U32 sample(U32& seed) const;
+
+	inline F32 probability(U32 index) const { return m_entries[index].probability; }
+
+	inline U32 size() const { return static_cast<U32>(m_entries.size()); }
+
+	inline const std::vector<AliasEntry>& entries() const { return m_entries; }
+
+private:
+	std::vector<AliasEntry> m_entries;
+};
@@ -3,13 +3,43 @@
 #include <cassert>
 #include <vector>
 
+#include "alias_table.h"
+#include "bvh_binning.h"
+#include "bvh_morton.h"
+#include "bvh_stats.h"
+#include "bvh_traversal.h"
 #include "material.h"
 #include "mesh.h"
+#include "quantized_bvh.h"
 #include "ray.h"
+#include "ray_packet.h"
+#include "ray_stream.h"
 #include "surf_math.h"
+#include "triangle4.h"
 #include "types.h"
-
-#define BVH_ROOT_INDEX	0
+#include "wide_bvh.h"
+
+#define BVH_ROOT_INDEX		0
+#define BVH_WIDE_TRAVERSAL	1	// Collapse built BVHs into 4 wide nodes for SSE traversal on the CPU
+#define BVH_QUANTIZATION	0	// Quantize wide node child bounds to 8 or 16 bits, 0 keeps full precision bounds
+#define SBVH_INDEX_BUDGET	1.5f	// Default maximum index count of spatial split builds, relative to the triangle count
+#define TLAS_REBUILD_THRESHOLD	1.5f	// Refits rebuild the TLAS once its SAH cost has grown by this factor since the last build
+#define BVH_DEPTH_FIRST_LAYOUT	1	// Reorder built nodes & leaf indices depth first, so traversal walks through memory mostly forwards
+#define GPU_INSTANCE_ASSEMBLY	4	// GPUInstance primitive type of assembly instances, follows the PrimitiveType values. Must match bvh.glsl
+
+#if BVH_WIDE_TRAVERSAL == 1
+#define BVH_LEAF_BLOCK_SIZE	TRIANGLE4_WIDTH	// Object split builds price leaves per block of triangles, matching the Triangle4 leaves
+#else
+#define BVH_LEAF_BLOCK_SIZE	1
+#endif
+
+#if BVH_QUANTIZATION == 8
+typedef QuantizedWideBvh<U8> TraversalBvh;
+#elif BVH_QUANTIZATION == 16
+typedef QuantizedWideBvh<U16> TraversalBvh;
+#else
+typedef WideBvh TraversalBvh;
+#endif
 
 struct AABB
 {
@@ -23,57 +53,214 @@ struct AABB
 	F32 area() const;
 
 	Float3 center() const;
-
-	F32 intersect(Ray& ray) const;
 };
 
-struct BvhBin
+struct BvhReference
 {
-	U32 count			= 0;
-	AABB boundingBox	= AABB();
+	AABB boundingBox;	// Bounds of the part of the primitive referenced, smaller than the primitive bounds after spatial splits
+	U32 primitiveIndex;
 };
 
-struct BvhNode
+// Packed 32 byte node, the child index & primitive count fill the 4th lane of the bounds. Sibling pairs start at even
+// indices of a 64 byte aligned pool, so both children are fetched with a single cache line. Matches the std430 GLSL BvhNode.
+struct ALIGN(32) BvhNode
 {
-	ALIGN(4) U32 leftFirst;
-	ALIGN(4) U32 count;
-	AABB boundingBox;
+	Float3 bbMin;
+	U32 leftFirst;
+	Float3 bbMax;
+	U32 count;
 
 	inline U32 left() const { return leftFirst; }
 	inline U32 right() const { return leftFirst + 1; }
 	inline U32 first() const { return leftFirst; }
 	inline bool isLeaf() const { return count != 0; }
+
+	inline AABB bounds() const;
+	inline void setBounds(const AABB& bounds);
+
+	inline F32 intersect(const TraversalRay& traversalRay, F32 depth) const;
+};
+
+static_assert(sizeof(BvhNode) == 32, "BvhNode must match the 32 byte GLSL node layout");
+
+AABB BvhNode::bounds() const
+{
+	AABB bounds = AABB();
+	bounds.bbMin = bbMin;
+	bounds.bbMax = bbMax;
+	return bounds;
+}
+
+void BvhNode::setBounds(const AABB& bounds)
+{
+	bbMin = bounds.bbMin;
+	bbMax = bounds.bbMax;
+}
+
+F32 BvhNode::intersect(const TraversalRay& traversalRay, F32 depth) const
+{
+	// Near and far planes are selected by the ray octant, so no min / max is needed per axis
+	const Float3& nearX = (traversalRay.octant & 1) ? bbMax : bbMin;
+	const Float3& nearY = (traversalRay.octant & 2) ? bbMax : bbMin;
+	const Float3& nearZ = (traversalRay.octant & 4) ? bbMax : bbMin;
+	const Float3& farX = (traversalRay.octant & 1) ? bbMin : bbMax;
+	const Float3& farY = (traversalRay.octant & 2) ? bbMin : bbMax;
+	const Float3& farZ = (traversalRay.octant & 4) ? bbMin : bbMax;
+
+	const Float3& origin = traversalRay.origin;
+	const Float3& rDir = traversalRay.rDirection;
+
+	F32 tmin = (nearX.x - origin.x) * rDir.x;
+	F32 tmax = (farX.x - origin.x) * rDir.x;
+	tmin = max(tmin, (nearY.y - origin.y) * rDir.y);
+	tmax = min(tmax, (farY.y - origin.y) * rDir.y);
+	tmin = max(tmin, (nearZ.z - origin.z) * rDir.z);
+	tmax = min(tmax, (farZ.z - origin.z) * rDir.z);
+
+	if (tmax >= tmin && tmin < depth && tmax > 0.0f)
+	{
+		return tmin;
+	}
+
+	return F32_FAR_AWAY;
+}
+
+inline SizeType intersectChildren(const BvhNode* nodePool, U32 leftFirst, const TraversalRay& traversalRay, F32 depth, TraversalEntry* hits)
+{
+	SizeType hitCount = 0;
+	for (U32 i = 0; i < 2; i++)
+	{
+		const BvhNode& child = nodePool[leftFirst + i];
+		F32 distance = child.intersect(traversalRay, depth);
+
+		if (distance != F32_FAR_AWAY)
+			hits[hitCount++] = TraversalEntry{ child.leftFirst, child.count, distance };
+	}
+
+	return hitCount;
+}
+
+enum class BvhBuildMode
+{
+	BinnedSAH,		// Object splits only, every primitive is referenced exactly once
+	SpatialSplits,	// SBVH, also considers spatial splits that duplicate primitive references within an index budget
+	Morton,			// LBVH, splits primitives sorted along a Morton curve at code bit boundaries, fastest to build at a lower quality
+};
+
+// Mesh space acceleration structure over the primitives of a mesh, traversed by the instances of the mesh.
+// Hits use the same conventions as BvhBLAS, packets & streams fall back to tracing their rays one by one.
+class IAccelerationStructure
+{
+public:
+	virtual ~IAccelerationStructure() = default;
+
+	virtual void build() = 0;
+
+	// Call after changing the mesh vertices, structures that cannot be refitted rebuild
+	virtual void refit() = 0;
+
+	virtual bool intersect(Ray& ray) const = 0;
+
+	virtual bool intersectAny(Ray& ray) const = 0;
+
+	virtual void intersect(RayPacket& packet, U32 firstActive = 0) const;
+
+	virtual void intersect(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const;
+
+	virtual void intersectAny(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const;
+
+	virtual Mesh* mesh() const = 0;
+
+	virtual AABB bounds() const = 0;
+
+	// Bytes used by the structure, the mesh is not included
+	virtual SizeType memoryUsage() const = 0;
+
+	// Seconds spent in the last build
+	virtual F32 buildTime() const = 0;
 };
 
 class BvhBLAS
+	: public IAccelerationStructure
 {
 public:
-	BvhBLAS(Mesh* mesh);
+	BvhBLAS(Mesh* mesh, bool deferBuild = false, BvhBuildMode buildMode = BvhBuildMode::BinnedSAH, F32 indexBudget = SBVH_INDEX_BUDGET);
 
-	~BvhBLAS();
+	virtual ~BvhBLAS();
 
 	BvhBLAS(const BvhBLAS& other) noexcept;
 	BvhBLAS& operator=(const BvhBLAS& other) noexcept;
 
-	bool intersect(Ray& ray) const;
+	virtual bool intersect(Ray& ray) const override;
 
-	bool intersectAny(Ray& ray) const;
+	virtual bool intersectAny(Ray& ray) const override;
 
-	void build();
+	bool intersect(Ray& ray, const TraversalRay& traversalRay) const;
 
-	void refit();
+	bool intersectAny(Ray& ray, const TraversalRay& traversalRay) const;
+
+	virtual void intersect(RayPacket& packet, U32 firstActive = 0) const override;
+
+	virtual void intersect(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const override;
+
+	virtual void intersectAny(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const override;
+
+	virtual void build() override;
+
+	// Builds with another mode than the configured one, e.g. a fast Morton build to render with until the configured build is done
+	void build(BvhBuildMode buildMode);
+
+	virtual void refit() override;
+
+	// Lowers the SAH cost with tree rotations for about timeBudget seconds, resuming where the previous call stopped.
+	// Returns true if the tree changed.
+	bool optimize(F32 timeBudget);
+
+	// Walks the whole tree, the EPO clips every triangle against all nodes it overlaps, so this is meant for offline reports
+	BvhStats stats() const;
+
+	// Exchanges the built trees of two BLASses over the same mesh without copying them, the build settings stay
+	void swapTree(BvhBLAS& other) noexcept;
 
-	inline const Mesh* mesh() const { return m_mesh; }
+	static void buildConcurrent(const std::vector<BvhBLAS*>& blasList);
+
+	virtual inline Mesh* mesh() const override { return m_mesh; }
+	inline const BvhBuildMode buildMode() const { return m_buildMode; }
+	inline const F32 indexBudget() const { return m_indexBudget; }
 	inline const SizeType triCount() const { return m_triCount; }
+	inline const SizeType indexCount() const { return m_indexCount; }
 	inline const U32* indices() const { return m_indices; }
 	inline const U32 nodesUsed() const { return m_nodesUsed; }
 	inline const BvhNode* nodePool() const { return m_nodePool; }
+	inline const TraversalBvh& wideBvh() const { return m_wideBvh; }
+	inline const SizeType nodeMemoryUsage() const { return m_nodeCapacity * sizeof(BvhNode); }
+	inline const SizeType leafMemoryUsage() const { return m_leafBlockCount * sizeof(Triangle4); }
+	virtual inline SizeType memoryUsage() const override { return m_indexCount * sizeof(U32) + nodeMemoryUsage() + m_wideBvh.memoryUsage() + leafMemoryUsage(); }
+	virtual inline F32 buildTime() const override { return m_buildTime; }
+
+	// Upper bounds of the index & node counts any build with the configured settings may use
+	inline const SizeType maxIndexCount() const { return m_buildMode == BvhBuildMode::SpatialSplits ? static_cast<SizeType>(m_indexBudget * static_cast<F32>(m_triCount)) : m_triCount; }
+	inline const SizeType maxNodeCount() const { return 2 * maxIndexCount(); }
 
-	inline const AABB& bounds() const { return m_nodePool[BVH_ROOT_INDEX].boundingBox; }
+	virtual inline AABB bounds() const override { return m_nodePool[BVH_ROOT_INDEX].bounds(); }
 
 private:
+	template <bool AnyHit>
+	bool traverse(Ray& ray, const TraversalRay& traversalRay) const;
+
+	template <bool AnyHit>
+	void traverseStream(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const;
+
+	// Leaf intersection over the index range, used by the binary traversal & for analytic meshes, which have no leaf blocks
+	template <bool AnyHit>
+	bool intersectPrimitives(Ray& ray, U32 first, U32 count) const;
+
+	template <bool AnyHit>
+	void intersectPrimitives(Ray* rays, const StreamRay* activeRays, U32 rayCount, U32 first, U32 count) const;
+
 	F32 calculateNodeCost(const BvhNode& node) const;
 
+	template <U32 BinCount>
 	F32 findSplitPlane(const BvhNode& node, F32& cost, U32& axis) const;
 
 	U32 partitionNode(const BvhNode& node, F32 splitPosition, U32 axis) const;
@@ -82,51 +269,115 @@ private:
 
 	void subdivide(SizeType nodeIndex);
 
+	F32 findSpatialSplitPlane(const std::vector<BvhReference>& references, const AABB& bounds, F32& cost, U32& axis) const;
+
+	void buildSpatial(SizeType maxReferences);
+
+	void subdivideSpatial(SizeType nodeIndex, std::vector<BvhReference>& references, U32 depth, SizeType maxReferences, SizeType& referenceCount, std::vector<U32>& leafIndices);
+
+	void resizeNodePool(U32 nodeCount);
+
+	void buildLeafBlocks();
+
 private:
 	Mesh* m_mesh;
+	BvhBuildMode m_buildMode;
+	F32 m_indexBudget;
 	SizeType m_triCount;
+	SizeType m_indexCount;
 	U32* m_indices;
 	U32 m_nodesUsed;
+	U32 m_nodeCapacity;
 	BvhNode* m_nodePool;
+	TraversalBvh m_wideBvh;
+	U32 m_leafBlockCount;
+	Triangle4* m_leafBlocks;	// Leaf triangles of the traversal BVH, every leaf references its own run of blocks. Unused for analytic meshes
+	U32 m_rotationCursor;	// Next node visited by optimize()
+	F32 m_buildTime;
+
+	std::vector<PrimitiveBounds> m_buildBounds;	// Build scratch, primitive bounds & centroids are only kept during object split builds
 };
 
 struct GPUInstance
 {
-	ALIGN(4)  U32 triOffset;			// Index offset into triangle array
-	ALIGN(4)  U32 bvhIdxOffset;			// Index offset into BVH GPU index array
-	ALIGN(4)  U32 bvhNodeOffset;		// Index offset into BVH GPU node array
+	ALIGN(4)  U32 triOffset;			// Index offset into triangle array, first member instance of assemblies
+	ALIGN(4)  U32 bvhIdxOffset;			// Index offset into BVH GPU index array, TLAS index array of assemblies
+	ALIGN(4)  U32 bvhNodeOffset;		// Index offset into BVH GPU node array, TLAS node array of assemblies
 	ALIGN(4)  U32 materialOffset;		// Index offset into material GPU array
 	ALIGN(4)  F32 area;
-	ALIGN(16) Mat4 transform;
-	ALIGN(16) Mat4 invTransform;
+	ALIGN(4)  U32 visibilityMask;		// Ray types intersecting the instance, see VISIBILITY_*
+	ALIGN(4)  U32 primitiveType;		// PrimitiveType of the mesh or GPU_INSTANCE_ASSEMBLY, analytic primitives are stored in the triangle array
+	ALIGN(16) Mat3x4 transform;
+	ALIGN(16) Mat3x4 invTransform;
 };
 
+static_assert(sizeof(GPUInstance) == 128, "GPUInstance must match the GLSL Instance layout");
+
 struct SamplePoint
 {
 	Float3 position;
 	Float3 normal;
+	F32 pdf;			// Area measure, over the world space surface of the instance
+	U32 primitiveIndex;
 };
 
+class BvhTLAS;
+
 class Instance
 {
 public:
+	// Transforms must be affine, the bottom row of the matrix is dropped
 	Instance(BvhBLAS* blas, Material* material, Mat4 transform);
 
+	// Instance of another acceleration structure, only CPU scenes can trace it
+	Instance(IAccelerationStructure* accel, Material* material, Mat4 transform);
+
+	// Instance of an assembly, a TLAS placed as a whole, e.g. a tree of leaf instances placed all over a forest.
+	// Nesting is bounded to one level, so the kernels can walk it without recursion: members must be mesh instances.
+	// Emitters are sampled from the scene instances only, so members must not be lights either.
+	// The assembly is shared by all its instances & must outlive them, it is never refitted by the scene.
+	Instance(const BvhTLAS* assembly, Mat4 transform);
+
+	// Hits of assemblies store the member that was hit in the nested instance index
 	bool intersect(Ray& ray) const;
 
 	bool intersectAny(Ray& ray) const;
 
+	void intersect(RayPacket& packet, U32 firstActive = 0) const;
+
 	Float3 normal(U32 primitiveIndex, const Float2& barycentric) const;
 
-	inline const Mat4& transform() const { return m_transform; }
+	// World space normal at a hit of the instance, nested hits are transformed by the member & assembly transforms
+	Float3 normal(const RayMetadata& hit) const;
+
+	// Mesh instance hit by the ray, the assembly member for nested hits
+	inline const Instance& hitLeaf(const RayMetadata& hit) const;
+
+	inline bool isAssembly() const { return assembly != nullptr; }
+
+	inline bool isEmitter() const { return material != nullptr && material->isLight(); }
+
+	inline const Mesh* mesh() const { return accel->mesh(); }
+
+	inline Mat4 transform() const { return m_transform.toMat4(); }
+
+	inline const Mat3x4& invTransform() const { return m_invTransform; }
 
 	inline GPUInstance toGPUInstance() const;
 
 	void setTransform(const Mat4& transform);
 
-	SamplePoint samplePoint(U32& seed) const;
+	// Picks a primitive by its world space area, then a uniform point on it, or on the sphere cap visible from the receiver.
+	// Emitter instances only
+	SamplePoint samplePoint(U32& seed, const Float3& receiver) const;
+
+	inline const AliasTable& triangleTable() const { return m_triangleTable; }
+
+	// Call after refitting or rebuilding the BLAS, the changed bounds are picked up by the next TLAS refit
+	inline void updateInstanceData() { updateBounds(); m_dirty = true; }
 
-	inline void updateInstanceData() { updateBounds(); }
+	inline bool isDirty() const { return m_dirty; }
+	inline void clearDirty() { m_dirty = false; }
 
 private:
 	void updateBounds();
@@ -134,20 +385,26 @@ private:
 	void calculateMeshArea();
 
 public:
-	BvhBLAS* bvh;
-	Material* material;
+	IAccelerationStructure* accel;	// nullptr for assemblies
+	BvhBLAS* bvh;		// Same structure as accel if it is a BVH, nullptr otherwise. GPU scenes & instance flattening need BVHs
+	const BvhTLAS* assembly;	// Placed TLAS of assembly instances, nullptr for mesh instances
+	Material* material;	// nullptr for assemblies, members carry their own materials
 	AABB bounds;
 	F32 area;
+	bool animated;	// Transform changes after the scene is built, animated instances are never flattened
+	U8 visibilityMask;	// Ray types intersecting the instance, see VISIBILITY_*. Set before building the scene
 
 private:
-	Mat4 m_transform;
-	Mat4 m_invTransform;
+	Mat3x4 m_transform;
+	Mat3x4 m_invTransform;
+	AliasTable m_triangleTable;	// World space triangle areas of emitters, rebuilt with the transform
+	bool m_dirty;	// Bounds changed since the owning TLAS last refitted or built
 };
 
 class BvhTLAS
 {
 public:
-	BvhTLAS(std::vector<Instance> instances);
+	BvhTLAS(std::vector<Instance> instances, BvhBuildMode buildMode = BvhBuildMode::BinnedSAH);
 
 	~BvhTLAS();
 
@@ -158,20 +415,61 @@ public:
 
 	bool intersectAny(Ray& ray) const;
 
+	bool intersect(Ray& ray, const TraversalRay& traversalRay) const;
+
+	bool intersectAny(Ray& ray, const TraversalRay& traversalRay) const;
+
+	void intersect(RayPacket& packet, U32 firstActive = 0) const;
+
+	void intersect(RayStream& stream) const;
+
+	void intersectAny(RayStream& stream) const;
+
 	void build();
 
+	// Only walks up from the leaves of dirty instances, falls back to a full build once the SAH cost degraded too far
 	void refit();
 
+	// Lowers the SAH cost with tree rotations for about timeBudget seconds, resuming where the previous call stopped.
+	// Returns true if the tree changed.
+	bool optimize(F32 timeBudget);
+
+	// The EPO is measured on instance bounds, as instance geometry is only known to the BLASses
+	BvhStats stats() const;
+
 	inline Instance& instance(SizeType index) ;
 
+	// SAH cost of the current nodes relative to the root area, drifts from the build cost as refits stretch the nodes
+	inline F32 sahCost() const;
+
 	inline const std::vector<Instance>& instances() const { return m_instances; }
 	inline const U32* indices() const { return m_indices; }
 	inline const U32 nodesUsed() const { return m_nodesUsed; }
 	inline const BvhNode* nodePool() const { return m_nodePool; }
+	inline const TraversalBvh& wideBvh() const { return m_wideBvh; }
+
+	// Union of the instance visibility masks below every binary node
+	inline const std::vector<U32>& nodeMasks() const { return m_nodeMasks; }
+
+	inline AABB bounds() const { return m_nodePool[BVH_ROOT_INDEX].bounds(); }
 
 private:
+	template <bool AnyHit>
+	bool traverse(Ray& ray, const TraversalRay& traversalRay) const;
+
+	template <bool AnyHit>
+	void traverseStream(RayStream& stream) const;
+
+	// Gathers the node & wide child masks bottom up, call after every change to the node pool
+	void updateVisibilityMasks();
+
+	U32 gatherNodeMask(U32 nodeIndex);
+
+	U32 gatherWideMask(U32 wideIndex);
+
 	F32 calculateNodeCost(const BvhNode& node) const;
 
+	template <U32 BinCount>
 	F32 findSplitPlane(const BvhNode& node, F32& cost, U32& axis) const;
 
 	U32 partitionNode(const BvhNode& node, F32 splitPosition, U32 axis) const;
@@ -180,11 +478,28 @@ private:
 
 	void subdivide(SizeType nodeIndex);
 
+	void linkNodes();
+
+	void refitFromLeaf(U32 nodeIndex);
+
+	inline F32 nodeSahWeight(const BvhNode& node) const { return node.isLeaf() ? static_cast<F32>(node.count) : 1.0f; }
+
 private:
 	std::vector<Instance> m_instances;
+	BvhBuildMode m_buildMode;
 	U32* m_indices;
 	U32 m_nodesUsed;
 	BvhNode* m_nodePool;
+	TraversalBvh m_wideBvh;
+
+	std::vector<U32> m_parentIndices;	// Parent of every node, refits walk up from the leaves of dirty instances only
+	std::vector<U32> m_instanceLeaves;	// Leaf node of every instance
+	std::vector<U32> m_nodeMasks;		// Visibility mask of every binary node, parallel to the node pool
+	std::vector<U32> m_wideChildMasks;	// Visibility masks of the children of every wide node, see VisibilityMaskedNodes
+	F64 m_nodeCost;	// Unnormalized SAH cost of the nodes, kept up to date by refits & rotations
+	F32 m_buildCost;	// sahCost() right after the last build
+	U32 m_rotationCursor;	// Next node visited by optimize()
+	F32 m_buildTime;
 };
 
 inline GPUInstance Instance::toGPUInstance() const
@@ -192,13 +507,29 @@ inline GPUInstance Instance::toGPUInstance() const
 	return GPUInstance{
 		0, 0,
 		0, 0,
-		area,
+		area, visibilityMask,
+		isAssembly() ? GPU_INSTANCE_ASSEMBLY : static_cast<U32>(mesh()->primitiveType),
 		m_transform, m_invTransform
 	};
 }
 
+const Instance& Instance::hitLeaf(const RayMetadata& hit) const
+{
+	if (!isAssembly())
+		return *this;
+
+	assert(hit.nestedInstanceIndex < assembly->instances().size());
+	return assembly->instances()[hit.nestedInstanceIndex];
+}
+
 Instance& BvhTLAS::instance(SizeType index)
 {
 	assert(index < m_instances.size());
 	return m_instances[index];
 }
+
+F32 BvhTLAS::sahCost() const
+{
+	const F32 rootArea = m_nodePool[BVH_ROOT_INDEX].bounds().area();
+	return rootArea > 0.0f ? static_cast<F32>(m_nodeCost / rootArea) : 0.0f;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+// Primitive bounds & centroid as consumed by the binned SAH builder, the 4th lane of every vector is ignored
+struct PrimitiveBounds
+{
+	__m128 bbMin;
+	__m128 bbMax;
+	__m128 centroid;
+};
+
+inline F32 boundsArea(__m128 bbMin, __m128 bbMax)
+{
+	ALIGN(16) F32 extent[4];
+	_mm_store_ps(extent, _mm_sub_ps(bbMax, bbMin));
+	return extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0];
+}
+
+// Number of blocks of BlockSize primitives needed to store count primitives
+template <U32 BlockSize>
+inline U32 blockCount(U32 count)
+{
+	return (count + BlockSize - 1) / BlockSize;
+}
+
+// Finds the best binned SAH split plane over count primitives.
+// Centroid bounds are calculated in a single pass, after which all 3 axes are binned in a single sweep over the primitives.
+// The PrimitiveFunc is called as primitiveBounds(i) for i in [0, count) and returns the PrimitiveBounds of the i-th primitive.
+// Primitive counts are rounded up to BlockSize when pricing a split, for leaves that intersect a block of primitives at once.
+template <U32 BinCount, U32 BlockSize = 1, typename PrimitiveFunc>
+F32 findBinnedSplitPlane(U32 count, PrimitiveFunc primitiveBounds, F32& cost, U32& axis)
+{
+	static_assert(BinCount >= 2, "Binned SAH requires at least 2 bins");
+	constexpr U32 PlaneCount = BinCount - 1;
+
+	__m128 centroidMin = _mm_set1_ps(F32_INF);
+	__m128 centroidMax = _mm_set1_ps(F32_NEG_INF);
+	for (U32 i = 0; i < count; i++)
+	{
+		const PrimitiveBounds primitive = primitiveBounds(i);
+		centroidMin = _mm_min_ps(centroidMin, primitive.centroid);
+		centroidMax = _mm_max_ps(centroidMax, primitive.centroid);
+	}
+
+	// Flat axes get a bin scale of 0, so all primitives land in the first bin and the axis is skipped below
+	const __m128 centroidExtent = _mm_sub_ps(centroidMax, centroidMin);
+	const __m128 flatMask = _mm_cmple_ps(centroidExtent, _mm_setzero_ps());
+	const __m128 binScale = _mm_andnot_ps(flatMask, _mm_div_ps(_mm_set1_ps(static_cast<F32>(BinCount)), centroidExtent));
+	const __m128i maxBin = _mm_set1_epi32(static_cast<I32>(BinCount - 1));
+
+	__m128 binMin[3][BinCount];
+	__m128 binMax[3][BinCount];
+	U32 binCount[3][BinCount] = {};
+	for (U32 a = 0; a < 3; a++)
+	{
+		for (U32 bin = 0; bin < BinCount; bin++)
+		{
+			binMin[a][bin] = _mm_set1_ps(F32_INF);
+			binMax[a][bin] = _mm_set1_ps(F32_NEG_INF);
+		}
+	}
+
+	for (U32 i = 0; i < count; i++)
+	{
+		const PrimitiveBounds primitive = primitiveBounds(i);
+
+		const __m128 section = _mm_mul_ps(_mm_sub_ps(primitive.centroid, centroidMin), binScale);
+		const __m128i binIndex = _mm_max_epi32(_mm_min_epi32(_mm_cvttps_epi32(section), maxBin), _mm_setzero_si128());
+
+		ALIGN(16) I32 bins[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(bins), binIndex);
+
+		for (U32 a = 0; a < 3; a++)
+		{
+			binMin[a][bins[a]] = _mm_min_ps(binMin[a][bins[a]], primitive.bbMin);
+			binMax[a][bins[a]] = _mm_max_ps(binMax[a][bins[a]], primitive.bbMax);
+			binCount[a][bins[a]]++;
+		}
+	}
+
+	ALIGN(16) F32 boundsMin[4];
+	ALIGN(16) F32 boundsExtent[4];
+	_mm_store_ps(boundsMin, centroidMin);
+	_mm_store_ps(boundsExtent, centroidExtent);
+	const I32 flatAxes = _mm_movemask_ps(flatMask);
+
+	F32 bestCost = F32_INF;
+	F32 bestSplit = 0.0f;
+	U32 bestAxis = 0;
+
+	for (U32 a = 0; a < 3; a++)
+	{
+		if (flatAxes & (1 << a))
+			continue;
+
+		// Calculate areas & primitive counts for both sides of every plane
+		F32 leftArea[PlaneCount], rightArea[PlaneCount];
+		U32 leftCount[PlaneCount], rightCount[PlaneCount];
+		__m128 leftMin = _mm_set1_ps(F32_INF), leftMax = _mm_set1_ps(F32_NEG_INF);
+		__m128 rightMin = _mm_set1_ps(F32_INF), rightMax = _mm_set1_ps(F32_NEG_INF);
+		U32 leftSum = 0, rightSum = 0;
+
+		for (U32 planeIdx = 0; planeIdx < PlaneCount; planeIdx++)
+		{
+			leftSum += binCount[a][planeIdx];
+			leftCount[planeIdx] = leftSum;
+			leftMin = _mm_min_ps(leftMin, binMin[a][planeIdx]);
+			leftMax = _mm_max_ps(leftMax, binMax[a][planeIdx]);
+			leftArea[planeIdx] = boundsArea(leftMin, leftMax);
+
+			const U32 RIGHT_BIN = BinCount - 1 - planeIdx;
+			const U32 RIGHT_PLANE = RIGHT_BIN - 1;
+			rightSum += binCount[a][RIGHT_BIN];
+			rightCount[RIGHT_PLANE] = rightSum;
+			rightMin = _mm_min_ps(rightMin, binMin[a][RIGHT_BIN]);
+			rightMax = _mm_max_ps(rightMax, binMax[a][RIGHT_BIN]);
+			rightArea[RIGHT_PLANE] = boundsArea(rightMin, rightMax);
+		}
+
+		// Calculate best split position, planes with an empty side never improve on the parent
+		const F32 binExtent = boundsExtent[a] / static_cast<F32>(BinCount);
+		for (U32 planeIdx = 0; planeIdx < PlaneCount; planeIdx++)
+		{
+			if (leftCount[planeIdx] == 0 || rightCount[planeIdx] == 0)
+				continue;
+
+			F32 planeCost = blockCount<BlockSize>(leftCount[planeIdx]) * leftArea[planeIdx] + blockCount<BlockSize>(rightCount[planeIdx]) * rightArea[planeIdx];
+			if (planeCost < bestCost)
+			{
+				bestCost = planeCost;
+				bestSplit = boundsMin[a] + binExtent * (planeIdx + 1);
+				bestAxis = a;
+			}
+		}
+	}
+
+	cost = bestCost;
+	axis = bestAxis;
+	return bestSplit;
+}
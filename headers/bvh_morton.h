@@ -0,0 +1,21 @@
+#pragma once
+
+#include "bvh_binning.h"
+#include "surf.h"
+#include "types.h"
+
+#define MORTON_AXIS_BITS		10		// Centroid grid resolution per axis, 3 axes make up a 30 bit code
+#define MORTON_RADIX_BITS		10		// Code bits sorted per radix pass, 3 passes sort a full 30 bit code
+#define MORTON_PARALLEL_COUNT	16384	// Primitive counts below this are sorted on the calling thread only
+
+// Interleaves the quantized centroid coordinates into a 30 bit Morton code, x ends up in the most significant bit of each triple
+U32 mortonCode(U32 x, U32 y, U32 z);
+
+// Sorts the primitives along the Morton curve through their centroids, quantized within the centroid bounds.
+// Writes the sorted primitive indices to indices & their codes to codes, both arrays hold count elements.
+// Uses a stable LSD radix sort, every pass is split over the OpenMP threads unless called from an active parallel region.
+void sortByMortonCode(const PrimitiveBounds* primitiveBounds, U32 count, U32* indices, U32* codes);
+
+// Number of primitives in the left half of a sorted code range, split where the highest bit differing within the range flips.
+// Ranges of equal codes are split in the middle.
+U32 findMortonSplit(const U32* codes, U32 count);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bvh.h"
+#include "types.h"
+
+#define BVH_REBUILD_CORE_SHARE	4	// Each background rebuild builds with at most 1 / share of the cores, leaving the rest to rendering
+
+// Rebuilds BLASses on worker threads while rendering keeps traversing their current trees, finished trees are swapped in
+// at a frame boundary. A BLAS keeps its mesh pointer while being rebuilt, so its mesh must not change until the swap.
+class BvhRebuilder
+{
+public:
+	BvhRebuilder();
+
+	// Waits for running rebuilds, their results are dropped
+	~BvhRebuilder();
+
+	BvhRebuilder(const BvhRebuilder& other) = delete;
+	BvhRebuilder& operator=(const BvhRebuilder& other) = delete;
+
+	// Builds every BLAS with a fast Morton build right away, then requests a rebuild with its configured settings
+	void buildFastFirst(const std::vector<BvhBLAS*>& blasList);
+
+	// Starts building a new tree for the BLAS with its configured settings, supersedes a rebuild still running for it
+	void requestRebuild(BvhBLAS* blas);
+
+	// Swaps finished trees into their BLASses without waiting for the others, call while no traversal runs.
+	// Returns true if any BLAS changed, the scenes using them need to refresh their BLAS data.
+	bool swapFinished();
+
+	// Waits for all running rebuilds & swaps them in
+	void finish();
+
+	inline bool busy() const { return !m_jobs.empty(); }
+
+private:
+	struct RebuildJob
+	{
+		BvhBLAS* target;
+		std::unique_ptr<BvhBLAS> result;
+		std::atomic<bool> finished;
+		bool superseded;	// A later request for the same BLAS replaces the result
+		std::thread worker;
+	};
+
+private:
+	std::vector<std::unique_ptr<RebuildJob>> m_jobs;	// In request order
+};
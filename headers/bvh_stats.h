@@ -0,0 +1,162 @@
+#pragma once
+
+#include <vector>
+
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define BVH_STATS_LEAF_BUCKETS	16	// Leaf size histogram buckets, leaves with more primitives share the last bucket
+
+// Quality & size metrics of a BVH, gathered from its binary node pool
+struct BvhStats
+{
+	U32 nodeCount;			// Binary nodes reachable from the root, including the root
+	U32 leafCount;
+	U32 maxDepth;			// Deepest leaf, the root has depth 0
+	F32 averageDepth;		// Average leaf depth
+	F32 sahCost;			// SAH cost relative to the root area, interior nodes cost 1 & leaves are priced like the builder does
+	F32 epo;				// Effective primitive overlap, SAH weighted primitive area inside nodes not referencing it, relative to the total area
+	F32 siblingOverlap;		// Summed overlap area of sibling bounds, relative to the root area
+	U32 leafHistogram[BVH_STATS_LEAF_BUCKETS];	// Leaf count per primitive count
+	SizeType nodeMemory;		// Binary node pool
+	SizeType traversalMemory;	// Wide nodes of CPU traversal
+	SizeType leafMemory;		// Leaf primitive copies of CPU traversal
+	F32 buildTime;			// Seconds spent in the last build
+};
+
+// Surface area of the part of a triangle inside the box
+F32 clippedTriangleArea(const Float3& v0, const Float3& v1, const Float3& v2, const Float3& bbMin, const Float3& bbMax);
+
+void printBvhStats(const char* name, const BvhStats& stats);
+
+// Fills out the tree metrics of the stats, memory & build time are left to the owner.
+// leafCost(count) prices a leaf, primitiveBounds(primitive) returns the bounds of a primitive and
+// clippedArea(primitive, bbMin, bbMax) the surface area of a primitive inside a box, used for the EPO.
+// Spatial split references are counted with the full area of their primitive in every leaf referencing it.
+template <typename NodeType, typename LeafCostFunc, typename BoundsFunc, typename AreaFunc>
+void gatherBvhStats(const NodeType* nodePool, const U32* indices, U32 primitiveCount, BvhStats& stats,
+	LeafCostFunc leafCost, BoundsFunc primitiveBounds, AreaFunc clippedArea)
+{
+	struct StatsEntry
+	{
+		U32 nodeIndex;
+		U32 depth;
+	};
+
+	stats.nodeCount = 0;
+	stats.leafCount = 0;
+	stats.maxDepth = 0;
+	for (U32 i = 0; i < BVH_STATS_LEAF_BUCKETS; i++)
+		stats.leafHistogram[i] = 0;
+
+	std::vector<F64> primitiveAreas(primitiveCount);
+	F64 totalArea = 0.0;
+	for (U32 i = 0; i < primitiveCount; i++)
+	{
+		primitiveAreas[i] = clippedArea(i, Float3(F32_NEG_INF), Float3(F32_INF));
+		totalArea += primitiveAreas[i];
+	}
+
+	// Nodes in depth first order, parents before children
+	std::vector<U32> order;
+	std::vector<StatsEntry> stack = { StatsEntry{ 0, 0 } };
+	U32 nodeRange = 1;
+	F64 depthSum = 0.0;
+	while (!stack.empty())
+	{
+		const StatsEntry entry = stack.back();
+		stack.pop_back();
+
+		const NodeType& node = nodePool[entry.nodeIndex];
+		order.push_back(entry.nodeIndex);
+		nodeRange = max(nodeRange, entry.nodeIndex + 1);
+
+		if (!node.isLeaf())
+		{
+			stack.push_back(StatsEntry{ node.left(), entry.depth + 1 });
+			stack.push_back(StatsEntry{ node.right(), entry.depth + 1 });
+			continue;
+		}
+
+		stats.leafCount++;
+		stats.maxDepth = max(stats.maxDepth, entry.depth);
+		depthSum += entry.depth;
+		stats.leafHistogram[min(node.count, static_cast<U32>(BVH_STATS_LEAF_BUCKETS - 1))]++;
+	}
+
+	stats.nodeCount = static_cast<U32>(order.size());
+	stats.averageDepth = static_cast<F32>(depthSum / stats.leafCount);
+
+	// Primitive area referenced below every node, summed up bottom up
+	std::vector<F64> subtreeAreas(nodeRange, 0.0);
+	for (SizeType i = order.size(); i-- > 0;)
+	{
+		const NodeType& node = nodePool[order[i]];
+		if (node.isLeaf())
+		{
+			for (U32 p = 0; p < node.count; p++)
+				subtreeAreas[order[i]] += primitiveAreas[indices[node.first() + p]];
+		}
+		else
+		{
+			subtreeAreas[order[i]] = subtreeAreas[node.left()] + subtreeAreas[node.right()];
+		}
+	}
+
+	// Primitive area inside every node, gathered by descending with every primitive into all nodes its bounds overlap
+	std::vector<F64> containedAreas(nodeRange, 0.0);
+	std::vector<U32> nodeStack;
+	for (U32 i = 0; i < primitiveCount; i++)
+	{
+		const auto bounds = primitiveBounds(i);
+
+		nodeStack.push_back(0);
+		while (!nodeStack.empty())
+		{
+			const U32 nodeIndex = nodeStack.back();
+			nodeStack.pop_back();
+
+			const NodeType& node = nodePool[nodeIndex];
+			if (bounds.bbMin.x > node.bbMax.x || bounds.bbMin.y > node.bbMax.y || bounds.bbMin.z > node.bbMax.z
+				|| bounds.bbMax.x < node.bbMin.x || bounds.bbMax.y < node.bbMin.y || bounds.bbMax.z < node.bbMin.z)
+				continue;
+
+			const bool contained = bounds.bbMin.x >= node.bbMin.x && bounds.bbMin.y >= node.bbMin.y && bounds.bbMin.z >= node.bbMin.z
+				&& bounds.bbMax.x <= node.bbMax.x && bounds.bbMax.y <= node.bbMax.y && bounds.bbMax.z <= node.bbMax.z;
+			containedAreas[nodeIndex] += contained ? primitiveAreas[i] : clippedArea(i, node.bbMin, node.bbMax);
+
+			if (!node.isLeaf())
+			{
+				nodeStack.push_back(node.left());
+				nodeStack.push_back(node.right());
+			}
+		}
+	}
+
+	const NodeType& root = nodePool[0];
+	const F64 rootArea = root.bounds().area();
+	F64 sahSum = 0.0;
+	F64 epoSum = 0.0;
+	F64 overlapSum = 0.0;
+	for (U32 nodeIndex : order)
+	{
+		const NodeType& node = nodePool[nodeIndex];
+		const F64 cost = node.isLeaf() ? leafCost(node.count) : 1.0;
+		sahSum += cost * node.bounds().area();
+		epoSum += cost * max(0.0f, static_cast<F32>(containedAreas[nodeIndex] - subtreeAreas[nodeIndex]));
+
+		if (!node.isLeaf())
+		{
+			const NodeType& left = nodePool[node.left()];
+			const NodeType& right = nodePool[node.right()];
+			const Float3 overlap = min(left.bbMax, right.bbMax) - max(left.bbMin, right.bbMin);
+			if (overlap.x > 0.0f && overlap.y > 0.0f && overlap.z > 0.0f)
+				overlapSum += overlap.x * overlap.y + overlap.y * overlap.z + overlap.z * overlap.x;
+		}
+	}
+
+	stats.sahCost = rootArea > 0.0 ? static_cast<F32>(sahSum / rootArea) : 0.0f;
+	stats.epo = totalArea > 0.0 ? static_cast<F32>(epoSum / totalArea) : 0.0f;
+	stats.siblingOverlap = rootArea > 0.0 ? static_cast<F32>(overlapSum / rootArea) : 0.0f;
+}
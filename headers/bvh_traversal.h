@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cassert>
+#include <immintrin.h>
+
+#include "ray.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define TRAVERSAL_STACK_SIZE	128
+#define TRAVERSAL_MAX_CHILDREN	4	// Largest branching factor of the supported node formats
+
+// Ray data precomputed once per traversal, rays transformed into instance space get their own record
+struct TraversalRay
+{
+	Float3 origin;
+	Float3 rDirection;
+	U32 octant;	// Direction sign bits, bit n is set if the direction is negative along axis n
+	U32 visibilityMask;	// Ray type, node formats with visibility masks skip children the ray type cannot see
+
+	// Broadcast ray data for 4 wide node formats
+	__m128 originX, originY, originZ;
+	__m128 rDirX, rDirY, rDirZ;
+
+	inline explicit TraversalRay(const Ray& ray);
+};
+
+// Node contents as stored on the traversal stack, an entry with count 0 references the children of an interior node
+struct TraversalEntry
+{
+	U32 leftFirst;
+	U32 count;
+	F32 distance;
+};
+
+TraversalRay::TraversalRay(const Ray& ray)
+	:
+	origin(ray.origin),
+	rDirection(Float3(1.0f) / ray.direction),
+	octant(0),
+	visibilityMask(ray.visibilityMask)
+{
+	octant |= ray.direction.x < 0.0f ? 1 : 0;
+	octant |= ray.direction.y < 0.0f ? 2 : 0;
+	octant |= ray.direction.z < 0.0f ? 4 : 0;
+
+	originX = _mm_set1_ps(origin.x);
+	originY = _mm_set1_ps(origin.y);
+	originZ = _mm_set1_ps(origin.z);
+	rDirX = _mm_set1_ps(rDirection.x);
+	rDirY = _mm_set1_ps(rDirection.y);
+	rDirZ = _mm_set1_ps(rDirection.z);
+}
+
+// Stack based traversal shared by all node formats, children are visited front to back.
+// A node format provides an intersectChildren(nodePool, leftFirst, traversalRay, depth, hits) overload, writing a TraversalEntry
+// for every child hit within the ray depth and returning the number of hits. Leaves are passed to intersectLeaf(ray, first, count),
+// which returns true if a primitive was hit. Any hit traversal terminates on the first leaf hit.
+template <bool AnyHit, typename NodeType, typename LeafFunc>
+inline bool traverseBvh(const NodeType* nodePool, TraversalEntry root, const TraversalRay& traversalRay, Ray& ray, LeafFunc intersectLeaf)
+{
+	assert(nodePool != nullptr);
+
+	TraversalEntry stack[TRAVERSAL_STACK_SIZE];
+	SizeType stackPtr = 0;
+	stack[stackPtr++] = root;
+
+	bool intersected = false;
+	while (stackPtr > 0)
+	{
+		const TraversalEntry entry = stack[--stackPtr];
+		if (entry.distance >= ray.depth)
+			continue;
+
+		if (entry.count != 0)
+		{
+			if (intersectLeaf(ray, entry.leftFirst, entry.count))
+			{
+				if (AnyHit)
+					return true;
+
+				intersected = true;
+			}
+
+			continue;
+		}
+
+		TraversalEntry hits[TRAVERSAL_MAX_CHILDREN];
+		SizeType hitCount = intersectChildren(nodePool, entry.leftFirst, traversalRay, ray.depth, hits);
+
+		// Sort hit children far to near, so the nearest child is popped first
+		for (SizeType i = 1; i < hitCount; i++)
+		{
+			const TraversalEntry child = hits[i];
+			SizeType slot = i;
+			while (slot > 0 && hits[slot - 1].distance < child.distance)
+			{
+				hits[slot] = hits[slot - 1];
+				slot--;
+			}
+
+			hits[slot] = child;
+		}
+
+		assert(stackPtr + hitCount <= TRAVERSAL_STACK_SIZE);
+		for (SizeType i = 0; i < hitCount; i++)
+			stack[stackPtr++] = hits[i];
+	}
+
+	return intersected;
+}
@@ -65,7 +65,7 @@ Ray Camera::getPrimaryRay(U32& seed, F32 x, F32 y)
 	const Float3 planePosition = viewPlane.firstPixel + u * viewPlane.uVector + v * viewPlane.vVector;
 	Float3 direction = (planePosition - origin).normalize();
 
-	return Ray(origin, direction);
+	return Ray(origin, direction, VISIBILITY_CAMERA);
 }
 
 inline Float3 Camera::sampleDefocusDisk(U32& seed)
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "bvh.h"
+#include "material.h"
+#include "mesh.h"
+#include "types.h"
+
+#define FLATTEN_MAX_DUPLICATED_TRIS	65536	// Static instances of a BLAS are only baked while their copies add at most this many triangles
+
+// Bakes static instances into world space BLASses, removing a TLAS level & a ray transform for most static geometry.
+// Materials & visibility masks are bound per instance, so static instances are merged per material & mask, into a single
+// BLAS each. Animated instances, truly instanced BLASses & instances without another static instance to merge with are kept.
+// Owns the baked meshes & BLASses, so it must outlive every scene built from its instances.
+class InstanceFlattener
+{
+public:
+	InstanceFlattener(const std::vector<Instance>& instances, BvhBuildMode buildMode = BvhBuildMode::BinnedSAH);
+
+	// Kept instances in their original order, followed by one identity transform instance per baked group
+	inline const std::vector<Instance>& instances() const { return m_instances; }
+
+	inline U32 bakedInstanceCount() const { return m_bakedInstanceCount; }
+
+private:
+	std::vector<std::unique_ptr<Mesh>> m_meshes;
+	std::vector<std::unique_ptr<BvhBLAS>> m_blasses;
+	std::vector<Instance> m_instances;
+	U32 m_bakedInstanceCount;
+};
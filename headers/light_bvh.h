@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+
+#include "bvh.h"
+#include "mesh.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define LIGHT_BVH_BINS	12	// Split candidates per axis, evaluated with the surface area orientation heuristic
+#define NEE_LIGHT_BVH	1	// Pick NEE emitters with the light BVH, 0 picks them by power & area through alias tables. Must match light_bvh.glsl
+
+// Spatial & directional bounds of a set of emitters, gathered while building
+struct LightBounds
+{
+	AABB bounds;
+	Float3 axis			= Float3(0.0f);
+	F32 cosThetaO		= 1.0f;
+	F32 cosThetaE		= 1.0f;
+	F32 power			= 0.0f;
+	U32 count			= 0;
+
+	void grow(const LightBounds& other);
+
+	// Surface area orientation heuristic weight, power times the bounds area & the solid angle the emission cone covers
+	F32 cost() const;
+};
+
+// Bounds of the positions, emission directions & power of the emitters below a node. Leaves hold a single emitter primitive.
+// Matches the std430 GLSL LightNode.
+struct LightBvhNode
+{
+	ALIGN(16) Float3 bbMin;
+	ALIGN(4)  U32 left;				// Left child of interior nodes, the right child follows it. Emitter index of leaves
+	ALIGN(16) Float3 bbMax;
+	ALIGN(4)  F32 power;			// Summed emitted power of the emitters below
+	ALIGN(16) Float3 axis;			// Axis of the cone bounding all emitter normals below
+	ALIGN(4)  F32 cosThetaO;		// Cosine of the normal cone spread, -1 bounds every direction
+	ALIGN(4)  F32 cosThetaE;		// Cosine of the emission spread around the normals, 0 for one sided diffuse emitters
+	ALIGN(4)  U32 instanceIndex;	// Instance & primitive of the leaf emitter, UNSET_INDEX for interior nodes
+	ALIGN(4)  U32 primitiveIndex;
+
+	inline bool isLeaf() const { return instanceIndex != UNSET_INDEX; }
+
+	// Conservative estimate of the light reaching a diffuse receiver at position with normal, 0 if none can reach it
+	F32 importance(const Float3& position, const Float3& normal) const;
+};
+
+static_assert(sizeof(LightBvhNode) == 64, "LightBvhNode must match the GLSL LightNode layout");
+
+struct EmitterSample
+{
+	Float3 position;
+	Float3 normal;
+	RgbColor emittance;
+	F32 pdf;			// Area measure, probability of picking the emitter over its world space area
+	U32 instanceIndex;
+};
+
+// BVH over the world space emissive primitives of all light instances, picking emitters for next event estimation
+// proportional to their estimated contribution instead of uniformly, so scenes with many lights stay low noise.
+class LightBvh
+{
+public:
+	LightBvh();
+
+	explicit LightBvh(const std::vector<Instance>& instances);
+
+	// Rebuilds over the current transforms, call after moving a light instance
+	void build(const std::vector<Instance>& instances);
+
+	// Descends from the root picking children by importance, then picks a uniform point on the leaf emitter,
+	// or on the part of a sphere emitter visible from the receiver.
+	// Returns false if there are no emitters or none of them can light the receiver.
+	bool sample(U32& seed, const Float3& position, const Float3& normal, EmitterSample& sample) const;
+
+	inline const std::vector<LightBvhNode>& nodes() const { return m_nodes; }
+
+	inline U32 emitterCount() const { return static_cast<U32>(m_emitters.size()); }
+
+private:
+	struct Emitter
+	{
+		Float3 v0, v1, v2;	// World space vertices & normals of triangles
+		Float3 n0, n1, n2;
+		PrimitiveType type;
+		AnalyticPrimitive analytic;	// World space primitive of analytic emitters
+		RgbColor emittance;
+		F32 area;
+		U32 instanceIndex;
+		U32 primitiveIndex;
+	};
+
+	void buildNode(const LightBounds* emitterBounds, U32* emitterIndices, U32 nodeIndex, U32 first, U32 count);
+
+private:
+	std::vector<Emitter> m_emitters;
+	std::vector<LightBvhNode> m_nodes;
+	U32 m_nodesUsed;
+};
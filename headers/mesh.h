@@ -14,7 +14,6 @@ struct Triangle
 	ALIGN(16) Float3 v0;
 	ALIGN(16) Float3 v1;
 	ALIGN(16) Float3 v2;
-	ALIGN(16) Float3 centroid;
 
 	Triangle(Float3 v1, Float3 v0, Float3 v2);
 
@@ -29,11 +28,73 @@ struct TriExtension
 	ALIGN(8)  Float2 uv0, uv1, uv2;
 };
 
+// Primitive type of all primitives in a mesh. Must match bvh.glsl
+enum class PrimitiveType : U32
+{
+	Triangle	= 0,
+	Sphere		= 1,
+	Quad		= 2,	// Parallelogram spanned by 2 edges from a corner
+	Disk		= 3,	// Ellipse spanned by 2 radius vectors from the center, a circle when they are orthogonal & equally long
+};
+
+// Procedural primitive, intersected & sampled exactly instead of tessellated into triangles.
+// Hit coordinates parameterize the surface & double as texture coordinates: (s, t) along the quad edges,
+// (radius, angle / 2pi) on disks & (polar angle / pi, azimuth / 2pi) on spheres.
+// Shares the layout of Triangle, so analytic meshes are uploaded to the GPU through the triangle buffers.
+struct AnalyticPrimitive
+{
+	ALIGN(16) Float3 origin;	// Sphere & disk center, quad corner
+	ALIGN(16) Float3 u;			// Quad edges & disk radius vectors, spheres store their radius in u.x
+	ALIGN(16) Float3 v;
+
+	static AnalyticPrimitive sphere(const Float3& center, F32 radius);
+
+	static AnalyticPrimitive quad(const Float3& corner, const Float3& edgeU, const Float3& edgeV);
+
+	static AnalyticPrimitive disk(const Float3& center, const Float3& normal, F32 radius);
+
+	bool intersect(PrimitiveType type, Ray& ray) const;
+
+	void bounds(PrimitiveType type, Float3& bbMin, Float3& bbMax) const;
+
+	F32 area(PrimitiveType type) const;
+
+	Float3 position(PrimitiveType type, const Float2& coordinates) const;
+
+	Float3 normal(PrimitiveType type, const Float2& coordinates) const;
+
+	// Same primitive after an affine transform. Quads & disks stay exact, spheres assume a uniform scale
+	AnalyticPrimitive transformed(PrimitiveType type, const Mat3x4& transform) const;
+
+	// Maps 2 uniform random numbers to hit coordinates distributed uniformly over the surface area
+	static Float2 sampleCoordinates(PrimitiveType type, F32 random0, F32 random1);
+
+	// Samples the cap of a sphere visible from the receiver uniformly by solid angle, returns the area measure density of the
+	// sampled point. Receivers inside the sphere see all of it & get a point uniform over its area instead
+	F32 sampleSphereCap(const Float3& receiver, F32 random0, F32 random1, Float3& position, Float3& normal) const;
+};
+
+static_assert(sizeof(AnalyticPrimitive) == sizeof(Triangle), "AnalyticPrimitive must match the Triangle layout");
+
 class Mesh
 {
 public:
 	Mesh(const std::string& path);
 
+	Mesh(std::vector<Triangle> triangles, std::vector<TriExtension> triExtensions);
+
+	Mesh(PrimitiveType primitiveType, std::vector<AnalyticPrimitive> analyticPrimitives);
+
+	inline bool isAnalytic() const { return primitiveType != PrimitiveType::Triangle; }
+
+	inline SizeType primitiveCount() const { return isAnalytic() ? analyticPrimitives.size() : triangles.size(); }
+
+	inline bool intersect(SizeType primitiveIndex, Ray& ray) const;
+
+	inline void bounds(SizeType primitiveIndex, Float3& bbMin, Float3& bbMax) const;
+
+	inline F32 area(SizeType primitiveIndex) const;
+
 	inline Float3 normal(SizeType primitiveIndex) const;
 
 	inline Float3 position(SizeType primitiveIndex, const Float2& barycentric) const;
@@ -43,18 +104,70 @@ public:
 	inline Float2 textureCoordinate(SizeType primitiveIndex, const Float2& barycentric) const;
 
 public:
+	PrimitiveType primitiveType;
 	std::vector<Triangle> triangles;
 	std::vector<TriExtension> triExtensions;
+	std::vector<AnalyticPrimitive> analyticPrimitives;	// Primitives of analytic meshes, which hold no triangles
 };
 
+bool Mesh::intersect(SizeType primitiveIndex, Ray& ray) const
+{
+	if (isAnalytic())
+	{
+		assert(primitiveIndex < analyticPrimitives.size());
+		return analyticPrimitives[primitiveIndex].intersect(primitiveType, ray);
+	}
+
+	assert(primitiveIndex < triangles.size());
+	return triangles[primitiveIndex].intersect(ray);
+}
+
+void Mesh::bounds(SizeType primitiveIndex, Float3& bbMin, Float3& bbMax) const
+{
+	if (isAnalytic())
+	{
+		assert(primitiveIndex < analyticPrimitives.size());
+		analyticPrimitives[primitiveIndex].bounds(primitiveType, bbMin, bbMax);
+		return;
+	}
+
+	assert(primitiveIndex < triangles.size());
+	const Triangle& tri = triangles[primitiveIndex];
+	bbMin = min(tri.v0, min(tri.v1, tri.v2));
+	bbMax = max(tri.v0, max(tri.v1, tri.v2));
+}
+
+F32 Mesh::area(SizeType primitiveIndex) const
+{
+	if (isAnalytic())
+	{
+		assert(primitiveIndex < analyticPrimitives.size());
+		return analyticPrimitives[primitiveIndex].area(primitiveType);
+	}
+
+	assert(primitiveIndex < triangles.size());
+	const Triangle& tri = triangles[primitiveIndex];
+	return 0.5f * (tri.v1 - tri.v0).cross(tri.v2 - tri.v0).magnitude();
+}
+
 Float3 Mesh::normal(SizeType primitiveIndex) const
 {
+	// Analytic primitives are curved or lack a corner to derive it from, their normal is taken at the center of the parameterization
+	if (isAnalytic())
+		return normal(primitiveIndex, Float2(0.5f, 0.5f));
+
 	assert(primitiveIndex < triangles.size());
 	return triangles[primitiveIndex].normal();
 }
 
 Float3 Mesh::position(SizeType primitiveIndex, const Float2& barycentric) const
 {
+	if (isAnalytic())
+	{
+		assert(primitiveIndex < analyticPrimitives.size());
+		return analyticPrimitives[primitiveIndex].position(primitiveType, barycentric);
+	}
+
 	assert(primitiveIndex < triangles.size());
 	const Triangle& tri = triangles[primitiveIndex];
 	return barycentric.u * tri.v0 + barycentric.v * tri.v2 + (1.0f - barycentric.u - barycentric.v) * tri.v1;
@@ -62,6 +175,12 @@ Float3 Mesh::position(SizeType primitiveIndex, const Float2& barycentric) const
 
 Float3 Mesh::normal(SizeType primitiveIndex, const Float2& barycentric) const
 {
+	if (isAnalytic())
+	{
+		assert(primitiveIndex < analyticPrimitives.size());
+		return analyticPrimitives[primitiveIndex].normal(primitiveType, barycentric);
+	}
+
 	assert(primitiveIndex < triangles.size());
 	const TriExtension& ext = triExtensions[primitiveIndex];
 	return barycentric.u * ext.n0 + barycentric.v * ext.n2 + (1.0f - barycentric.u - barycentric.v) * ext.n1;
@@ -69,6 +188,9 @@ Float3 Mesh::normal(SizeType primitiveIndex, const Float2& barycentric) const
 
 Float2 Mesh::textureCoordinate(SizeType primitiveIndex, const Float2& barycentric) const
 {
+	if (isAnalytic())
+		return barycentric;
+
 	assert(primitiveIndex < triangles.size());
 	const TriExtension& ext = triExtensions[primitiveIndex];
 	return barycentric.u * ext.uv0 + barycentric.v * ext.uv2 + (1.0f - barycentric.u - barycentric.v) * ext.uv1;
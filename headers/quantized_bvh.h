@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <immintrin.h>
+
+#include "bvh_traversal.h"
+#include "ray.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+#include "wide_bvh.h"
+
+// 4 wide BVH node with child bounds quantized relative to the bounds of the node itself.
+// A child bound is decoded as origin + q * scale, quantized minima are rounded down and maxima rounded up so
+// decoded boxes always contain the original child bounds. Unused child slots have leftFirst and count set to 0.
+template <typename QuantType>
+struct ALIGN(16) QuantizedBvhNode
+{
+	U32 leftFirst[WIDE_BVH_WIDTH];	// Quantized node index for interior children, first primitive index or leaf block for leaves
+	U32 count[WIDE_BVH_WIDTH];		// Primitive count for leaf children, 0 for interior children
+	F32 origin[3];
+	F32 scale[3];
+	QuantType qMinX[WIDE_BVH_WIDTH];
+	QuantType qMinY[WIDE_BVH_WIDTH];
+	QuantType qMinZ[WIDE_BVH_WIDTH];
+	QuantType qMaxX[WIDE_BVH_WIDTH];
+	QuantType qMaxY[WIDE_BVH_WIDTH];
+	QuantType qMaxZ[WIDE_BVH_WIDTH];
+};
+
+// Compressed variant of WideBvh, trading a few instructions per node visit for a smaller node footprint.
+// Supports 8 bit (U8) and 16 bit (U16) quantization.
+template <typename QuantType>
+class QuantizedWideBvh
+{
+public:
+	typedef QuantizedBvhNode<QuantType> NodeType;
+
+	QuantizedWideBvh();
+
+	~QuantizedWideBvh();
+
+	QuantizedWideBvh(const QuantizedWideBvh& other) noexcept;
+	QuantizedWideBvh& operator=(const QuantizedWideBvh& other) noexcept;
+
+	// Exchanges the node pools without copying them
+	void swap(QuantizedWideBvh& other) noexcept;
+
+	void collapse(const BvhNode* nodePool, U32 nodesUsed);
+
+	template <bool AnyHit, typename LeafFunc>
+	inline bool intersect(Ray& ray, const TraversalRay& traversalRay, LeafFunc intersectLeaf) const;
+
+	// Replaces the first primitive of every leaf child with remapLeaf(leftFirst, count), called in node pool order
+	template <typename LeafFunc>
+	inline void remapLeaves(LeafFunc remapLeaf);
+
+	inline const U32 nodesUsed() const { return m_nodesUsed; }
+	inline const NodeType* nodePool() const { return m_nodePool; }
+	inline const SizeType memoryUsage() const { return m_nodesUsed * sizeof(NodeType); }
+
+private:
+	U32 collapseNode(const BvhNode* nodePool, U32 nodeIndex);
+
+	void release();
+
+private:
+	U32 m_nodeCapacity;
+	U32 m_nodesUsed;
+	NodeType* m_nodePool;
+};
+
+inline __m128i loadQuantized(const U8* values)
+{
+	I32 packed = 0;
+	memcpy(&packed, values, WIDE_BVH_WIDTH * sizeof(U8));
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+}
+
+inline __m128i loadQuantized(const U16* values)
+{
+	return _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(values)));
+}
+
+inline __m128 decodeQuantized(__m128i quantized, __m128 origin, __m128 scale)
+{
+	return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(quantized), scale));
+}
+
+template <typename QuantType>
+inline I32 intersectWideNode(const QuantizedBvhNode<QuantType>& node, const TraversalRay& traversalRay, F32 depth, __m128& tNear)
+{
+	const __m128 originX = _mm_set1_ps(node.origin[0]);
+	const __m128 originY = _mm_set1_ps(node.origin[1]);
+	const __m128 originZ = _mm_set1_ps(node.origin[2]);
+	const __m128 scaleX = _mm_set1_ps(node.scale[0]);
+	const __m128 scaleY = _mm_set1_ps(node.scale[1]);
+	const __m128 scaleZ = _mm_set1_ps(node.scale[2]);
+
+	I32 mask = intersectWideBounds(
+		traversalRay, depth,
+		decodeQuantized(loadQuantized(node.qMinX), originX, scaleX),
+		decodeQuantized(loadQuantized(node.qMinY), originY, scaleY),
+		decodeQuantized(loadQuantized(node.qMinZ), originZ, scaleZ),
+		decodeQuantized(loadQuantized(node.qMaxX), originX, scaleX),
+		decodeQuantized(loadQuantized(node.qMaxY), originY, scaleY),
+		decodeQuantized(loadQuantized(node.qMaxZ), originZ, scaleZ),
+		tNear
+	);
+
+	// Decoded empty slots are not rejected by the slab test, so they are masked out by their child reference
+	const __m128i leftFirst = _mm_load_si128(reinterpret_cast<const __m128i*>(node.leftFirst));
+	const __m128i count = _mm_load_si128(reinterpret_cast<const __m128i*>(node.count));
+	const __m128i unused = _mm_cmpeq_epi32(_mm_or_si128(leftFirst, count), _mm_setzero_si128());
+	mask &= ~_mm_movemask_ps(_mm_castsi128_ps(unused));
+
+	return mask;
+}
+
+template <typename QuantType>
+inline SizeType intersectChildren(const QuantizedBvhNode<QuantType>* nodePool, U32 nodeIndex, const TraversalRay& traversalRay, F32 depth, TraversalEntry* hits)
+{
+	const QuantizedBvhNode<QuantType>& node = nodePool[nodeIndex];
+
+	__m128 tNear;
+	I32 mask = intersectWideNode(node, traversalRay, depth, tNear);
+
+	return gatherWideHits(node, mask, tNear, hits);
+}
+
+template <typename QuantType>
+template <bool AnyHit, typename LeafFunc>
+bool QuantizedWideBvh<QuantType>::intersect(Ray& ray, const TraversalRay& traversalRay, LeafFunc intersectLeaf) const
+{
+	return traverseBvh<AnyHit>(m_nodePool, TraversalEntry{ WIDE_BVH_ROOT_INDEX, 0, 0.0f }, traversalRay, ray, intersectLeaf);
+}
+
+template <typename QuantType>
+template <typename LeafFunc>
+void QuantizedWideBvh<QuantType>::remapLeaves(LeafFunc remapLeaf)
+{
+	for (U32 nodeIndex = 0; nodeIndex < m_nodesUsed; nodeIndex++)
+	{
+		NodeType& node = m_nodePool[nodeIndex];
+		for (U32 i = 0; i < WIDE_BVH_WIDTH; i++)
+		{
+			if (node.count[i] != 0)
+				node.leftFirst[i] = remapLeaf(node.leftFirst[i], node.count[i]);
+		}
+	}
+}
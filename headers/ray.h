@@ -5,11 +5,18 @@
 
 #define UNSET_INDEX (U32)(~0)
 
+// Ray types, rays only intersect instances with their type set in the instance visibility mask. Must match wavefront_common.glsl
+#define VISIBILITY_CAMERA	(1 << 0)	// Primary rays
+#define VISIBILITY_INDIRECT	(1 << 1)	// Bounce rays
+#define VISIBILITY_SHADOW	(1 << 2)	// Next event estimation shadow rays
+#define VISIBILITY_ALL		0xFF		// Every ray type, masks hold 8 bits
+
 struct GPURayState
 {
 	ALIGN(4) bool inMedium;
 	ALIGN(4) bool lastSpecular;
 	ALIGN(4) U32 pixelIdx;
+	ALIGN(4) U32 visibilityMask;	// Ray type, see VISIBILITY_*
 };
 
 struct GPURayHit
@@ -17,6 +24,7 @@ struct GPURayHit
 	ALIGN(4) U32 instanceIdx;
 	ALIGN(4) U32 primitiveIdx;
 	ALIGN(8) Float2 hitCoords;
+	ALIGN(4) U32 nestedInstanceIdx;	// Member of the assembly instanceIdx that was hit, UNSET_INDEX for mesh instances
 };
 
 struct GPURay
@@ -39,6 +47,7 @@ struct GPUShadowRayMetadata
 	ALIGN(16) Float3 N;
 	ALIGN(4) U32 hitInstanceIdx;
 	ALIGN(4) U32 lightInstanceIdx;
+	ALIGN(4) F32 lightPdf;	// Area measure
 };
 
 struct RayMetadata
@@ -46,6 +55,7 @@ struct RayMetadata
 	U32 primitiveIndex		= UNSET_INDEX;
 	U32 instanceIndex		= UNSET_INDEX;
 	Float2 hitCoordinates	= Float2(0.0f, 0.0f);
+	U32 nestedInstanceIndex	= UNSET_INDEX;	// Member hit inside the assembly instanceIndex, UNSET_INDEX for mesh instances
 };
 
 struct Ray
@@ -54,9 +64,10 @@ struct Ray
 	F32 depth;
 	Float3 direction;
 	bool inMedium;
+	U8 visibilityMask;	// Ray type, see VISIBILITY_*. Untyped rays see every instance visible to any ray type
 	RayMetadata metadata;
 
-	Ray(Float3 origin, Float3 direction);
+	Ray(Float3 origin, Float3 direction, U8 visibilityMask = VISIBILITY_ALL);
 
 	inline Float3 hitPosition();
 };
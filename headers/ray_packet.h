@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cassert>
+#include <immintrin.h>
+
+#include "bvh_traversal.h"
+#include "ray.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define RAY_PACKET_WIDTH	8	// Packets cover square pixel tiles of this width, 8x8 or 16x16 tiles are coherent enough for primary rays
+#define RAY_PACKET_SIZE		(RAY_PACKET_WIDTH * RAY_PACKET_WIDTH)
+#define RAY_PACKET_LANES	(RAY_PACKET_SIZE / 4)
+
+// Coherent packet of rays stored as 4 wide SoA lanes, hit results use the same conventions as the per ray metadata.
+// Partially filled packets are padded with copies of the first ray that can never register a hit.
+struct ALIGN(16) RayPacket
+{
+	__m128 originX[RAY_PACKET_LANES], originY[RAY_PACKET_LANES], originZ[RAY_PACKET_LANES];
+	__m128 directionX[RAY_PACKET_LANES], directionY[RAY_PACKET_LANES], directionZ[RAY_PACKET_LANES];
+	__m128 rDirX[RAY_PACKET_LANES], rDirY[RAY_PACKET_LANES], rDirZ[RAY_PACKET_LANES];
+	__m128 depth[RAY_PACKET_LANES];
+	__m128 hitU[RAY_PACKET_LANES], hitV[RAY_PACKET_LANES];
+	__m128i primitiveIndex[RAY_PACKET_LANES];
+	__m128i instanceIndex[RAY_PACKET_LANES];
+	__m128i nestedInstanceIndex[RAY_PACKET_LANES];
+
+	U32 rayCount;
+	U32 laneCount;
+	U8 visibilityMask;	// Ray type, shared by all rays of the packet
+
+	// Interval bounds over all rays, only valid for culling if the packet is coherent
+	__m128 originMin, originMax;
+	__m128 rDirMin, rDirMax;
+	__m128 octantMask;	// Lane n is set if the average direction is negative along axis n
+	U32 octant;
+	bool coherent;		// All rays share the same direction signs
+
+	RayPacket(const Ray* rays, U32 count);
+
+	// Copy of a packet transformed by an affine matrix, used to move a packet into instance space
+	RayPacket(const RayPacket& packet, const Mat3x4& transform);
+
+	void store(Ray* rays) const;
+
+	void copyHits(const RayPacket& other);
+
+	inline I32 intersectBounds(U32 lane, __m128 bbMin, __m128 bbMax) const;
+
+	inline bool missesBounds(U32 firstActive, __m128 bbMin, __m128 bbMax) const;
+
+	inline U32 firstActiveLane(U32 firstActive, const F32* bbMin, const F32* bbMax) const;
+
+	inline void intersectTriangle(U32 firstActive, const F32* v0, const F32* v1, const F32* v2, U32 primitiveIndex);
+
+private:
+	void updateTraversalData();
+};
+
+// Slab test of the 4 rays in a lane against a box, returns a bit per ray that hits the box within its depth
+I32 RayPacket::intersectBounds(U32 lane, __m128 bbMin, __m128 bbMax) const
+{
+	const __m128 t1X = _mm_mul_ps(_mm_sub_ps(_mm_shuffle_ps(bbMin, bbMin, _MM_SHUFFLE(0, 0, 0, 0)), originX[lane]), rDirX[lane]);
+	const __m128 t2X = _mm_mul_ps(_mm_sub_ps(_mm_shuffle_ps(bbMax, bbMax, _MM_SHUFFLE(0, 0, 0, 0)), originX[lane]), rDirX[lane]);
+	const __m128 t1Y = _mm_mul_ps(_mm_sub_ps(_mm_shuffle_ps(bbMin, bbMin, _MM_SHUFFLE(1, 1, 1, 1)), originY[lane]), rDirY[lane]);
+	const __m128 t2Y = _mm_mul_ps(_mm_sub_ps(_mm_shuffle_ps(bbMax, bbMax, _MM_SHUFFLE(1, 1, 1, 1)), originY[lane]), rDirY[lane]);
+	const __m128 t1Z = _mm_mul_ps(_mm_sub_ps(_mm_shuffle_ps(bbMin, bbMin, _MM_SHUFFLE(2, 2, 2, 2)), originZ[lane]), rDirZ[lane]);
+	const __m128 t2Z = _mm_mul_ps(_mm_sub_ps(_mm_shuffle_ps(bbMax, bbMax, _MM_SHUFFLE(2, 2, 2, 2)), originZ[lane]), rDirZ[lane]);
+
+	const __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1X, t2X), _mm_min_ps(t1Y, t2Y)), _mm_min_ps(t1Z, t2Z));
+	const __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1X, t2X), _mm_max_ps(t1Y, t2Y)), _mm_max_ps(t1Z, t2Z));
+
+	const __m128 hit = _mm_and_ps(
+		_mm_and_ps(_mm_cmpge_ps(tFar, tNear), _mm_cmplt_ps(tNear, depth[lane])),
+		_mm_cmpgt_ps(tFar, _mm_setzero_ps())
+	);
+
+	return _mm_movemask_ps(hit);
+}
+
+// Conservative interval arithmetic test of all active rays against a box, returns true only if no ray can hit the box.
+// Near and far planes are selected by the shared direction signs, so the test is only valid for coherent packets.
+bool RayPacket::missesBounds(U32 firstActive, __m128 bbMin, __m128 bbMax) const
+{
+	assert(coherent);
+
+	const __m128 nearPlane = _mm_blendv_ps(bbMin, bbMax, octantMask);
+	const __m128 farPlane = _mm_blendv_ps(bbMax, bbMin, octantMask);
+
+	const __m128 nearMin = _mm_sub_ps(nearPlane, originMax);
+	const __m128 nearMax = _mm_sub_ps(nearPlane, originMin);
+	const __m128 farMin = _mm_sub_ps(farPlane, originMax);
+	const __m128 farMax = _mm_sub_ps(farPlane, originMin);
+
+	// Lower bound of the entry distance & upper bound of the exit distance per axis over all origin & direction combinations
+	const __m128 tNear = _mm_min_ps(
+		_mm_min_ps(_mm_mul_ps(nearMin, rDirMin), _mm_mul_ps(nearMin, rDirMax)),
+		_mm_min_ps(_mm_mul_ps(nearMax, rDirMin), _mm_mul_ps(nearMax, rDirMax))
+	);
+	const __m128 tFar = _mm_max_ps(
+		_mm_max_ps(_mm_mul_ps(farMin, rDirMin), _mm_mul_ps(farMin, rDirMax)),
+		_mm_max_ps(_mm_mul_ps(farMax, rDirMin), _mm_mul_ps(farMax, rDirMax))
+	);
+
+	ALIGN(16) F32 nearAxes[4];
+	ALIGN(16) F32 farAxes[4];
+	_mm_store_ps(nearAxes, tNear);
+	_mm_store_ps(farAxes, tFar);
+
+	const F32 entry = max(nearAxes[0], max(nearAxes[1], nearAxes[2]));
+	const F32 exit = min(farAxes[0], min(farAxes[1], farAxes[2]));
+	if (entry > exit || exit <= 0.0f)
+		return true;
+
+	__m128 maxDepth = depth[firstActive];
+	for (U32 lane = firstActive + 1; lane < laneCount; lane++)
+		maxDepth = _mm_max_ps(maxDepth, depth[lane]);
+
+	ALIGN(16) F32 depths[4];
+	_mm_store_ps(depths, maxDepth);
+	return entry >= max(max(depths[0], depths[1]), max(depths[2], depths[3]));
+}
+
+// Finds the first lane starting at firstActive with a ray hitting the box, returns laneCount if no ray hits it.
+// Early hits of the first active lane are the common case, the interval test rejects misses of the whole packet early.
+U32 RayPacket::firstActiveLane(U32 firstActive, const F32* bbMin, const F32* bbMax) const
+{
+	// Packed nodes store integer node data in the 4th lane, it is cleared so it never turns into denormal arithmetic
+	const __m128 boundsMin = _mm_blend_ps(_mm_load_ps(bbMin), _mm_setzero_ps(), 8);
+	const __m128 boundsMax = _mm_blend_ps(_mm_load_ps(bbMax), _mm_setzero_ps(), 8);
+
+	if (intersectBounds(firstActive, boundsMin, boundsMax) != 0)
+		return firstActive;
+
+	if (coherent && missesBounds(firstActive, boundsMin, boundsMax))
+		return laneCount;
+
+	for (U32 lane = firstActive + 1; lane < laneCount; lane++)
+	{
+		if (intersectBounds(lane, boundsMin, boundsMax) != 0)
+			return lane;
+	}
+
+	return laneCount;
+}
+
+// Moller-Trumbore test of all active rays against a single triangle, 4 rays at a time.
+// Matches Triangle::intersect, hits update the depth, hit coordinates & primitive index of the ray.
+void RayPacket::intersectTriangle(U32 firstActive, const F32* v0, const F32* v1, const F32* v2, U32 primitive)
+{
+	const __m128 vertex0 = _mm_load_ps(v0);
+	const __m128 edge1 = _mm_sub_ps(_mm_load_ps(v1), vertex0);
+	const __m128 edge2 = _mm_sub_ps(_mm_load_ps(v2), vertex0);
+
+	const __m128 v0X = _mm_shuffle_ps(vertex0, vertex0, _MM_SHUFFLE(0, 0, 0, 0));
+	const __m128 v0Y = _mm_shuffle_ps(vertex0, vertex0, _MM_SHUFFLE(1, 1, 1, 1));
+	const __m128 v0Z = _mm_shuffle_ps(vertex0, vertex0, _MM_SHUFFLE(2, 2, 2, 2));
+	const __m128 e1X = _mm_shuffle_ps(edge1, edge1, _MM_SHUFFLE(0, 0, 0, 0));
+	const __m128 e1Y = _mm_shuffle_ps(edge1, edge1, _MM_SHUFFLE(1, 1, 1, 1));
+	const __m128 e1Z = _mm_shuffle_ps(edge1, edge1, _MM_SHUFFLE(2, 2, 2, 2));
+	const __m128 e2X = _mm_shuffle_ps(edge2, edge2, _MM_SHUFFLE(0, 0, 0, 0));
+	const __m128 e2Y = _mm_shuffle_ps(edge2, edge2, _MM_SHUFFLE(1, 1, 1, 1));
+	const __m128 e2Z = _mm_shuffle_ps(edge2, edge2, _MM_SHUFFLE(2, 2, 2, 2));
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 epsilon = _mm_set1_ps(F32_EPSILON);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128i primitiveIdx = _mm_set1_epi32(static_cast<I32>(primitive));
+
+	for (U32 lane = firstActive; lane < laneCount; lane++)
+	{
+		// h = direction x e2
+		const __m128 hX = _mm_sub_ps(_mm_mul_ps(directionY[lane], e2Z), _mm_mul_ps(directionZ[lane], e2Y));
+		const __m128 hY = _mm_sub_ps(_mm_mul_ps(directionZ[lane], e2X), _mm_mul_ps(directionX[lane], e2Z));
+		const __m128 hZ = _mm_sub_ps(_mm_mul_ps(directionX[lane], e2Y), _mm_mul_ps(directionY[lane], e2X));
+		const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1X, hX), _mm_mul_ps(e1Y, hY)), _mm_mul_ps(e1Z, hZ));
+
+		__m128 mask = _mm_cmpge_ps(_mm_and_ps(a, absMask), epsilon);
+		if (_mm_movemask_ps(mask) == 0)
+			continue;
+
+		const __m128 f = _mm_div_ps(one, a);
+		const __m128 sX = _mm_sub_ps(originX[lane], v0X);
+		const __m128 sY = _mm_sub_ps(originY[lane], v0Y);
+		const __m128 sZ = _mm_sub_ps(originZ[lane], v0Z);
+		const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sX, hX), _mm_mul_ps(sY, hY)), _mm_mul_ps(sZ, hZ)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+		// q = s x e1
+		const __m128 qX = _mm_sub_ps(_mm_mul_ps(sY, e1Z), _mm_mul_ps(sZ, e1Y));
+		const __m128 qY = _mm_sub_ps(_mm_mul_ps(sZ, e1X), _mm_mul_ps(sX, e1Z));
+		const __m128 qZ = _mm_sub_ps(_mm_mul_ps(sX, e1Y), _mm_mul_ps(sY, e1X));
+		const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX[lane], qX), _mm_mul_ps(directionY[lane], qY)), _mm_mul_ps(directionZ[lane], qZ)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+		const __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2X, qX), _mm_mul_ps(e2Y, qY)), _mm_mul_ps(e2Z, qZ)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, epsilon), _mm_cmplt_ps(t, depth[lane])));
+
+		if (_mm_movemask_ps(mask) == 0)
+			continue;
+
+		depth[lane] = _mm_blendv_ps(depth[lane], t, mask);
+		hitU[lane] = _mm_blendv_ps(hitU[lane], u, mask);
+		hitV[lane] = _mm_blendv_ps(hitV[lane], v, mask);
+		primitiveIndex[lane] = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(primitiveIndex[lane]), _mm_castsi128_ps(primitiveIdx), mask));
+	}
+}
+
+// Packet counterpart of traverseBvh over binary nodes, children are visited front to back along the average packet direction.
+// Every stack entry carries the first lane that may still hit the node, lanes before it are skipped for the whole subtree.
+// Traversal starts at the lane firstActive, e.g. when a packet enters an instance that earlier lanes already missed.
+// Leaves are passed to intersectLeaf(packet, first, count, firstActive).
+template <typename NodeType, typename LeafFunc>
+inline void traversePacket(const NodeType* nodePool, U32 rootIndex, U32 firstActive, RayPacket& packet, LeafFunc intersectLeaf)
+{
+	assert(nodePool != nullptr);
+
+	struct PacketEntry
+	{
+		U32 nodeIndex;
+		U32 firstActive;
+	};
+
+	PacketEntry stack[TRAVERSAL_STACK_SIZE];
+	SizeType stackPtr = 0;
+	stack[stackPtr++] = PacketEntry{ rootIndex, firstActive };
+
+	while (stackPtr > 0)
+	{
+		const PacketEntry entry = stack[--stackPtr];
+		const NodeType& node = nodePool[entry.nodeIndex];
+
+		const U32 nodeFirstActive = packet.firstActiveLane(entry.firstActive, node.bbMin.xyz, node.bbMax.xyz);
+		if (nodeFirstActive == packet.laneCount)
+			continue;
+
+		if (node.isLeaf())
+		{
+			intersectLeaf(packet, node.first(), node.count, nodeFirstActive);
+			continue;
+		}
+
+		// Order children by the packet direction along the axis that separates their centers the most
+		const NodeType& left = nodePool[node.left()];
+		const NodeType& right = nodePool[node.right()];
+		const Float3 separation = (right.bbMin + right.bbMax) - (left.bbMin + left.bbMax);
+		const Float3 extent = Float3(fabsf(separation.x), fabsf(separation.y), fabsf(separation.z));
+
+		U32 axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		const bool negativeDirection = ((packet.octant >> axis) & 1) != 0;
+		const bool rightFirst = (separation[axis] < 0.0f) == negativeDirection;
+
+		assert(stackPtr + 2 <= TRAVERSAL_STACK_SIZE);
+		stack[stackPtr++] = PacketEntry{ rightFirst ? node.left() : node.right(), nodeFirstActive };
+		stack[stackPtr++] = PacketEntry{ rightFirst ? node.right() : node.left(), nodeFirstActive };
+	}
+}
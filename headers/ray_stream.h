@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cassert>
+#include <vector>
+
+#include "bvh_traversal.h"
+#include "ray.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define RAY_STREAM_SIZE		4096	// Rays gathered per stream, larger streams share every node & triangle fetch between more rays
+
+// Ray reaching a node during stream traversal, with the entry distance of the ray into the node bounds
+struct StreamRay
+{
+	U32 rayIndex;
+	F32 distance;
+};
+
+// Scratch memory of a single level stream traversal, kept with the stream so repeated traces reuse the allocations
+struct StreamWorkspace
+{
+	std::vector<TraversalRay> traversalRays;
+	std::vector<StreamRay> activeRays;
+	std::vector<StreamRay> childRays[TRAVERSAL_MAX_CHILDREN];
+};
+
+// Batch of independent rays traced together, hit results use the per ray metadata like single rays do.
+// Closest hit traces set the instance index of every ray that hit the scene, any hit traces set it for occluded rays only.
+// Any hit traces expect fresh rays, a ray with a primitive index set counts as occluded and is not traced any further.
+struct RayStream
+{
+	std::vector<Ray> rays;
+
+	StreamWorkspace workspace;
+	std::vector<Ray> instanceRays;
+	std::vector<U32> instanceRayIndices;	// Stream ray of every instance ray, rays the instance is invisible to are left out
+	StreamWorkspace instanceWorkspace;
+};
+
+// Stream counterpart of traverseBvh, shared by all node formats through their intersectChildren overloads.
+// Every node on the stack owns a range of the active ray list, holding the rays that hit its bounds. Visiting an interior node
+// partitions its rays into a new range per child, so every node & leaf is fetched once for all rays that reach it.
+// Ranges are allocated on top of the active ray list, nearest child last, so popping a node releases the ranges of all
+// subtrees finished before it. Leaves are passed to intersectLeaf(rays, activeRays, rayCount, first, count).
+template <bool AnyHit, typename NodeType, typename LeafFunc>
+inline void traverseBvhStream(const NodeType* nodePool, TraversalEntry root, Ray* rays, U32 rayCount, StreamWorkspace& workspace, LeafFunc intersectLeaf)
+{
+	assert(nodePool != nullptr);
+	assert(rays != nullptr);
+
+	struct StreamEntry
+	{
+		TraversalEntry node;
+		U32 first;
+		U32 count;
+	};
+
+	StreamEntry stack[TRAVERSAL_STACK_SIZE];
+	SizeType stackPtr = 0;
+
+	std::vector<StreamRay>& activeRays = workspace.activeRays;
+	activeRays.clear();
+	workspace.traversalRays.clear();
+	for (U32 i = 0; i < rayCount; i++)
+	{
+		workspace.traversalRays.push_back(TraversalRay(rays[i]));
+
+		if (!AnyHit || rays[i].metadata.primitiveIndex == UNSET_INDEX)
+			activeRays.push_back(StreamRay{ i, 0.0f });
+	}
+
+	if (!activeRays.empty())
+		stack[stackPtr++] = StreamEntry{ root, 0, static_cast<U32>(activeRays.size()) };
+
+	while (stackPtr > 0)
+	{
+		const StreamEntry entry = stack[--stackPtr];
+		activeRays.resize(entry.first + entry.count);
+
+		// Drop rays that found a closer hit, or any hit, since the node was pushed
+		U32 count = 0;
+		for (U32 i = entry.first; i < entry.first + entry.count; i++)
+		{
+			const Ray& ray = rays[activeRays[i].rayIndex];
+			if (activeRays[i].distance < ray.depth && (!AnyHit || ray.metadata.primitiveIndex == UNSET_INDEX))
+				activeRays[entry.first + count++] = activeRays[i];
+		}
+
+		if (count == 0)
+			continue;
+
+		if (entry.node.count != 0)
+		{
+			intersectLeaf(rays, &activeRays[entry.first], count, entry.node.leftFirst, entry.node.count);
+			continue;
+		}
+
+		// Partition the rays over the children they hit
+		TraversalEntry children[TRAVERSAL_MAX_CHILDREN];
+		F32 distanceSums[TRAVERSAL_MAX_CHILDREN] = {};
+		SizeType childCount = 0;
+
+		for (U32 i = entry.first; i < entry.first + count; i++)
+		{
+			const U32 rayIndex = activeRays[i].rayIndex;
+			TraversalEntry hits[TRAVERSAL_MAX_CHILDREN];
+			SizeType hitCount = intersectChildren(nodePool, entry.node.leftFirst, workspace.traversalRays[rayIndex], rays[rayIndex].depth, hits);
+
+			for (SizeType h = 0; h < hitCount; h++)
+			{
+				SizeType slot = 0;
+				while (slot < childCount && (children[slot].leftFirst != hits[h].leftFirst || children[slot].count != hits[h].count))
+					slot++;
+
+				if (slot == childCount)
+				{
+					children[childCount++] = hits[h];
+					workspace.childRays[slot].clear();
+				}
+
+				workspace.childRays[slot].push_back(StreamRay{ rayIndex, hits[h].distance });
+				distanceSums[slot] += hits[h].distance;
+			}
+		}
+
+		// Order children far to near by the average entry distance of their rays, the nearest child range ends up on top
+		SizeType order[TRAVERSAL_MAX_CHILDREN];
+		F32 averages[TRAVERSAL_MAX_CHILDREN];
+		for (SizeType c = 0; c < childCount; c++)
+		{
+			averages[c] = distanceSums[c] / static_cast<F32>(workspace.childRays[c].size());
+
+			SizeType slot = c;
+			while (slot > 0 && averages[order[slot - 1]] < averages[c])
+			{
+				order[slot] = order[slot - 1];
+				slot--;
+			}
+
+			order[slot] = c;
+		}
+
+		activeRays.resize(entry.first);
+		assert(stackPtr + childCount <= TRAVERSAL_STACK_SIZE);
+		for (SizeType c = 0; c < childCount; c++)
+		{
+			const std::vector<StreamRay>& childRays = workspace.childRays[order[c]];
+			const U32 first = static_cast<U32>(activeRays.size());
+			activeRays.insert(activeRays.end(), childRays.begin(), childRays.end());
+			stack[stackPtr++] = StreamEntry{ children[order[c]], first, static_cast<U32>(childRays.size()) };
+		}
+	}
+}
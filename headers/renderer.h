@@ -6,6 +6,7 @@
 #include "camera.h"
 #include "pixel_buffer.h"
 #include "ray.h"
+#include "ray_stream.h"
 #include "render_context.h"
 #include "scene.h"
 #include "surf_math.h"
@@ -44,6 +45,22 @@ struct AccumulatorState
     ~AccumulatorState();
 };
 
+// State of a path traced on the CPU, carried from bounce to bounce
+struct PathState
+{
+    RgbColor energy         = RgbColor(0.0f);
+    RgbColor transmission   = RgbColor(1.0f);
+    bool lastSpecular       = true;
+};
+
+// Next event estimation sample of a shaded hit, contributes to the path energy if its shadow ray is unoccluded
+struct LightSample
+{
+    Ray shadowRay           = Ray(Float3(0.0f), Float3(0.0f), VISIBILITY_SHADOW);
+    RgbColor contribution   = RgbColor(0.0f);
+    bool valid              = false;
+};
+
 struct FrameStateUBO
 {
     ALIGN(4) U32 samplesPerFrame     = 0;
@@ -113,7 +130,15 @@ public:
     virtual inline const FrameInstrumentationData& frameInfo() override { return m_frameInstrumentationData; }
 
 private:
-    RgbColor trace(U32& seed, Ray& ray, U32 depth = 0);
+    // Rays already intersected with the scene, e.g. by packet tracing, pass primaryIntersected to skip their first intersection
+    RgbColor trace(U32& seed, Ray& ray, U32 depth = 0, bool primaryIntersected = false);
+
+    // Traces the rays of a stream as paths bounce by bounce, ray i uses seeds[i] & writes its path energy to energies[i]
+    void traceStream(RayStream& stream, U32* seeds, RgbColor* energies, bool primaryIntersected);
+
+    // Shades an intersected (or missed) ray of a path & replaces it with the extension ray, returns false once the path ends.
+    // Shadow rays are returned in the light sample instead of being traced, so callers can batch them.
+    bool shade(U32& seed, Ray& ray, bool intersected, PathState& path, LightSample& lightSample);
 
     void copyBufferToImage(
         const Buffer& staging,
@@ -314,6 +339,11 @@ private:
                 DescriptorSetBinding{ 7, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
                 DescriptorSetBinding{ 8, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
                 DescriptorSetBinding{ 9, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
+                DescriptorSetBinding{ 10, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
+                DescriptorSetBinding{ 11, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
+                DescriptorSetBinding{ 12, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
+                DescriptorSetBinding{ 13, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
+                DescriptorSetBinding{ 14, VK_SHADER_STAGE_COMPUTE_BIT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER },
             }
         },
     });
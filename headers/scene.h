@@ -4,6 +4,7 @@
 #include <vulkan/vulkan.h>
 
 #include "bvh.h"
+#include "light_bvh.h"
 #include "ray.h"
 #include "render_context.h"
 #include "surf_math.h"
@@ -31,6 +32,9 @@ public:
 	virtual const SceneBackground& backgroundSettings() const = 0;
 
 	virtual void update(F32 deltaTime) = 0;
+
+	// Call after BLASses of the scene got new trees, e.g. swapped in by a BvhRebuilder
+	virtual void refreshBlasData() = 0;
 };
 
 class Scene
@@ -46,11 +50,23 @@ public:
 
 	inline bool intersectAny(Ray& ray) const { return m_sceneTlas.intersectAny(ray); }
 
-	inline const Instance& hitInstance(SizeType instanceIndex) { return m_sceneTlas.instance(instanceIndex); }
+	inline void intersect(RayPacket& packet) const { m_sceneTlas.intersect(packet); }
+
+	inline void intersect(RayStream& stream) const { m_sceneTlas.intersect(stream); }
+
+	inline void intersectAny(RayStream& stream) const { m_sceneTlas.intersectAny(stream); }
+
+	// Mesh instance hit by the ray, the assembly member for nested hits
+	inline const Instance& hitInstance(const RayMetadata& hit) const { return m_sceneTlas.instances()[hit.instanceIndex].hitLeaf(hit); }
+
+	inline Float3 hitNormal(const RayMetadata& hit) const { return m_sceneTlas.instances()[hit.instanceIndex].normal(hit); }
+
+	inline const BvhTLAS& tlas() const { return m_sceneTlas; }
 
 	inline const U32 lightCount() const { return static_cast<U32>(m_lightIndices.size()); }
 
-	inline const Instance& sampleLights(U32& seed) { return m_sceneTlas.instance(m_lightIndices[randomRange(seed, 0, lightCount())]); }
+	// Picks a point on an emitter for a receiver, see NEE_LIGHT_BVH. False if no emitter can light it
+	bool sampleLights(U32& seed, const Float3& position, const Float3& normal, EmitterSample& sample) const;
 
 	RgbColor sampleBackground(const Ray& ray) const;
 
@@ -58,16 +74,34 @@ public:
 
 	virtual void update(F32 deltaTime) override;
 
+	// Instances traverse their BLASses in place & tree rebuilds keep the BLAS bounds, so there is nothing to refresh
+	virtual inline void refreshBlasData() override {}
+
+private:
+	// Call after moving a light instance
+	void buildLightSamplers();
+
 private:
 	SceneBackground m_background;
 	BvhTLAS m_sceneTlas;
 	std::vector<U32> m_lightIndices;
+	LightBvh m_lightBvh;
+	AliasTable m_lightTable;	// Light instances by emitted power, parallel to the light indices
 };
 
+// Traversal links of a GPU BVH node, letting the kernels walk the tree without a stack.
+// The root links to itself, parents of BLAS nodes are local to their BLAS.
+#define BVH_LINK_PARENT_MASK	0x0FFFFFFFu	// Index of the parent node
+#define BVH_LINK_RIGHT_CHILD	(1u << 28)	// The node is the right child of its parent
+#define BVH_LINK_AXIS_SHIFT		29			// Axis separating the child centroids the most, 2 bits
+#define BVH_LINK_FLIP_CHILDREN	(1u << 31)	// The right child lies before the left child along the axis
+
 struct GPULightData
 {
 	ALIGN(4) U32 lightInstanceIdx;
 	ALIGN(4) U32 primitiveCount;
+	ALIGN(4) U32 triangleAliasOffset;	// First entry of the triangle area alias table of the instance
+	AliasEntry power;					// Slot of the power weighted alias table over all lights
 };
 
 struct GPUBatchInfo
@@ -76,15 +110,26 @@ struct GPUBatchInfo
 	std::vector<TriExtension> triExtBuffer;
 	std::vector<U32> BLASIndices;
 	std::vector<BvhNode> BLASNodes;
+	std::vector<U32> BLASLinks;
+	SizeType BLASIndexCapacity;			// Indices & nodes any rebuild of the BLASses fits in, see BvhBLAS::maxIndexCount
+	SizeType BLASNodeCapacity;
 	std::vector<Material> materials;
-	std::vector<GPUInstance> gpuInstances;
+	std::vector<GPUInstance> gpuInstances;		// Scene instances, then the members of every assembly back to back
+	std::vector<U32> assemblyIndices;			// TLASses of all assemblies, uploaded behind the scene TLAS
+	std::vector<BvhNode> assemblyNodes;
+	std::vector<U32> assemblyLinks;
+	std::vector<U32> assemblyMasks;
 	std::vector<GPULightData> lights;
+	std::vector<AliasEntry> triangleAliases;
 };
 
 class GPUBatcher
 {
 public:
 	static const GPUBatchInfo createBatchInfo(const std::vector<Instance>& instances);
+
+	// Parent & child order links of every node reachable from the root, see BVH_LINK_*
+	static std::vector<U32> createNodeLinks(const BvhNode* nodePool, U32 nodesUsed);
 };
 
 class GPUScene
@@ -99,8 +144,13 @@ public:
 
 	virtual void update(F32 deltaTime) override;
 
+	// Reuploads the BLAS buffers, they are allocated for the largest trees the BLASses can be rebuilt into
+	virtual void refreshBlasData() override;
+
+	inline const BvhTLAS& tlas() const { return m_sceneTlas; }
+
 private:
-	void uploadToGPU(const void* data, SizeType size, Buffer& target);
+	void uploadToGPU(const void* data, SizeType size, Buffer& target, SizeType targetOffset = 0);
 
 private:
 	RenderContext* m_renderContext;
@@ -109,15 +159,22 @@ private:
 	GPUBatchInfo m_batchInfo;
 	SceneBackground m_background;
 	BvhTLAS m_sceneTlas;
+	std::vector<U32> m_tlasLinks;	// Rebuilt with every TLAS update, the TLAS changes shape when refits rebuild or rotate it
+	LightBvh m_lightBvh;			// Rebuilt when a light instance moves
 
 public:
 	Buffer globalTriBuffer;			// Global mesh triangle buffer.
 	Buffer globalTriExtBuffer;		// Global mesh tri extension data buffer.
 	Buffer BLASGlobalIndexBuffer;	// All BLASses will be stored in 1 buffer,
 	Buffer BLASGlobalNodeBuffer;	// with nodes & indices stored in 2 SSBOs.
+	Buffer BLASGlobalLinkBuffer;	// Stackless traversal links of all BLAS nodes, parallel to the node buffer.
 	Buffer materialBuffer;			// Materials are stored in a single SSBO.
 	Buffer instanceBuffer;			// The Instance buffer contains GPUInstances with offsets into global BLAS buffers.
 	Buffer TLASIndexBuffer;			// The TLAS index buffer containes indices into the instance buffer.
-	Buffer TLASNodeBuffer;			// The TLAS Node buffer contains TLAS BVH nodes.
-	Buffer lightBuffer;				// The light buffer contains needed data for all lights in the scene.
+	Buffer TLASNodeBuffer;			// The TLAS Node buffer contains TLAS BVH nodes, followed by the nodes of all assembly TLASses.
+	Buffer TLASLinkBuffer;			// The TLAS link buffer contains stackless traversal links of the TLAS nodes.
+	Buffer TLASMaskBuffer;			// The TLAS mask buffer contains the instance visibility masks below every TLAS node.
+	Buffer lightBuffer;				// The light buffer contains the light BVH nodes, picking emitters for next event estimation.
+	Buffer lightDataBuffer;			// The light data buffer contains all light instances, with a power weighted alias table.
+	Buffer triangleAliasBuffer;		// Triangle area alias tables of all light instances, back to back.
 };
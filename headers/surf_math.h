@@ -90,6 +90,20 @@ using RgbaColor = Float4;
 
 using Mat4 = glm::mat4;	// Matrix stuff is hard, so steal it from GLM
 
+// Affine transform, the upper 3 rows of a 4x4 matrix with an implicit (0, 0, 0, 1) bottom row.
+// Rows hold the linear part followed by the translation, laid out like a column major mat3x4 multiplied from the left in GLSL.
+struct ALIGN(16) Mat3x4
+{
+	Float4 rows[3];
+
+	inline Mat3x4() : Mat3x4(Mat4(1.0f)) {};
+	inline explicit Mat3x4(const Mat4& matrix);
+
+	inline Float3 transformPoint(const Float3& point) const;
+	inline Float3 transformVector(const Float3& vector) const;
+	inline Mat4 toMat4() const;
+};
+
 template <typename T>
 inline void swap(T& a, T& b) { T temp; temp = a; a = b; b = temp; }
 
@@ -116,6 +130,8 @@ inline SizeType max(SizeType a, SizeType b) { return a > b ? a : b; };
 inline Float3 min(const Float3& a, const Float3& b) { return Float3(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z)); }
 inline Float3 max(const Float3& a, const Float3& b) { return Float3(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z)); }
 
+inline F32 luminance(const RgbColor& color) { return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b; }
+
 // Float2 operators
 inline Float2 operator+(const Float2& a, F32 b) { return Float2(a.x + b, a.y + b); }
 inline Float2 operator-(const Float2& a, F32 b) { return Float2(a.x - b, a.y - b); }
@@ -200,6 +216,36 @@ inline F32 Float4::magnitude() const { return sqrtf(this->dot(*this)); }
 inline F32 Float4::dot(const Float4& other) const { return x * other.x + y * other.y + z * other.z + w * other.w; }
 inline Float4 Float4::normalize() const { F32 invLen = rsqrtf(this->dot(*this)); return *this * invLen; }
 
+// Mat3x4 functions, GLM matrices are indexed by column first
+inline Mat3x4::Mat3x4(const Mat4& matrix)
+{
+	for (U32 row = 0; row < 3; row++)
+		rows[row] = Float4(matrix[0][row], matrix[1][row], matrix[2][row], matrix[3][row]);
+}
+
+inline Float3 Mat3x4::transformPoint(const Float3& point) const { return transformVector(point) + Float3(rows[0].w, rows[1].w, rows[2].w); }
+
+inline Float3 Mat3x4::transformVector(const Float3& vector) const
+{
+	return Float3(
+		rows[0].x * vector.x + rows[0].y * vector.y + rows[0].z * vector.z,
+		rows[1].x * vector.x + rows[1].y * vector.y + rows[1].z * vector.z,
+		rows[2].x * vector.x + rows[2].y * vector.y + rows[2].z * vector.z
+	);
+}
+
+inline Mat4 Mat3x4::toMat4() const
+{
+	Mat4 matrix(1.0f);
+	for (U32 row = 0; row < 3; row++)
+	{
+		for (U32 column = 0; column < 4; column++)
+			matrix[column][row] = rows[row].xyzw[column];
+	}
+
+	return matrix;
+}
+
 U32 RgbaToU32(const RgbaColor& color);
 
 U32 initSeed(U32 seed);
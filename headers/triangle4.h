@@ -0,0 +1,97 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include "mesh.h"
+#include "ray.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define TRIANGLE4_WIDTH		4
+
+// Block of 4 triangles stored as SoA with precomputed edges, intersected by a single SSE Moller-Trumbore test.
+// Used as the leaf primitive format of CPU traversal, unused lanes hold degenerate triangles that can never be hit.
+struct ALIGN(16) Triangle4
+{
+	F32 v0X[TRIANGLE4_WIDTH], v0Y[TRIANGLE4_WIDTH], v0Z[TRIANGLE4_WIDTH];
+	F32 e1X[TRIANGLE4_WIDTH], e1Y[TRIANGLE4_WIDTH], e1Z[TRIANGLE4_WIDTH];	// v1 - v0
+	F32 e2X[TRIANGLE4_WIDTH], e2Y[TRIANGLE4_WIDTH], e2Z[TRIANGLE4_WIDTH];	// v2 - v0
+	U32 primitiveIndex[TRIANGLE4_WIDTH];	// Mesh triangle index per lane, UNSET_INDEX for unused lanes
+
+	void clear();
+
+	void setTriangle(U32 lane, const Triangle& triangle, U32 primitive);
+
+	inline bool intersect(Ray& ray) const;
+};
+
+// Matches Triangle::intersect for every lane, the nearest hit updates the depth, hit coordinates & primitive index of the ray.
+// Equally distant hits resolve to the lowest lane, like a sequential loop over the triangles would.
+bool Triangle4::intersect(Ray& ray) const
+{
+	const __m128 dirX = _mm_set1_ps(ray.direction.x);
+	const __m128 dirY = _mm_set1_ps(ray.direction.y);
+	const __m128 dirZ = _mm_set1_ps(ray.direction.z);
+	const __m128 edge1X = _mm_load_ps(e1X), edge1Y = _mm_load_ps(e1Y), edge1Z = _mm_load_ps(e1Z);
+	const __m128 edge2X = _mm_load_ps(e2X), edge2Y = _mm_load_ps(e2Y), edge2Z = _mm_load_ps(e2Z);
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 epsilon = _mm_set1_ps(F32_EPSILON);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	// h = direction x e2
+	const __m128 hX = _mm_sub_ps(_mm_mul_ps(dirY, edge2Z), _mm_mul_ps(dirZ, edge2Y));
+	const __m128 hY = _mm_sub_ps(_mm_mul_ps(dirZ, edge2X), _mm_mul_ps(dirX, edge2Z));
+	const __m128 hZ = _mm_sub_ps(_mm_mul_ps(dirX, edge2Y), _mm_mul_ps(dirY, edge2X));
+	const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, hX), _mm_mul_ps(edge1Y, hY)), _mm_mul_ps(edge1Z, hZ));
+
+	__m128 mask = _mm_cmpge_ps(_mm_and_ps(a, absMask), epsilon);
+	if (_mm_movemask_ps(mask) == 0)
+		return false;
+
+	const __m128 f = _mm_div_ps(one, a);
+	const __m128 sX = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(v0X));
+	const __m128 sY = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(v0Y));
+	const __m128 sZ = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(v0Z));
+	const __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sX, hX), _mm_mul_ps(sY, hY)), _mm_mul_ps(sZ, hZ)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+	// q = s x e1
+	const __m128 qX = _mm_sub_ps(_mm_mul_ps(sY, edge1Z), _mm_mul_ps(sZ, edge1Y));
+	const __m128 qY = _mm_sub_ps(_mm_mul_ps(sZ, edge1X), _mm_mul_ps(sX, edge1Z));
+	const __m128 qZ = _mm_sub_ps(_mm_mul_ps(sX, edge1Y), _mm_mul_ps(sY, edge1X));
+	const __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dirX, qX), _mm_mul_ps(dirY, qY)), _mm_mul_ps(dirZ, qZ)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+	const __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, epsilon), _mm_cmplt_ps(t, _mm_set1_ps(ray.depth))));
+
+	I32 hitMask = _mm_movemask_ps(mask);
+	if (hitMask == 0)
+		return false;
+
+	ALIGN(16) F32 depths[TRIANGLE4_WIDTH];
+	_mm_store_ps(depths, t);
+
+	U32 nearest = 0;
+	F32 nearestDepth = F32_INF;
+	for (U32 i = 0; i < TRIANGLE4_WIDTH; i++)
+	{
+		if ((hitMask & (1 << i)) && depths[i] < nearestDepth)
+		{
+			nearest = i;
+			nearestDepth = depths[i];
+		}
+	}
+
+	ALIGN(16) F32 hitU[TRIANGLE4_WIDTH], hitV[TRIANGLE4_WIDTH];
+	_mm_store_ps(hitU, u);
+	_mm_store_ps(hitV, v);
+
+	ray.depth = nearestDepth;
+	ray.metadata.hitCoordinates = Float2(hitU[nearest], hitV[nearest]);
+	ray.metadata.primitiveIndex = primitiveIndex[nearest];
+	return true;
+}
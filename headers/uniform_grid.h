@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+
+#include "bvh.h"
+#include "mesh.h"
+#include "ray.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define GRID_TOP_DENSITY		0.0625f	// Top level cells per triangle, kept coarse so empty space is skipped in large steps
+#define GRID_CELL_DENSITY		2.0f	// Leaf cells per triangle overlapping a top level cell
+#define GRID_MAX_RESOLUTION		128		// Cells per axis of the top level grid
+#define GRID_MAX_CELL_RESOLUTION	32	// Leaf cells per axis of a single top level cell
+
+struct GridCell
+{
+	U32 firstLeaf;		// First leaf cell of the nested grid
+	U8 resolution[3];	// Leaf cells per axis, 0 for empty cells
+};
+
+struct GridLeaf
+{
+	U32 first;		// Index range of the triangles overlapping the leaf
+	U32 count;
+};
+
+// Two level uniform grid, every non empty top level cell holds a nested grid sized to the triangles overlapping it.
+// Both levels are walked with a 3D-DDA, so traversal cost follows the distance a ray travels instead of the tree depth.
+// Fits dense, uniformly tessellated meshes, where the cells adapt well to the triangle sizes.
+// Triangles are referenced by every leaf their bounds overlap, there is no cheap refit.
+class UniformGrid
+	: public IAccelerationStructure
+{
+public:
+	UniformGrid(Mesh* mesh, bool deferBuild = false);
+
+	virtual ~UniformGrid() = default;
+
+	virtual void build() override;
+
+	// Grids are rebuilt, moved triangles change the cells they overlap
+	virtual void refit() override;
+
+	// Packets & streams use the per ray defaults of the interface
+	using IAccelerationStructure::intersect;
+	using IAccelerationStructure::intersectAny;
+
+	virtual bool intersect(Ray& ray) const override;
+
+	virtual bool intersectAny(Ray& ray) const override;
+
+	virtual inline Mesh* mesh() const override { return m_mesh; }
+
+	virtual inline AABB bounds() const override { return m_bounds; }
+
+	virtual inline SizeType memoryUsage() const override { return m_cells.size() * sizeof(GridCell) + m_leaves.size() * sizeof(GridLeaf) + m_indices.size() * sizeof(U32); }
+
+	virtual inline F32 buildTime() const override { return m_buildTime; }
+
+	inline const U32* resolution() const { return m_resolution; }
+
+	inline SizeType leafCount() const { return m_leaves.size(); }
+
+private:
+	template <bool AnyHit>
+	bool traverse(Ray& ray) const;
+
+private:
+	Mesh* m_mesh;
+	AABB m_bounds;
+	Float3 m_cellSize;
+	U32 m_resolution[3];
+	std::vector<GridCell> m_cells;
+	std::vector<GridLeaf> m_leaves;
+	std::vector<U32> m_indices;
+	F32 m_buildTime;
+};
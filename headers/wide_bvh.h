@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cassert>
+#include <immintrin.h>
+
+#include "bvh_traversal.h"
+#include "ray.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define WIDE_BVH_WIDTH					4
+#define WIDE_BVH_ROOT_INDEX				0
+#define WIDE_BVH_CHILD_MASK_BITS		8	// Visibility mask bits per child, the masks of all children of a node share a U32
+
+struct BvhNode;
+
+// 4 wide BVH node with child bounds stored as SoA, allowing a single SSE slab test for all children.
+// Unused child slots have their bounds set to +inf, which never passes the slab test.
+struct ALIGN(64) WideBvhNode
+{
+	ALIGN(16) F32 bbMinX[WIDE_BVH_WIDTH];
+	ALIGN(16) F32 bbMinY[WIDE_BVH_WIDTH];
+	ALIGN(16) F32 bbMinZ[WIDE_BVH_WIDTH];
+	ALIGN(16) F32 bbMaxX[WIDE_BVH_WIDTH];
+	ALIGN(16) F32 bbMaxY[WIDE_BVH_WIDTH];
+	ALIGN(16) F32 bbMaxZ[WIDE_BVH_WIDTH];
+	ALIGN(16) U32 leftFirst[WIDE_BVH_WIDTH];	// Wide node index for interior children, first primitive index or leaf block for leaves
+	ALIGN(16) U32 count[WIDE_BVH_WIDTH];		// Primitive count for leaf children, 0 for interior children
+};
+
+// Collapsed 4 wide representation of a binary BVH node pool, used for CPU traversal only.
+// Leaf children reference the same index ranges as the binary leaves they were collapsed from, until remapped by the owner.
+class WideBvh
+{
+public:
+	typedef WideBvhNode NodeType;
+
+	WideBvh();
+
+	~WideBvh();
+
+	WideBvh(const WideBvh& other) noexcept;
+	WideBvh& operator=(const WideBvh& other) noexcept;
+
+	// Exchanges the node pools without copying them
+	void swap(WideBvh& other) noexcept;
+
+	void collapse(const BvhNode* nodePool, U32 nodesUsed);
+
+	template <bool AnyHit, typename LeafFunc>
+	inline bool intersect(Ray& ray, const TraversalRay& traversalRay, LeafFunc intersectLeaf) const;
+
+	// Replaces the first primitive of every leaf child with remapLeaf(leftFirst, count), called in node pool order
+	template <typename LeafFunc>
+	inline void remapLeaves(LeafFunc remapLeaf);
+
+	inline const U32 nodesUsed() const { return m_nodesUsed; }
+	inline const WideBvhNode* nodePool() const { return m_nodePool; }
+	inline const SizeType memoryUsage() const { return m_nodesUsed * sizeof(WideBvhNode); }
+
+private:
+	U32 collapseNode(const BvhNode* nodePool, U32 nodeIndex);
+
+	void release();
+
+private:
+	U32 m_nodeCapacity;
+	U32 m_nodesUsed;
+	WideBvhNode* m_nodePool;
+};
+
+// Selects up to WIDE_BVH_WIDTH binary nodes to become the children of a wide node, by repeatedly opening the interior child
+// with the largest surface area. Returns the number of children written.
+U32 gatherWideChildren(const BvhNode* nodePool, U32 nodeIndex, U32 (&children)[WIDE_BVH_WIDTH]);
+
+// Slab test of a ray against 4 boxes at once, returns a bit mask of hit boxes and stores the entry distances in tNear
+inline I32 intersectWideBounds(
+	const TraversalRay& traversalRay, F32 depth,
+	__m128 minX, __m128 minY, __m128 minZ,
+	__m128 maxX, __m128 maxY, __m128 maxZ,
+	__m128& tNear
+)
+{
+	const __m128 txNear = _mm_mul_ps(_mm_sub_ps(minX, traversalRay.originX), traversalRay.rDirX);
+	const __m128 txFar = _mm_mul_ps(_mm_sub_ps(maxX, traversalRay.originX), traversalRay.rDirX);
+	const __m128 tyNear = _mm_mul_ps(_mm_sub_ps(minY, traversalRay.originY), traversalRay.rDirY);
+	const __m128 tyFar = _mm_mul_ps(_mm_sub_ps(maxY, traversalRay.originY), traversalRay.rDirY);
+	const __m128 tzNear = _mm_mul_ps(_mm_sub_ps(minZ, traversalRay.originZ), traversalRay.rDirZ);
+	const __m128 tzFar = _mm_mul_ps(_mm_sub_ps(maxZ, traversalRay.originZ), traversalRay.rDirZ);
+
+	__m128 tmin = _mm_min_ps(txNear, txFar);
+	__m128 tmax = _mm_max_ps(txNear, txFar);
+	tmin = _mm_max_ps(tmin, _mm_min_ps(tyNear, tyFar));
+	tmax = _mm_min_ps(tmax, _mm_max_ps(tyNear, tyFar));
+	tmin = _mm_max_ps(tmin, _mm_min_ps(tzNear, tzFar));
+	tmax = _mm_min_ps(tmax, _mm_max_ps(tzNear, tzFar));
+
+	const __m128 hitMask = _mm_and_ps(
+		_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, _mm_set1_ps(depth))),
+		_mm_cmpgt_ps(tmax, _mm_setzero_ps())
+	);
+
+	tNear = tmin;
+	return _mm_movemask_ps(hitMask);
+}
+
+// Writes a traversal entry for every child of a wide node set in the hit mask, returns the number of entries written
+template <typename WideNode>
+inline SizeType gatherWideHits(const WideNode& node, I32 mask, __m128 tNear, TraversalEntry* hits)
+{
+	ALIGN(16) F32 distances[WIDE_BVH_WIDTH];
+	_mm_store_ps(distances, tNear);
+
+	SizeType hitCount = 0;
+	for (U32 i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		if (mask & (1 << i))
+			hits[hitCount++] = TraversalEntry{ node.leftFirst[i], node.count[i], distances[i] };
+	}
+
+	return hitCount;
+}
+
+// Slab test of a ray against the children of a wide node, returns a bit mask of hit children
+inline I32 intersectWideNode(const WideBvhNode& node, const TraversalRay& traversalRay, F32 depth, __m128& tNear)
+{
+	return intersectWideBounds(
+		traversalRay, depth,
+		_mm_load_ps(node.bbMinX), _mm_load_ps(node.bbMinY), _mm_load_ps(node.bbMinZ),
+		_mm_load_ps(node.bbMaxX), _mm_load_ps(node.bbMaxY), _mm_load_ps(node.bbMaxZ),
+		tNear
+	);
+}
+
+inline SizeType intersectChildren(const WideBvhNode* nodePool, U32 nodeIndex, const TraversalRay& traversalRay, F32 depth, TraversalEntry* hits)
+{
+	const WideBvhNode& node = nodePool[nodeIndex];
+
+	__m128 tNear;
+	I32 mask = intersectWideNode(node, traversalRay, depth, tNear);
+
+	return gatherWideHits(node, mask, tNear, hits);
+}
+
+// Wide nodes paired with the visibility masks of their children, WIDE_BVH_CHILD_MASK_BITS per child slot.
+// Passed to the traversal functions in place of a node pool, so subtrees the ray type cannot see are never entered.
+template <typename NodeType>
+struct VisibilityMaskedNodes
+{
+	const NodeType* nodePool;
+	const U32* childMasks;
+};
+
+static_assert(WIDE_BVH_WIDTH * WIDE_BVH_CHILD_MASK_BITS <= 32, "The child visibility masks of a wide node must fit a U32");
+
+// Bit mask of the child slots whose visibility mask shares a bit with the ray type
+inline I32 visibleChildren(U32 childMasks, U32 visibilityMask)
+{
+	I32 visible = 0;
+	for (U32 i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		if (((childMasks >> (i * WIDE_BVH_CHILD_MASK_BITS)) & visibilityMask) != 0)
+			visible |= 1 << i;
+	}
+
+	return visible;
+}
+
+template <typename NodeType>
+inline SizeType intersectChildren(const VisibilityMaskedNodes<NodeType>* nodes, U32 nodeIndex, const TraversalRay& traversalRay, F32 depth, TraversalEntry* hits)
+{
+	const NodeType& node = nodes->nodePool[nodeIndex];
+
+	__m128 tNear;
+	I32 mask = intersectWideNode(node, traversalRay, depth, tNear);
+	mask &= visibleChildren(nodes->childMasks[nodeIndex], traversalRay.visibilityMask);
+
+	return gatherWideHits(node, mask, tNear, hits);
+}
+
+template <bool AnyHit, typename LeafFunc>
+bool WideBvh::intersect(Ray& ray, const TraversalRay& traversalRay, LeafFunc intersectLeaf) const
+{
+	return traverseBvh<AnyHit>(m_nodePool, TraversalEntry{ WIDE_BVH_ROOT_INDEX, 0, 0.0f }, traversalRay, ray, intersectLeaf);
+}
+
+template <typename LeafFunc>
+void WideBvh::remapLeaves(LeafFunc remapLeaf)
+{
+	for (U32 nodeIndex = 0; nodeIndex < m_nodesUsed; nodeIndex++)
+	{
+		WideBvhNode& node = m_nodePool[nodeIndex];
+		for (U32 i = 0; i < WIDE_BVH_WIDTH; i++)
+		{
+			if (node.count[i] != 0)
+				node.leftFirst[i] = remapLeaf(node.leftFirst[i], node.count[i]);
+		}
+	}
+}
@@ -3,12 +3,31 @@
 #ifndef GLSL_BVH
 #define GLSL_BVH
 
+#define BVH_ROOT_IDX			0
+
+// Stackless traversal links, see GPUBatcher::createNodeLinks
+#define BVH_LINK_PARENT_MASK	0x0FFFFFFFu
+#define BVH_LINK_RIGHT_CHILD	(1u << 28)
+#define BVH_LINK_AXIS_SHIFT		29
+#define BVH_LINK_FLIP_CHILDREN	(1u << 31)
+
+// States of the stackless traversal, named after the node the current node was reached from
+#define TRAVERSAL_FROM_PARENT	0
+#define TRAVERSAL_FROM_SIBLING	1
+#define TRAVERSAL_FROM_CHILD	2
+
+// Primitive types of meshes, see PrimitiveType in mesh.h
+#define PRIMITIVE_TRIANGLE		0
+#define PRIMITIVE_SPHERE		1
+#define PRIMITIVE_QUAD			2
+#define PRIMITIVE_DISK			3
+#define PRIMITIVE_ASSEMBLY		4	// Instance of an assembly TLAS, see GPU_INSTANCE_ASSEMBLY in bvh.h
+
 struct Triangle
 {
 	vec3 v0;
 	vec3 v1;
 	vec3 v2;
-	vec3 triCentroid;
 };
 
 struct TriExtension
@@ -19,12 +38,13 @@ struct TriExtension
 
 struct BvhNode
 {
-	uint leftFirst;
-	uint count;
 	vec3 aabbMin;
+	uint leftFirst;
 	vec3 aabbMax;
+	uint count;
 };
 
+// Assembly instances reference a TLAS in the TLAS buffers instead, with the first member instance in triOffset
 struct Instance
 {
 	uint triOffset;
@@ -32,14 +52,10 @@ struct Instance
 	uint nodeOffset;
 	uint materialOffset;
 	float area;
-	mat4 transform;
-	mat4 invTransform;
-};
-
-struct LightData
-{
-	uint lightInstanceIdx;
-	uint primitiveCount;
+	uint visibilityMask;		// Ray types intersecting the instance
+	uint primitiveType;		// Analytic primitives are stored in the triangle array as (origin, u, v), see AnalyticPrimitive
+	mat3x4 transform;		// Affine, rows of the transform stored as columns, applied as vec4(v, w) * transform
+	mat3x4 invTransform;
 };
 
 bool bvhNodeIsLeaf(BvhNode node)
@@ -47,6 +63,28 @@ bool bvhNodeIsLeaf(BvhNode node)
 	return node.count != 0;
 }
 
+uint bvhLinkParent(uint link)
+{
+	return link & BVH_LINK_PARENT_MASK;
+}
+
+uint bvhLinkSibling(uint nodeIdx, uint link)
+{
+	return (link & BVH_LINK_RIGHT_CHILD) != 0 ? nodeIdx - 1u : nodeIdx + 1u;
+}
+
+// Offset of the child visited first from the left child, the one on the side the ray comes from
+uint bvhNearChildOffset(uint link, vec3 direction)
+{
+	bool negative = direction[(link >> BVH_LINK_AXIS_SHIFT) & 3u] < 0.0;
+	return negative != ((link & BVH_LINK_FLIP_CHILDREN) != 0) ? 1u : 0u;
+}
+
+bool bvhIsNearChild(uint link, uint parentLink, vec3 direction)
+{
+	return ((link & BVH_LINK_RIGHT_CHILD) != 0 ? 1u : 0u) == bvhNearChildOffset(parentLink, direction);
+}
+
 vec3 scaleVertexBarycentric(Triangle tri, vec2 uv)
 {
 	return uv.x * tri.v0 + uv.y * tri.v2 + (1.0 - uv.x - uv.y) * tri.v1;
@@ -95,6 +133,194 @@ bool triangleIntersect(Triangle tri, inout Ray ray)
 	return true;
 }
 
+// Mirrors AnalyticPrimitive::intersect, the primitive is passed in the triangle layout
+bool analyticIntersect(uint type, Triangle prim, inout Ray ray)
+{
+	if (type == PRIMITIVE_SPHERE)
+	{
+		float radius = prim.v1.x;
+		vec3 oc = ray.origin - prim.v0;
+		float a = dot(ray.direction, ray.direction);
+		float b = dot(oc, ray.direction);
+		float c = dot(oc, oc) - radius * radius;
+
+		vec3 closest = oc - ray.direction * (b / a);
+		float discriminant = a * (radius * radius - dot(closest, closest));
+		if (discriminant < 0.0)
+			return false;
+
+		float q = -b - (b < 0.0 ? -1.0 : 1.0) * sqrt(discriminant);
+		float nearDepth = min(c / q, q / a);
+		float farDepth = max(c / q, q / a);
+
+		float depth = nearDepth;
+		if (!depthInBounds(depth, ray.depth))
+		{
+			depth = farDepth;
+			if (!depthInBounds(depth, ray.depth))
+				return false;
+		}
+
+		vec3 N = (oc + ray.direction * depth) / radius;
+		float azimuth = atan(N.y, N.x);
+		if (azimuth < 0.0)
+			azimuth += F32_2PI;
+
+		ray.depth = depth;
+		ray.hit.hitCoords = vec2(acos(clamp(N.z, -1.0, 1.0)) / F32_PI, azimuth / F32_2PI);
+		return true;
+	}
+
+	vec3 n = cross(prim.v1, prim.v2);
+	float denominator = dot(n, ray.direction);
+	if (abs(denominator) < F32_EPSILON)
+		return false;
+
+	float depth = dot(n, prim.v0 - ray.origin) / denominator;
+	if (!depthInBounds(depth, ray.depth))
+		return false;
+
+	vec3 q = ray.origin + ray.direction * depth - prim.v0;
+	vec3 w = n / dot(n, n);
+	float s = dot(w, cross(q, prim.v2));
+	float t = dot(w, cross(prim.v1, q));
+
+	if (type == PRIMITIVE_QUAD)
+	{
+		if (0.0 > s || s > 1.0 || 0.0 > t || t > 1.0)
+			return false;
+
+		ray.depth = depth;
+		ray.hit.hitCoords = vec2(s, t);
+		return true;
+	}
+
+	float radius2 = s * s + t * t;
+	if (radius2 > 1.0)
+		return false;
+
+	float angle = atan(t, s);
+	if (angle < 0.0)
+		angle += F32_2PI;
+
+	ray.depth = depth;
+	ray.hit.hitCoords = vec2(sqrt(radius2), angle / F32_2PI);
+	return true;
+}
+
+bool primitiveIntersect(uint type, Triangle prim, inout Ray ray)
+{
+	return type == PRIMITIVE_TRIANGLE ? triangleIntersect(prim, ray) : analyticIntersect(type, prim, ray);
+}
+
+vec3 sphereNormal(vec2 hitCoords)
+{
+	float polar = hitCoords.x * F32_PI;
+	float azimuth = hitCoords.y * F32_2PI;
+	return vec3(sin(polar) * cos(azimuth), sin(polar) * sin(azimuth), cos(polar));
+}
+
+// Object space normal at the hit coordinates, analytic primitives are not smoothed
+vec3 primitiveNormal(uint type, Triangle prim, TriExtension ext, vec2 hitCoords)
+{
+	if (type == PRIMITIVE_TRIANGLE)
+		return scaleNormalBarycentric(ext, hitCoords);
+
+	if (type == PRIMITIVE_SPHERE)
+		return sphereNormal(hitCoords);
+
+	return normalize(cross(prim.v1, prim.v2));
+}
+
+vec3 primitivePosition(uint type, Triangle prim, vec2 hitCoords)
+{
+	if (type == PRIMITIVE_TRIANGLE)
+		return scaleVertexBarycentric(prim, hitCoords);
+
+	if (type == PRIMITIVE_SPHERE)
+		return prim.v0 + sphereNormal(hitCoords) * prim.v1.x;
+
+	if (type == PRIMITIVE_QUAD)
+		return prim.v0 + prim.v1 * hitCoords.x + prim.v2 * hitCoords.y;
+
+	float angle = hitCoords.y * F32_2PI;
+	return prim.v0 + (prim.v1 * cos(angle) + prim.v2 * sin(angle)) * hitCoords.x;
+}
+
+// Hit coordinates of a point distributed uniformly over the primitive area, mirrors AnalyticPrimitive::sampleCoordinates
+vec2 primitiveSampleCoords(uint type, float r0, float r1)
+{
+	if (type == PRIMITIVE_TRIANGLE)
+	{
+		// Barycentric weights of v0 & v2
+		float sqrtR0 = sqrt(r0);
+		return vec2(1.0 - sqrtR0, r1 * sqrtR0);
+	}
+
+	if (type == PRIMITIVE_SPHERE)
+		return vec2(acos(clamp(1.0 - 2.0 * r0, -1.0, 1.0)) / F32_PI, r1);
+
+	if (type == PRIMITIVE_DISK)
+		return vec2(sqrt(r0), r1);
+
+	return vec2(r0, r1);
+}
+
+// Point on the sphere cap visible from the receiver, uniform by solid angle. Returns its area measure density, mirrors AnalyticPrimitive::sampleSphereCap
+float sphereCapSample(vec3 center, float radius, vec3 receiver, float r0, float r1, out vec3 position, out vec3 normal)
+{
+	vec3 toCenter = center - receiver;
+	float distanceSquared = dot(toCenter, toCenter);
+	float sinMaxSquared = radius * radius / distanceSquared;
+	if (sinMaxSquared >= 1.0)
+	{
+		normal = sphereNormal(primitiveSampleCoords(PRIMITIVE_SPHERE, r0, r1));
+		position = center + normal * radius;
+		return 1.0 / (4.0 * F32_PI * radius * radius);
+	}
+
+	// 1 - cos written through the sine, so the cap of a distant sphere keeps its precision
+	float capHeight = sinMaxSquared / (1.0 + sqrt(1.0 - sinMaxSquared));
+	float oneMinusCos = r0 * capHeight;
+	float cosTheta = 1.0 - oneMinusCos;
+	float sinThetaSquared = oneMinusCos * (2.0 - oneMinusCos);
+	float sinTheta = sqrt(sinThetaSquared);
+	float phi = F32_2PI * r1;
+
+	float centerDistance = sqrt(distanceSquared);
+	vec3 axis = toCenter / centerDistance;
+	vec3 tangent = normalize(cross(axis, abs(axis.x) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0)));
+	vec3 bitangent = cross(axis, tangent);
+	vec3 direction = tangent * (sinTheta * cos(phi)) + bitangent * (sinTheta * sin(phi)) + axis * cosTheta;
+
+	float t = centerDistance * cosTheta - sqrt(max(radius * radius - distanceSquared * sinThetaSquared, 0.0));
+	position = receiver + direction * t;
+	normal = normalize(position - center);
+
+	float cosLight = max(dot(normal, -direction), 0.0);
+	return cosLight / (t * t * F32_2PI * capHeight);
+}
+
+// World space area, exact under affine transforms except for spheres, which assume a uniform scale
+float primitiveArea(uint type, Triangle prim, mat3x4 transform)
+{
+	if (type == PRIMITIVE_SPHERE)
+	{
+		float radius = length(vec4(prim.v1.x, 0.0, 0.0, 0.0) * transform);
+		return 4.0 * F32_PI * radius * radius;
+	}
+
+	if (type == PRIMITIVE_TRIANGLE)
+	{
+		vec3 a = vec4(prim.v1 - prim.v0, 0.0) * transform;
+		vec3 b = vec4(prim.v2 - prim.v0, 0.0) * transform;
+		return 0.5 * length(cross(a, b));
+	}
+
+	float parallelogramArea = length(cross(vec4(prim.v1, 0.0) * transform, vec4(prim.v2, 0.0) * transform));
+	return type == PRIMITIVE_QUAD ? parallelogramArea : F32_PI * parallelogramArea;
+}
+
 float aabbIntersect(BvhNode node, Ray ray)
 {
 	vec3 rDir = 1.0 / ray.direction;
@@ -0,0 +1,89 @@
+#include "wavefront_common.glsl"
+
+#ifndef GLSL_LIGHT_BVH
+#define GLSL_LIGHT_BVH
+
+#define LIGHT_BVH_ROOT_IDX		0
+#define NEE_LIGHT_BVH			1	// Pick emitters with the light BVH, 0 picks them through alias tables. Must match light_bvh.h
+
+// Bounds of the emitters below a node, see LightBvhNode
+struct LightNode
+{
+	vec3 aabbMin;
+	uint left;				// Left child of interior nodes, the right child follows it
+	vec3 aabbMax;
+	float power;
+	vec3 axis;				// Cone around the emitter normals
+	float cosThetaO;
+	float cosThetaE;
+	uint instanceIdx;		// Leaf emitter, UNSET_IDX for interior nodes
+	uint primitiveIdx;
+};
+
+struct AliasEntry
+{
+	float threshold;
+	uint alias;
+	float probability;
+};
+
+struct LightData
+{
+	uint lightInstanceIdx;
+	uint primitiveCount;
+	uint triangleAliasOffset;
+	AliasEntry power;
+};
+
+bool lightNodeIsLeaf(LightNode node)
+{
+	return node.instanceIdx != uint(UNSET_IDX);
+}
+
+// cos(max(0, a - b)) & sin(max(0, a - b)) of two angles given by their sine & cosine
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+	return cosA > cosB ? 1.0 : cosA * cosB + sinA * sinB;
+}
+
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+	return cosA > cosB ? 0.0 : sinA * cosB - cosA * sinB;
+}
+
+float sinFromCos(float cosTheta)
+{
+	return sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+}
+
+// Conservative estimate of the light reaching a diffuse receiver at P with normal N, mirrors LightBvhNode::importance
+float lightNodeImportance(LightNode node, vec3 P, vec3 N)
+{
+	vec3 center = 0.5 * (node.aabbMin + node.aabbMax);
+	vec3 halfExtent = 0.5 * (node.aabbMax - node.aabbMin);
+	float radius2 = dot(halfExtent, halfExtent);
+	vec3 toReceiver = P - center;
+	float distance2 = dot(toReceiver, toReceiver);
+
+	// Receivers inside the bounding sphere may be lit from any direction
+	if (distance2 <= radius2)
+		return node.power / max(radius2, F32_EPSILON);
+
+	vec3 wi = toReceiver / sqrt(distance2);
+	float sinThetaB = sqrt(radius2 / distance2);
+	float cosThetaB = sinFromCos(sinThetaB);
+
+	float cosThetaW = dot(node.axis, wi);
+	float cosThetaX = cosSubClamped(sinFromCos(cosThetaW), cosThetaW, sinFromCos(node.cosThetaO), node.cosThetaO);
+	float sinThetaX = sinSubClamped(sinFromCos(cosThetaW), cosThetaW, sinFromCos(node.cosThetaO), node.cosThetaO);
+	float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+	if (cosThetaP <= node.cosThetaE)
+		return 0.0;
+
+	float cosThetaI = -dot(N, wi);
+	float cosThetaIP = cosSubClamped(sinFromCos(cosThetaI), cosThetaI, sinThetaB, cosThetaB);
+
+	return max(0.0, node.power * cosThetaP * cosThetaIP / distance2);
+}
+
+#endif
@@ -11,6 +11,12 @@
 
 #define UNSET_IDX		~0
 
+// Ray types, see ray.h
+#define VISIBILITY_CAMERA		(1u << 0)
+#define VISIBILITY_INDIRECT		(1u << 1)
+#define VISIBILITY_SHADOW		(1u << 2)
+#define VISIBILITY_ALL			0xFFu
+
 #define WORLD_FORWARD	vec3(0, 0, 1)
 #define WORLD_RIGHT		vec3(-1, 0, 0)
 #define WORLD_UP 		vec3(0, 1, 0)
@@ -43,6 +49,7 @@ struct RayState
 	bool inMedium;
 	bool lastSpecular;
 	uint pixelIdx;
+	uint visibilityMask;	// Ray type, see VISIBILITY_*
 };
 
 struct RayHit
@@ -50,6 +57,7 @@ struct RayHit
 	uint instanceIdx;
 	uint primitiveIdx;
 	vec2 hitCoords;
+	uint nestedInstanceIdx;		// Member of the assembly instanceIdx that was hit, UNSET_IDX for mesh instances
 };
 
 struct Ray
@@ -69,6 +77,7 @@ struct ShadowRayMetadata
 	vec3 IL, LN;
 	vec3 brdf, N;
 	uint hitInstanceIdx, lightInstanceIdx;
+	float lightPdf;		// Area measure
 };
 
 uint WangHash(uint seed)
@@ -187,8 +196,8 @@ Ray newRay(vec3 origin, vec3 direction)
 		F32_FAR_AWAY,
 		vec3(1),
 		vec3(0),
-		RayState(false, true, UNSET_IDX),
-		RayHit(UNSET_IDX, UNSET_IDX, vec2(0))
+		RayState(false, true, UNSET_IDX, VISIBILITY_ALL),
+		RayHit(UNSET_IDX, UNSET_IDX, vec2(0), UNSET_IDX)
 	);
 }
 
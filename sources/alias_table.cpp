@@ -0,0 +1,80 @@
+#include "alias_table.h"
+
+#include <cassert>
+#include <vector>
+
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+void AliasTable::build(const F32* weights, U32 count)
+{
+	assert(weights != nullptr || count == 0);
+
+	m_entries.resize(count);
+	if (count == 0)
+		return;
+
+	F64 totalWeight = 0.0;
+	for (U32 i = 0; i < count; i++)
+	{
+		assert(weights[i] >= 0.0f);
+		totalWeight += weights[i];
+	}
+
+	if (totalWeight <= 0.0)
+	{
+		for (U32 i = 0; i < count; i++)
+			m_entries[i] = AliasEntry{ 1.0f, i, 1.0f / count };
+
+		return;
+	}
+
+	// Weights scaled so the average slot holds 1, slots below it are topped up by a slot above it
+	std::vector<F64> scaled(count);
+	std::vector<U32> small;
+	std::vector<U32> large;
+	for (U32 i = 0; i < count; i++)
+	{
+		scaled[i] = weights[i] * count / totalWeight;
+		m_entries[i].probability = static_cast<F32>(weights[i] / totalWeight);
+
+		if (scaled[i] < 1.0)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		const U32 less = small.back();
+		const U32 more = large.back();
+		small.pop_back();
+		large.pop_back();
+
+		m_entries[less].threshold = static_cast<F32>(scaled[less]);
+		m_entries[less].alias = more;
+
+		scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+		if (scaled[more] < 1.0)
+			small.push_back(more);
+		else
+			large.push_back(more);
+	}
+
+	// Leftovers hold 1 up to rounding errors
+	for (U32 i : small)
+		m_entries[i] = AliasEntry{ 1.0f, i, m_entries[i].probability };
+
+	for (U32 i : large)
+		m_entries[i] = AliasEntry{ 1.0f, i, m_entries[i].probability };
+}
+
+U32 AliasTable::sample(U32& seed) const
+{
+	assert(!m_entries.empty());
+
+	const U32 index = randomRange(seed, 0u, size());
+	const AliasEntry& entry = m_entries[index];
+	return randomF32(seed) < entry.threshold ? index : entry.alias;
+}
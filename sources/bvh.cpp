@@ -1,8 +1,17 @@
 #include "bvh.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <utility>
+#include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bvh_binning.h"
+#include "bvh_morton.h"
 #include "material.h"
 #include "mesh.h"
 #include "ray.h"
@@ -10,9 +19,286 @@
 #include "surf_math.h"
 #include "types.h"
 
-#define TRAVERSAL_STACK_SIZE	64
-#define BIN_COUNT				8
-#define PLANE_COUNT				BIN_COUNT - 1
+#define BIN_COUNT				8	// Binned SAH bin count, 16 or 32 bins trade build time for tree quality
+
+// Spatial splits are only considered when the best object split has child bounds overlapping by more than this fraction of the root area
+#define SBVH_OVERLAP_THRESHOLD	1e-5f
+#define SBVH_MAX_DEPTH			48	// Nodes below this depth only use object splits, bounding the traversal stack depth
+
+// Nodes with fewer primitives than this are subdivided on the current thread instead of spawning a build task
+#define BUILD_TASK_THRESHOLD	1024
+
+#define ROTATION_MIN_GAIN		1e-4f	// Rotations must lower the summed child area by this fraction of the node area
+#define ROTATION_CLOCK_INTERVAL	32		// Nodes visited by optimize() between checks of the time budget
+
+// Runs a recursive BVH build as a tree of OpenMP tasks, idle threads steal pending subtrees from the task pool.
+// When called from an active parallel region (e.g. concurrent BLAS builds) the build joins the existing team.
+template <typename BuildFunc>
+static void runBuildTasks(BuildFunc&& build)
+{
+#ifdef _OPENMP
+	if (omp_in_parallel())
+	{
+#pragma omp taskgroup
+		{
+			build();
+		}
+
+		return;
+	}
+
+#pragma omp parallel
+#pragma omp single
+	build();
+#else
+	build();
+#endif
+}
+
+static void refitFromChildren(BvhNode* nodePool, U32 nodeIndex)
+{
+	BvhNode& node = nodePool[nodeIndex];
+	if (node.isLeaf())
+		return;
+
+	node.bbMin = min(nodePool[node.left()].bbMin, nodePool[node.right()].bbMin);
+	node.bbMax = max(nodePool[node.left()].bbMax, nodePool[node.right()].bbMax);
+}
+
+// Tree rotations after Kopta et al., swapping a child with a grandchild on the other side or two grandchildren on opposite sides.
+// Only the children of the rotated node change bounds, the node itself & all its ancestors stay valid. Swaps move whole subtrees
+// between pool slots, onMove(nodeIndex) is called for both slots so owners can patch their links into the pool.
+// Returns the change in summed child area, 0 if no rotation lowers it enough.
+template <typename MoveFunc>
+static F32 rotateNode(BvhNode* nodePool, U32 nodeIndex, MoveFunc onMove)
+{
+	const BvhNode& node = nodePool[nodeIndex];
+	if (node.isLeaf())
+		return 0.0f;
+
+	const U32 left = node.left();
+	const U32 right = node.right();
+	const BvhNode& leftNode = nodePool[left];
+	const BvhNode& rightNode = nodePool[right];
+	const F32 leftArea = leftNode.bounds().area();
+	const F32 rightArea = rightNode.bounds().area();
+
+	auto unionArea = [nodePool](U32 a, U32 b) {
+		AABB bounds = nodePool[a].bounds();
+		bounds.grow(nodePool[b].bounds());
+		return bounds.area();
+	};
+
+	F32 bestDelta = -ROTATION_MIN_GAIN * node.bounds().area();
+	U32 swapA = 0;
+	U32 swapB = 0;
+	auto consider = [&bestDelta, &swapA, &swapB](F32 delta, U32 a, U32 b) {
+		if (delta < bestDelta)
+		{
+			bestDelta = delta;
+			swapA = a;
+			swapB = b;
+		}
+	};
+
+	if (!rightNode.isLeaf())
+	{
+		consider(unionArea(left, rightNode.right()) - rightArea, left, rightNode.left());
+		consider(unionArea(left, rightNode.left()) - rightArea, left, rightNode.right());
+	}
+
+	if (!leftNode.isLeaf())
+	{
+		consider(unionArea(right, leftNode.right()) - leftArea, right, leftNode.left());
+		consider(unionArea(right, leftNode.left()) - leftArea, right, leftNode.right());
+	}
+
+	if (!leftNode.isLeaf() && !rightNode.isLeaf())
+	{
+		const U32 leftLeft = leftNode.left(), leftRight = leftNode.right();
+		const U32 rightLeft = rightNode.left(), rightRight = rightNode.right();
+		consider(unionArea(rightLeft, leftRight) + unionArea(leftLeft, rightRight) - leftArea - rightArea, leftLeft, rightLeft);
+		consider(unionArea(rightRight, leftRight) + unionArea(rightLeft, leftLeft) - leftArea - rightArea, leftLeft, rightRight);
+	}
+
+	if (swapA == swapB)
+		return 0.0f;
+
+	const BvhNode swapped = nodePool[swapA];
+	nodePool[swapA] = nodePool[swapB];
+	nodePool[swapB] = swapped;
+	onMove(swapA);
+	onMove(swapB);
+
+	refitFromChildren(nodePool, left);
+	refitFromChildren(nodePool, right);
+	return bestDelta;
+}
+
+struct MortonBuild
+{
+	BvhNode* nodePool;
+	U32 nodesUsed;
+	const PrimitiveBounds* primitiveBounds;
+	const U32* indices;
+	const U32* codes;
+	U32 maxLeafSize;
+};
+
+// Splits the Morton sorted primitives of a node at the highest code bit differing within its range, down to maxLeafSize.
+// Only leaf bounds are set, interior bounds are filled in bottom up once the whole tree is emitted.
+static void subdivideMorton(MortonBuild* build, U32 nodeIndex)
+{
+	BvhNode& node = build->nodePool[nodeIndex];
+
+	if (node.count <= build->maxLeafSize)
+	{
+		__m128 bbMin = _mm_set1_ps(F32_INF);
+		__m128 bbMax = _mm_set1_ps(F32_NEG_INF);
+		for (U32 i = 0; i < node.count; i++)
+		{
+			const PrimitiveBounds& primitive = build->primitiveBounds[build->indices[node.first() + i]];
+			bbMin = _mm_min_ps(bbMin, primitive.bbMin);
+			bbMax = _mm_max_ps(bbMax, primitive.bbMax);
+		}
+
+		ALIGN(16) F32 boundsMin[4];
+		ALIGN(16) F32 boundsMax[4];
+		_mm_store_ps(boundsMin, bbMin);
+		_mm_store_ps(boundsMax, bbMax);
+		node.bbMin = Float3(boundsMin[0], boundsMin[1], boundsMin[2]);
+		node.bbMax = Float3(boundsMax[0], boundsMax[1], boundsMax[2]);
+		return;
+	}
+
+	const U32 leftCount = findMortonSplit(build->codes + node.first(), node.count);
+
+	U32 leftIndex = 0;
+#pragma omp atomic capture
+	{ leftIndex = build->nodesUsed; build->nodesUsed += 2; }
+	U32 rightIndex = leftIndex + 1;
+
+	BvhNode& left = build->nodePool[leftIndex];
+	left.leftFirst = node.first();
+	left.count = leftCount;
+
+	BvhNode& right = build->nodePool[rightIndex];
+	right.leftFirst = node.first() + leftCount;
+	right.count = node.count - leftCount;
+
+	node.leftFirst = leftIndex;
+	node.count = 0;
+
+#pragma omp task if(leftCount > BUILD_TASK_THRESHOLD)
+	subdivideMorton(build, leftIndex);
+	subdivideMorton(build, rightIndex);
+}
+
+// Builds a linear BVH over count primitives into the binary node layout of the binned builders, writing the Morton sorted
+// primitive order to indices. Runs in linear time after the radix sort, returns the number of nodes used.
+static U32 buildMortonNodes(BvhNode* nodePool, const PrimitiveBounds* primitiveBounds, U32 count, U32 maxLeafSize, U32* indices)
+{
+	std::vector<U32> codes(count);
+	sortByMortonCode(primitiveBounds, count, indices, codes.data());
+
+	BvhNode& rootNode = nodePool[BVH_ROOT_INDEX];
+	rootNode.leftFirst = 0;
+	rootNode.count = count;
+
+	MortonBuild build = { nodePool, 2, primitiveBounds, indices, codes.data(), maxLeafSize };
+	runBuildTasks([&build]() { subdivideMorton(&build, BVH_ROOT_INDEX); });
+
+	// Children are always allocated after their parent, so a reverse sweep over the pool visits them first
+	for (U32 nodeIndex = build.nodesUsed - 1; nodeIndex >= 2; nodeIndex--)
+		refitFromChildren(nodePool, nodeIndex);
+
+	refitFromChildren(nodePool, BVH_ROOT_INDEX);
+	return build.nodesUsed;
+}
+
+// Moves the nodes of a binary pool into depth first order, every sibling pair is followed by the pairs below the left child and then the
+// pairs below the right child. Leaf index ranges are moved into the same order, so both arrays are read front to back by a traversal
+// visiting left children first. Unreachable nodes are dropped, returns the number of nodes used by the new layout.
+static U32 reorderDepthFirst(BvhNode* nodePool, U32 nodesUsed, U32* indices, SizeType indexCount)
+{
+	struct ReorderEntry
+	{
+		U32 oldIndex;
+		U32 newIndex;
+	};
+
+	const std::vector<BvhNode> oldNodes(nodePool, nodePool + nodesUsed);
+	const std::vector<U32> oldIndices(indices, indices + indexCount);
+
+	U32 newNodesUsed = 2;
+	U32 newIndexCount = 0;
+	std::vector<ReorderEntry> stack = { ReorderEntry{ BVH_ROOT_INDEX, BVH_ROOT_INDEX } };
+	while (!stack.empty())
+	{
+		const ReorderEntry entry = stack.back();
+		stack.pop_back();
+
+		BvhNode node = oldNodes[entry.oldIndex];
+		if (node.isLeaf())
+		{
+			memcpy(indices + newIndexCount, oldIndices.data() + node.first(), node.count * sizeof(U32));
+			node.leftFirst = newIndexCount;
+			newIndexCount += node.count;
+		}
+		else
+		{
+			const U32 pairIndex = newNodesUsed;
+			newNodesUsed += 2;
+
+			stack.push_back(ReorderEntry{ node.right(), pairIndex + 1 });
+			stack.push_back(ReorderEntry{ node.left(), pairIndex });
+			node.leftFirst = pairIndex;
+		}
+
+		nodePool[entry.newIndex] = node;
+	}
+
+	assert(newNodesUsed <= nodesUsed);
+	assert(newIndexCount == indexCount);
+	return newNodesUsed;
+}
+
+// Visits the nodes of a binary pool from the cursor downwards, wrapping around, until the time budget is spent or a full
+// sweep applied no rotation. Returns true if any call of rotate(nodeIndex) did rotate.
+template <typename RotateFunc>
+static bool runRotations(U32 nodesUsed, U32& cursor, F32 timeBudget, RotateFunc rotate)
+{
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point start = Clock::now();
+
+	if (cursor >= nodesUsed)
+		cursor = nodesUsed - 1;
+
+	bool rotated = false;
+	U32 visited = 0;
+	U32 sinceRotation = 0;
+	while (sinceRotation < nodesUsed)
+	{
+		const U32 nodeIndex = cursor;
+		cursor = (cursor == 0) ? nodesUsed - 1 : cursor - 1;
+
+		if (nodeIndex != 1 && rotate(nodeIndex))
+		{
+			rotated = true;
+			sinceRotation = 0;
+		}
+		else
+		{
+			sinceRotation++;
+		}
+
+		if (++visited % ROTATION_CLOCK_INTERVAL == 0
+			&& std::chrono::duration<F32>(Clock::now() - start).count() >= timeBudget)
+			break;
+	}
+
+	return rotated;
+}
 
 void AABB::grow(const Float3& point)
 {
@@ -34,77 +320,81 @@ F32 AABB::area() const
 
 Float3 AABB::center() const
 {
-	return 0.5f * (bbMax - bbMin);
+	return 0.5f * (bbMin + bbMax);
 }
 
-F32 AABB::intersect(Ray& ray) const
+static bool isEmpty(const AABB& bounds)
 {
-	// calculate direction reciprocal once
-	Float3 rDir = Float3(1.0f) / ray.direction;
-
-	F32 txNear = (bbMin.x - ray.origin.x) * rDir.x;
-	F32 txFar = (bbMax.x - ray.origin.x) * rDir.x;
-	F32 tmin = min(txNear, txFar);
-	F32 tmax = max(txNear, txFar);
-
-	F32 tyNear = (bbMin.y - ray.origin.y) * rDir.y;
-	F32 tyFar = (bbMax.y - ray.origin.y) * rDir.y;
-	tmin = max(tmin, min(tyNear, tyFar));
-	tmax = min(tmax, max(tyNear, tyFar));
-
-	F32 tzNear = (bbMin.z - ray.origin.z) * rDir.z;
-	F32 tzFar = (bbMax.z - ray.origin.z) * rDir.z;
-	tmin = max(tmin, min(tzNear, tzFar));
-	tmax = min(tmax, max(tzNear, tzFar));
-
-	if (tmax >= tmin && tmin < ray.depth && tmax > 0.0f)
-	{
-		return tmin;
-	}
-
-	return F32_FAR_AWAY;
+	return bounds.bbMin.x > bounds.bbMax.x || bounds.bbMin.y > bounds.bbMax.y || bounds.bbMin.z > bounds.bbMax.z;
 }
 
-BvhBLAS::BvhBLAS(Mesh* mesh)
+BvhBLAS::BvhBLAS(Mesh* mesh, bool deferBuild, BvhBuildMode buildMode, F32 indexBudget)
 	:
 	m_mesh(mesh),
-	m_triCount(mesh->triangles.size()),
+	m_buildMode(mesh->isAnalytic() && buildMode == BvhBuildMode::SpatialSplits ? BvhBuildMode::BinnedSAH : buildMode),
+	m_indexBudget(indexBudget),
+	m_triCount(mesh->primitiveCount()),
+	m_indexCount(m_triCount),
 	m_indices(new U32[m_triCount]{}),
 	m_nodesUsed(2),
-	m_nodePool(static_cast<BvhNode*>(MALLOC64(2 * m_triCount * sizeof(BvhNode))))
+	m_nodeCapacity(0),
+	m_nodePool(nullptr),
+	m_leafBlockCount(0),
+	m_leafBlocks(nullptr),
+	m_rotationCursor(0),
+	m_buildTime(0.0f)
 {
-	assert(m_nodePool != nullptr && m_indices != nullptr);
-	memset(m_nodePool, 0, 2 * m_triCount * sizeof(BvhNode));
+	assert(m_indices != nullptr);
+	assert(indexBudget >= 1.0f);
+	resizeNodePool(static_cast<U32>(2 * m_triCount));
 
 	// Fill out indices array
 	for (SizeType idx = 0; idx < m_triCount; idx++)
 		m_indices[idx] = static_cast<U32>(idx);
 
-	// Build BVH based on loaded mesh
-	build();
+	// Build BVH based on loaded mesh, deferred builds are expected to be started by the owner (e.g. using buildConcurrent)
+	if (!deferBuild)
+		build();
 }
 
 BvhBLAS::~BvhBLAS()
 {
 	delete[] m_indices;
 	FREE64(m_nodePool);
+	FREE64(m_leafBlocks);
 }
 
 BvhBLAS::BvhBLAS(const BvhBLAS& other) noexcept
 	:
 	m_mesh(other.m_mesh),
+	m_buildMode(other.m_buildMode),
+	m_indexBudget(other.m_indexBudget),
 	m_triCount(other.m_triCount),
+	m_indexCount(other.m_indexCount),
 	m_indices(nullptr),
 	m_nodesUsed(other.m_nodesUsed),
-	m_nodePool(nullptr)
+	m_nodeCapacity(other.m_nodeCapacity),
+	m_nodePool(nullptr),
+	m_wideBvh(other.m_wideBvh),
+	m_leafBlockCount(other.m_leafBlockCount),
+	m_leafBlocks(nullptr),
+	m_rotationCursor(other.m_rotationCursor),
+	m_buildTime(other.m_buildTime)
 {
-	m_indices = new U32[m_triCount];
-	m_nodePool = static_cast<BvhNode*>(MALLOC64(2 * m_triCount * sizeof(BvhNode)));
+	m_indices = new U32[m_indexCount];
+	m_nodePool = static_cast<BvhNode*>(MALLOC64(m_nodeCapacity * sizeof(BvhNode)));
 
 	assert(m_nodePool != nullptr && m_indices != nullptr);
 
-	memcpy(m_indices, other.m_indices, sizeof(U32) * m_triCount);
-	memcpy(m_nodePool, other.m_nodePool, 2 * m_triCount * sizeof(BvhNode));
+	memcpy(m_indices, other.m_indices, sizeof(U32) * m_indexCount);
+	memcpy(m_nodePool, other.m_nodePool, m_nodeCapacity * sizeof(BvhNode));
+
+	if (m_leafBlockCount != 0)
+	{
+		m_leafBlocks = static_cast<Triangle4*>(MALLOC64(m_leafBlockCount * sizeof(Triangle4)));
+		assert(m_leafBlocks != nullptr);
+		memcpy(m_leafBlocks, other.m_leafBlocks, m_leafBlockCount * sizeof(Triangle4));
+	}
 }
 
 BvhBLAS& BvhBLAS::operator=(const BvhBLAS& other) noexcept
@@ -115,265 +405,498 @@ BvhBLAS& BvhBLAS::operator=(const BvhBLAS& other) noexcept
 	}
 
 	this->m_mesh = other.m_mesh;
+	this->m_buildMode = other.m_buildMode;
+	this->m_indexBudget = other.m_indexBudget;
 	this->m_triCount = other.m_triCount;
-	this->m_indices = new U32[m_triCount]{};
-	memcpy(this->m_indices, other.m_indices, sizeof(U32) * m_triCount);
+	this->m_indexCount = other.m_indexCount;
+	this->m_indices = new U32[m_indexCount]{};
+	memcpy(this->m_indices, other.m_indices, sizeof(U32) * m_indexCount);
 
 	this->m_nodesUsed = other.m_nodesUsed;
-	this->m_nodePool = static_cast<BvhNode*>(MALLOC64(2 * m_triCount * sizeof(BvhNode)));
-	memcpy(m_nodePool, other.m_nodePool, 2 * m_triCount * sizeof(BvhNode));
+	this->m_nodeCapacity = other.m_nodeCapacity;
+	this->m_nodePool = static_cast<BvhNode*>(MALLOC64(m_nodeCapacity * sizeof(BvhNode)));
+	memcpy(m_nodePool, other.m_nodePool, m_nodeCapacity * sizeof(BvhNode));
+	this->m_wideBvh = other.m_wideBvh;
+	this->m_rotationCursor = other.m_rotationCursor;
+	this->m_buildTime = other.m_buildTime;
+
+	FREE64(this->m_leafBlocks);
+	this->m_leafBlocks = nullptr;
+	this->m_leafBlockCount = other.m_leafBlockCount;
+	if (m_leafBlockCount != 0)
+	{
+		this->m_leafBlocks = static_cast<Triangle4*>(MALLOC64(m_leafBlockCount * sizeof(Triangle4)));
+		assert(m_leafBlocks != nullptr);
+		memcpy(m_leafBlocks, other.m_leafBlocks, m_leafBlockCount * sizeof(Triangle4));
+	}
 
 	return *this;
 }
 
-bool BvhBLAS::intersect(Ray& ray) const
+void IAccelerationStructure::intersect(RayPacket& packet, U32 firstActive) const
 {
-	BvhNode* node = &m_nodePool[BVH_ROOT_INDEX];
-	BvhNode* stack[TRAVERSAL_STACK_SIZE]{};
-	SizeType stackPtr = 0;
-
-	bool intersected = false;
-	while(true)
+	// Lanes before the first active lane missed the structure bounds already
+	for (U32 lane = firstActive; lane < packet.laneCount; lane++)
 	{
-		if (node->isLeaf())
+		ALIGN(16) F32 originX[4], originY[4], originZ[4], directionX[4], directionY[4], directionZ[4];
+		ALIGN(16) F32 depths[4], u[4], v[4];
+		ALIGN(16) U32 primitives[4];
+		_mm_store_ps(originX, packet.originX[lane]);
+		_mm_store_ps(originY, packet.originY[lane]);
+		_mm_store_ps(originZ, packet.originZ[lane]);
+		_mm_store_ps(directionX, packet.directionX[lane]);
+		_mm_store_ps(directionY, packet.directionY[lane]);
+		_mm_store_ps(directionZ, packet.directionZ[lane]);
+		_mm_store_ps(depths, packet.depth[lane]);
+		_mm_store_ps(u, packet.hitU[lane]);
+		_mm_store_ps(v, packet.hitV[lane]);
+		_mm_store_si128(reinterpret_cast<__m128i*>(primitives), packet.primitiveIndex[lane]);
+
+		// Padding rays keep the depth that stops them from registering hits
+		for (U32 i = 0; i < 4; i++)
 		{
-			for (U32 i = 0; i < node->count; i++)
-			{
-				U32 primitiveIndex = m_indices[node->first() + i];
-				const Triangle& tri = m_mesh->triangles[primitiveIndex];
+			Ray ray(Float3(originX[i], originY[i], originZ[i]), Float3(directionX[i], directionY[i], directionZ[i]), packet.visibilityMask);
+			ray.depth = depths[i];
+			if (!intersect(ray))
+				continue;
+
+			depths[i] = ray.depth;
+			u[i] = ray.metadata.hitCoordinates.x;
+			v[i] = ray.metadata.hitCoordinates.y;
+			primitives[i] = ray.metadata.primitiveIndex;
+		}
 
-				if (tri.intersect(ray))
-				{
-					intersected = true;
-					ray.metadata.primitiveIndex = primitiveIndex;
-				}
-			}
+		packet.depth[lane] = _mm_load_ps(depths);
+		packet.hitU[lane] = _mm_load_ps(u);
+		packet.hitV[lane] = _mm_load_ps(v);
+		packet.primitiveIndex[lane] = _mm_load_si128(reinterpret_cast<const __m128i*>(primitives));
+	}
+}
 
-			if (stackPtr == 0)
-				break;
+void IAccelerationStructure::intersect(Ray* rays, U32 rayCount, StreamWorkspace&) const
+{
+	assert(rays != nullptr);
 
-			node = stack[stackPtr - 1];
-			stackPtr--;
-			continue;
-		}
+	for (U32 i = 0; i < rayCount; i++)
+		intersect(rays[i]);
+}
 
-		BvhNode* childNear = &m_nodePool[node->left()];
-		BvhNode* childFar = &m_nodePool[node->right()];
+void IAccelerationStructure::intersectAny(Ray* rays, U32 rayCount, StreamWorkspace&) const
+{
+	assert(rays != nullptr);
 
-		F32 distNear = childNear->boundingBox.intersect(ray);
-		F32 distFar = childFar->boundingBox.intersect(ray);
+	// Rays with a primitive set are occluded already
+	for (U32 i = 0; i < rayCount; i++)
+	{
+		if (rays[i].metadata.primitiveIndex == UNSET_INDEX)
+			intersectAny(rays[i]);
+	}
+}
 
-		if (distNear > distFar) {
-			swap(distNear, distFar);
-			swap(childNear, childFar);
-		}
+bool BvhBLAS::intersect(Ray& ray) const
+{
+	return traverse<false>(ray, TraversalRay(ray));
+}
 
-		if (distNear == F32_FAR_AWAY)
-		{
-			if (stackPtr == 0)
-				break;
+bool BvhBLAS::intersectAny(Ray& ray) const
+{
+	return traverse<true>(ray, TraversalRay(ray));
+}
 
-			node = stack[stackPtr - 1];
-			stackPtr--;
-		}
-		else
+bool BvhBLAS::intersect(Ray& ray, const TraversalRay& traversalRay) const
+{
+	return traverse<false>(ray, traversalRay);
+}
+
+bool BvhBLAS::intersectAny(Ray& ray, const TraversalRay& traversalRay) const
+{
+	return traverse<true>(ray, traversalRay);
+}
+
+template <bool AnyHit>
+bool BvhBLAS::intersectPrimitives(Ray& ray, U32 first, U32 count) const
+{
+	bool intersected = false;
+	for (U32 i = 0; i < count; i++)
+	{
+		U32 primitiveIndex = m_indices[first + i];
+
+		if (m_mesh->intersect(primitiveIndex, ray))
 		{
-			node = childNear;
-			if (distFar != F32_FAR_AWAY)
-			{
-				stack[stackPtr] = childFar;
-				stackPtr++;
-			}
+			if (AnyHit)
+				return true;
+
+			intersected = true;
+			ray.metadata.primitiveIndex = primitiveIndex;
 		}
 	}
 
 	return intersected;
 }
 
-bool BvhBLAS::intersectAny(Ray& ray) const
+template <bool AnyHit>
+void BvhBLAS::intersectPrimitives(Ray* rays, const StreamRay* activeRays, U32 rayCount, U32 first, U32 count) const
 {
-	BvhNode* node = &m_nodePool[BVH_ROOT_INDEX];
-	BvhNode* stack[TRAVERSAL_STACK_SIZE]{};
-	SizeType stackPtr = 0;
-
-	while (true)
+	// Primitives are the outer loop, so every primitive is fetched once for all rays in the leaf
+	for (U32 i = 0; i < count; i++)
 	{
-		if (node->isLeaf())
+		U32 primitiveIndex = m_indices[first + i];
+
+		for (U32 r = 0; r < rayCount; r++)
 		{
-			for (U32 i = 0; i < node->count; i++)
-			{
-				U32 primitiveIndex = m_indices[node->first() + i];
-				const Triangle& tri = m_mesh->triangles[primitiveIndex];
+			Ray& ray = rays[activeRays[r].rayIndex];
+			if (AnyHit && ray.metadata.primitiveIndex != UNSET_INDEX)
+				continue;
 
-				if (tri.intersect(ray))
-				{
+			if (m_mesh->intersect(primitiveIndex, ray))
+				ray.metadata.primitiveIndex = primitiveIndex;
+		}
+	}
+}
+
+template <bool AnyHit>
+bool BvhBLAS::traverse(Ray& ray, const TraversalRay& traversalRay) const
+{
+#if BVH_WIDE_TRAVERSAL == 1
+	// Wide leaves reference their first leaf block, the count is still the triangle count
+	auto intersectLeaf = [this](Ray& ray, U32 first, U32 count) {
+		if (m_mesh->isAnalytic())
+			return intersectPrimitives<AnyHit>(ray, first, count);
+
+		bool intersected = false;
+		const U32 lastBlock = first + blockCount<TRIANGLE4_WIDTH>(count);
+		for (U32 block = first; block < lastBlock; block++)
+		{
+			if (m_leafBlocks[block].intersect(ray))
+			{
+				if (AnyHit)
 					return true;
-				}
+
+				intersected = true;
 			}
+		}
 
-			if (stackPtr == 0)
-				break;
+		return intersected;
+	};
 
-			node = stack[stackPtr - 1];
-			stackPtr--;
-			continue;
-		}
+	return m_wideBvh.intersect<AnyHit>(ray, traversalRay, intersectLeaf);
+#else
+	auto intersectLeaf = [this](Ray& ray, U32 first, U32 count) {
+		return intersectPrimitives<AnyHit>(ray, first, count);
+	};
 
-		BvhNode* childNear = &m_nodePool[node->left()];
-		BvhNode* childFar = &m_nodePool[node->right()];
+	const BvhNode& root = m_nodePool[BVH_ROOT_INDEX];
+	return traverseBvh<AnyHit>(m_nodePool, TraversalEntry{ root.leftFirst, root.count, 0.0f }, traversalRay, ray, intersectLeaf);
+#endif
+}
 
-		F32 distNear = childNear->boundingBox.intersect(ray);
-		F32 distFar = childFar->boundingBox.intersect(ray);
+void BvhBLAS::intersect(RayPacket& packet, U32 firstActive) const
+{
+	// Packet leaves are intersected triangle by triangle over all lanes, analytic primitives trace the lanes one by one
+	if (m_mesh->isAnalytic())
+	{
+		IAccelerationStructure::intersect(packet, firstActive);
+		return;
+	}
 
-		if (distNear > distFar) {
-			swap(distNear, distFar);
-			swap(childNear, childFar);
+	// Packets are traversed over the binary nodes, the interval culling works on any node bounds
+	traversePacket(m_nodePool, BVH_ROOT_INDEX, firstActive, packet, [this](RayPacket& packet, U32 first, U32 count, U32 firstActive) {
+		for (U32 i = 0; i < count; i++)
+		{
+			U32 primitiveIndex = m_indices[first + i];
+			const Triangle& tri = m_mesh->triangles[primitiveIndex];
+			packet.intersectTriangle(firstActive, tri.v0.xyz, tri.v1.xyz, tri.v2.xyz, primitiveIndex);
 		}
+	});
+}
 
-		if (distNear == F32_FAR_AWAY)
-		{
-			if (stackPtr == 0)
-				break;
+void BvhBLAS::intersect(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const
+{
+	traverseStream<false>(rays, rayCount, workspace);
+}
 
-			node = stack[stackPtr - 1];
-			stackPtr--;
+void BvhBLAS::intersectAny(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const
+{
+	traverseStream<true>(rays, rayCount, workspace);
+}
+
+template <bool AnyHit>
+void BvhBLAS::traverseStream(Ray* rays, U32 rayCount, StreamWorkspace& workspace) const
+{
+#if BVH_WIDE_TRAVERSAL == 1
+	auto intersectLeaf = [this](Ray* rays, const StreamRay* activeRays, U32 rayCount, U32 first, U32 count) {
+		if (m_mesh->isAnalytic())
+		{
+			intersectPrimitives<AnyHit>(rays, activeRays, rayCount, first, count);
+			return;
 		}
-		else
+
+		// Blocks are the outer loop, so every block is fetched once for all rays in the leaf
+		const U32 lastBlock = first + blockCount<TRIANGLE4_WIDTH>(count);
+		for (U32 block = first; block < lastBlock; block++)
 		{
-			node = childNear;
-			if (distFar != F32_FAR_AWAY)
+			for (U32 r = 0; r < rayCount; r++)
 			{
-				stack[stackPtr] = childFar;
-				stackPtr++;
+				Ray& ray = rays[activeRays[r].rayIndex];
+				if (AnyHit && ray.metadata.primitiveIndex != UNSET_INDEX)
+					continue;
+
+				m_leafBlocks[block].intersect(ray);
 			}
 		}
-	}
+	};
 
-	return false;
+	traverseBvhStream<AnyHit>(m_wideBvh.nodePool(), TraversalEntry{ WIDE_BVH_ROOT_INDEX, 0, 0.0f }, rays, rayCount, workspace, intersectLeaf);
+#else
+	auto intersectLeaf = [this](Ray* rays, const StreamRay* activeRays, U32 rayCount, U32 first, U32 count) {
+		intersectPrimitives<AnyHit>(rays, activeRays, rayCount, first, count);
+	};
+
+	const BvhNode& root = m_nodePool[BVH_ROOT_INDEX];
+	traverseBvhStream<AnyHit>(m_nodePool, TraversalEntry{ root.leftFirst, root.count, 0.0f }, rays, rayCount, workspace, intersectLeaf);
+#endif
 }
 
 void BvhBLAS::build()
 {
+	build(m_buildMode);
+}
+
+void BvhBLAS::build(BvhBuildMode buildMode)
+{
+	const std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+
+	// Spatial splits clip triangles, analytic primitives are only split by object
+	if (m_mesh->isAnalytic() && buildMode == BvhBuildMode::SpatialSplits)
+		buildMode = BvhBuildMode::BinnedSAH;
+
+	// Spatial splits may reference a primitive multiple times, the total reference count is limited by the index budget
+	SizeType maxReferences = m_triCount;
+	if (buildMode == BvhBuildMode::SpatialSplits)
+		maxReferences = static_cast<SizeType>(m_indexBudget * static_cast<F32>(m_triCount));
+
+	// A binary BVH over N references uses at most 2N nodes, the pool is trimmed to the used nodes after building
+	if (m_nodeCapacity < 2 * maxReferences)
+		resizeNodePool(static_cast<U32>(2 * maxReferences));
+
 	// Reset nodes used
 	m_nodesUsed = 2;
 
 	BvhNode& rootNode = m_nodePool[BVH_ROOT_INDEX];
 	rootNode.leftFirst = 0;
 	rootNode.count = static_cast<U32>(m_triCount);
+	rootNode.setBounds(AABB());
 
-	updateNodeBounds(BVH_ROOT_INDEX);
-	subdivide(BVH_ROOT_INDEX);
-}
-
-void BvhBLAS::refit()
-{
-	for (I64 i = m_nodesUsed - 1; i >= 0; i--)
+	if (buildMode == BvhBuildMode::SpatialSplits)
+	{
+		buildSpatial(maxReferences);
+	}
+	else
 	{
-		if (i == 1) continue;
+		// Object splits reference every primitive once, a previous spatial split build may have left duplicated references
+		if (m_indexCount != m_triCount)
+		{
+			delete[] m_indices;
+			m_indexCount = m_triCount;
+			m_indices = new U32[m_indexCount]{};
+		}
+
+		for (SizeType i = 0; i < m_triCount; i++)
+			m_indices[i] = static_cast<U32>(i);
 
-		if (m_nodePool[i].isLeaf())
+		// Primitive bounds & centroids are calculated once, instead of for every split evaluation
+		m_buildBounds.resize(m_triCount);
+		for (SizeType i = 0; i < m_triCount; i++)
 		{
-			updateNodeBounds(i);
-			continue;
+			if (m_mesh->isAnalytic())
+			{
+				Float3 bbMin, bbMax;
+				m_mesh->bounds(i, bbMin, bbMax);
+
+				const __m128 boundsMin = _mm_setr_ps(bbMin.x, bbMin.y, bbMin.z, 0.0f);
+				const __m128 boundsMax = _mm_setr_ps(bbMax.x, bbMax.y, bbMax.z, 0.0f);
+				m_buildBounds[i] = PrimitiveBounds{ boundsMin, boundsMax, _mm_mul_ps(_mm_add_ps(boundsMin, boundsMax), _mm_set1_ps(0.5f)) };
+				continue;
+			}
+
+			const Triangle& tri = m_mesh->triangles[i];
+			const __m128 v0 = _mm_load_ps(tri.v0.xyz);
+			const __m128 v1 = _mm_load_ps(tri.v1.xyz);
+			const __m128 v2 = _mm_load_ps(tri.v2.xyz);
+
+			m_buildBounds[i] = PrimitiveBounds{
+				_mm_min_ps(v0, _mm_min_ps(v1, v2)),
+				_mm_max_ps(v0, _mm_max_ps(v1, v2)),
+				_mm_mul_ps(_mm_add_ps(_mm_add_ps(v0, v1), v2), _mm_set1_ps(0.333f))
+			};
 		}
 
-		BvhNode& node = m_nodePool[i];
-		const BvhNode& left = m_nodePool[node.left()];
-		const BvhNode& right = m_nodePool[node.right()];
+		if (buildMode == BvhBuildMode::Morton)
+		{
+			m_nodesUsed = buildMortonNodes(m_nodePool, m_buildBounds.data(), static_cast<U32>(m_triCount), BVH_LEAF_BLOCK_SIZE, m_indices);
+		}
+		else
+		{
+			updateNodeBounds(BVH_ROOT_INDEX);
+			runBuildTasks([this]() { subdivide(BVH_ROOT_INDEX); });
+		}
 
-		node.boundingBox.bbMin = min(left.boundingBox.bbMin, right.boundingBox.bbMin);
-		node.boundingBox.bbMax = max(left.boundingBox.bbMax, right.boundingBox.bbMax);
+		std::vector<PrimitiveBounds>().swap(m_buildBounds);
 	}
+
+#if BVH_DEPTH_FIRST_LAYOUT == 1
+	m_nodesUsed = reorderDepthFirst(m_nodePool, m_nodesUsed, m_indices, m_indexCount);
+#endif
+
+	resizeNodePool(m_nodesUsed);
+
+#if BVH_WIDE_TRAVERSAL == 1
+	m_wideBvh.collapse(m_nodePool, m_nodesUsed);
+	buildLeafBlocks();
+#endif
+
+	m_buildTime = std::chrono::duration<F32>(std::chrono::steady_clock::now() - buildStart).count();
 }
 
-F32 BvhBLAS::calculateNodeCost(const BvhNode& node) const
+void BvhBLAS::swapTree(BvhBLAS& other) noexcept
 {
-	return static_cast<F32>(node.count) * node.boundingBox.area();
+	assert(m_mesh == other.m_mesh);
+
+	std::swap(m_indexCount, other.m_indexCount);
+	std::swap(m_indices, other.m_indices);
+	std::swap(m_nodesUsed, other.m_nodesUsed);
+	std::swap(m_nodeCapacity, other.m_nodeCapacity);
+	std::swap(m_nodePool, other.m_nodePool);
+	m_wideBvh.swap(other.m_wideBvh);
+	std::swap(m_leafBlockCount, other.m_leafBlockCount);
+	std::swap(m_leafBlocks, other.m_leafBlocks);
+	std::swap(m_rotationCursor, other.m_rotationCursor);
+	std::swap(m_buildTime, other.m_buildTime);
+	m_buildBounds.swap(other.m_buildBounds);
 }
 
-F32 BvhBLAS::findSplitPlane(const BvhNode& node, F32& cost, U32& axis) const
+void BvhBLAS::buildConcurrent(const std::vector<BvhBLAS*>& blasList)
 {
-	F32 bestCost = F32_INF;
-	F32 bestSplit = 0.0f;
-	U32 bestAxis = 0;
+	// Every BLAS build is its own root task, subtrees of all BLASses are load balanced over the same team
+#pragma omp parallel
+#pragma omp single
+	for (BvhBLAS* blas : blasList)
+	{
+		assert(blas != nullptr);
 
-	for (U32 axis = 0; axis < 3; axis++)
+#pragma omp task firstprivate(blas)
+		blas->build();
+	}
+}
+
+void BvhBLAS::refit()
+{
+	// Rotations can move children in front of their parent in the pool, so nodes are refitted in reverse breadth first order
+	std::vector<U32> order;
+	order.reserve(m_nodesUsed);
+	order.push_back(BVH_ROOT_INDEX);
+	for (SizeType i = 0; i < order.size(); i++)
 	{
-		// Calculate centroid based bin extent
-		F32 boundsMin = F32_MAX;
-		F32 boundsMax = F32_MIN;
-		for (SizeType i = 0; i < node.count; i++)
+		const BvhNode& node = m_nodePool[order[i]];
+		if (!node.isLeaf())
 		{
-			SizeType idx = node.first() + i;
-			const Triangle& tri = m_mesh->triangles[m_indices[idx]];
-
-			boundsMin = min(boundsMin, tri.centroid[axis]);
-			boundsMax = max(boundsMax, tri.centroid[axis]);
+			order.push_back(node.left());
+			order.push_back(node.right());
 		}
+	}
 
-		if (boundsMin == boundsMax)
+	for (SizeType i = order.size(); i-- > 0;)
+	{
+		BvhNode& node = m_nodePool[order[i]];
+		if (node.isLeaf())
 		{
+			node.setBounds(AABB());
+			updateNodeBounds(order[i]);
 			continue;
 		}
 
-		// Populate BVH bins
-		const F32 binScale = static_cast<F32>(BIN_COUNT) / (boundsMax - boundsMin);
-		BvhBin bins[BIN_COUNT];
+		refitFromChildren(m_nodePool, order[i]);
+	}
 
-		for (SizeType i = 0; i < node.count; i++)
-		{
-			SizeType idx = node.first() + i;
-			const Triangle& tri = m_mesh->triangles[m_indices[idx]];
+#if BVH_WIDE_TRAVERSAL == 1
+	// Wide nodes store copies of the child bounds & leaf blocks store copies of the vertices, so both are rebuilt
+	m_wideBvh.collapse(m_nodePool, m_nodesUsed);
+	buildLeafBlocks();
+#endif
+}
 
-			SizeType section = static_cast<SizeType>((tri.centroid[axis] - boundsMin) * binScale);
-			SizeType binIndex = min(BIN_COUNT - 1, section);
-			
-			BvhBin& bin = bins[binIndex];
-			bin.count++;
-			bin.boundingBox.grow(tri.v0);
-			bin.boundingBox.grow(tri.v1);
-			bin.boundingBox.grow(tri.v2);
-		}
+BvhStats BvhBLAS::stats() const
+{
+	BvhStats stats = {};
+	gatherBvhStats(m_nodePool, m_indices, static_cast<U32>(m_triCount), stats,
+		[](U32 count) { return static_cast<F32>(blockCount<BVH_LEAF_BLOCK_SIZE>(count)); },
+		[this](U32 primitive) {
+			AABB bounds = AABB();
+			m_mesh->bounds(primitive, bounds.bbMin, bounds.bbMax);
+			return bounds;
+		},
+		[this](U32 primitive, const Float3& bbMin, const Float3& bbMax) {
+			if (m_mesh->isAnalytic())
+			{
+				// Approximated by the share of the primitive bounds surface area inside the node
+				AABB bounds = AABB();
+				m_mesh->bounds(primitive, bounds.bbMin, bounds.bbMax);
+				const F32 boundsArea = bounds.area();
 
-		// Calculate areas & primitive counts for bins
-		F32 leftArea[PLANE_COUNT]{}, rightArea[PLANE_COUNT]{};
-		U32 leftCount[PLANE_COUNT]{}, rightCount[PLANE_COUNT]{};
-		AABB leftBox = AABB(), rightBox = AABB();
-		U32 leftSum = 0, rightSum = 0;
+				bounds.bbMin = max(bounds.bbMin, bbMin);
+				bounds.bbMax = min(bounds.bbMax, bbMax);
+				if (boundsArea <= 0.0f || isEmpty(bounds))
+					return 0.0f;
 
-		for (SizeType planeIdx = 0; planeIdx < PLANE_COUNT; planeIdx++)
-		{
-			leftSum += bins[planeIdx].count;
-			leftCount[planeIdx] = leftSum;
-			leftBox.grow(bins[planeIdx].boundingBox);
-			leftArea[planeIdx] = leftBox.area();
+				return m_mesh->area(primitive) * bounds.area() / boundsArea;
+			}
 
-			const SizeType RIGHT_BIN = BIN_COUNT - 1 - planeIdx;
-			const SizeType RIGHT_PLANE = RIGHT_BIN - 1;
-			rightSum += bins[RIGHT_BIN].count;
-			rightCount[RIGHT_PLANE] = rightSum;
-			rightBox.grow(bins[RIGHT_BIN].boundingBox);
-			rightArea[RIGHT_PLANE] = rightBox.area();
+			const Triangle& tri = m_mesh->triangles[primitive];
+			return clippedTriangleArea(tri.v0, tri.v1, tri.v2, bbMin, bbMax);
 		}
+	);
 
-		// Calculate best split position
-		F32 binExtent = (boundsMax - boundsMin) / static_cast<F32>(BIN_COUNT);
-		for (SizeType planeIdx = 0; planeIdx < PLANE_COUNT; planeIdx++)
-		{
-			F32 planeCost = leftCount[planeIdx] * leftArea[planeIdx] + rightCount[planeIdx] * rightArea[planeIdx];
+	stats.nodeMemory = nodeMemoryUsage();
+	stats.traversalMemory = m_wideBvh.memoryUsage();
+	stats.leafMemory = leafMemoryUsage();
+	stats.buildTime = m_buildTime;
+	return stats;
+}
 
-			if (planeCost < bestCost)
-			{
-				bestCost = planeCost;
-				bestSplit = boundsMin + binExtent * (planeIdx + 1);
-				bestAxis = axis;
-			}
-		}
+bool BvhBLAS::optimize(F32 timeBudget)
+{
+	bool rotated = runRotations(m_nodesUsed, m_rotationCursor, timeBudget, [this](U32 nodeIndex) {
+		return rotateNode(m_nodePool, nodeIndex, [](U32) {}) < 0.0f;
+	});
+
+#if BVH_DEPTH_FIRST_LAYOUT == 1
+	// Rotations swap subtrees between slots of the pool, undoing the depth first order
+	if (rotated)
+		m_nodesUsed = reorderDepthFirst(m_nodePool, m_nodesUsed, m_indices, m_indexCount);
+#endif
+
+#if BVH_WIDE_TRAVERSAL == 1
+	if (rotated)
+	{
+		m_wideBvh.collapse(m_nodePool, m_nodesUsed);
+		buildLeafBlocks();
 	}
+#endif
 
-	cost = bestCost;
-	axis = bestAxis;
-	return bestSplit;
+	return rotated;
+}
+
+F32 BvhBLAS::calculateNodeCost(const BvhNode& node) const
+{
+	return static_cast<F32>(blockCount<BVH_LEAF_BLOCK_SIZE>(node.count)) * node.bounds().area();
+}
+
+template <U32 BinCount>
+F32 BvhBLAS::findSplitPlane(const BvhNode& node, F32& cost, U32& axis) const
+{
+	return findBinnedSplitPlane<BinCount, BVH_LEAF_BLOCK_SIZE>(node.count, [this, &node](U32 i) {
+		return m_buildBounds[m_indices[node.first() + i]];
+	}, cost, axis);
 }
 
 U32 BvhBLAS::partitionNode(const BvhNode& node, F32 splitPosition, U32 axis) const
@@ -385,8 +908,8 @@ U32 BvhBLAS::partitionNode(const BvhNode& node, F32 splitPosition, U32 axis) con
 
 	while (pivot <= last)
 	{
-		const Triangle& tri = m_mesh->triangles[m_indices[pivot]];
-		if (tri.centroid[axis] < splitPosition)
+		const __m128& centroid = m_buildBounds[m_indices[pivot]].centroid;
+		if (reinterpret_cast<const F32*>(&centroid)[axis] < splitPosition)
 		{
 			pivot++;
 		}
@@ -402,27 +925,39 @@ U32 BvhBLAS::partitionNode(const BvhNode& node, F32 splitPosition, U32 axis) con
 
 void BvhBLAS::updateNodeBounds(SizeType nodeIndex)
 {
-	assert(nodeIndex < 2 * m_triCount);
+	assert(nodeIndex < m_nodeCapacity);
 	BvhNode& node = m_nodePool[nodeIndex];
 
+	AABB bounds = node.bounds();
 	for (SizeType i = 0; i < node.count; i++)
 	{
 		SizeType idx = node.first() + i;
+		if (m_mesh->isAnalytic())
+		{
+			Float3 bbMin, bbMax;
+			m_mesh->bounds(m_indices[idx], bbMin, bbMax);
+			bounds.grow(bbMin);
+			bounds.grow(bbMax);
+			continue;
+		}
+
 		const Triangle& tri = m_mesh->triangles[m_indices[idx]];
-		node.boundingBox.grow(tri.v0);
-		node.boundingBox.grow(tri.v1);
-		node.boundingBox.grow(tri.v2);
+		bounds.grow(tri.v0);
+		bounds.grow(tri.v1);
+		bounds.grow(tri.v2);
 	}
+
+	node.setBounds(bounds);
 }
 
 void BvhBLAS::subdivide(SizeType nodeIndex)
 {
-	assert(nodeIndex < 2 * m_triCount);
+	assert(nodeIndex < m_nodeCapacity);
 	BvhNode& node = m_nodePool[nodeIndex];
 
 	F32 cost = F32_INF;
 	U32 axis = 0;
-	F32 splitPosition = findSplitPlane(node, cost, axis);
+	F32 splitPosition = findSplitPlane<BIN_COUNT>(node, cost, axis);
 	F32 parentCost = calculateNodeCost(node);
 
 	if (cost >= parentCost)
@@ -433,62 +968,502 @@ void BvhBLAS::subdivide(SizeType nodeIndex)
 	U32 pivotPosition = partitionNode(node, splitPosition, axis);
 	U32 leftCount = pivotPosition - node.first();
 
-	if (leftCount == 0 || leftCount == node.count)
+	if (leftCount == 0 || leftCount == node.count)
+	{
+		return;
+	}
+
+	// Child pairs are allocated atomically, concurrent subdivisions only ever touch their own node range
+	U32 leftIndex = 0;
+#pragma omp atomic capture
+	{ leftIndex = m_nodesUsed; m_nodesUsed += 2; }
+	U32 rightIndex = leftIndex + 1;
+
+	// Update left node
+	BvhNode& left = m_nodePool[leftIndex];
+	left.leftFirst = node.first();
+	left.count = leftCount;
+	left.setBounds(AABB());
+
+	// Update right node
+	BvhNode& right = m_nodePool[rightIndex];
+	right.leftFirst = pivotPosition;
+	right.count = node.count - leftCount;
+	right.setBounds(AABB());
+
+	// Update parent node
+	node.leftFirst = leftIndex;
+	node.count = 0;
+
+	updateNodeBounds(leftIndex);
+	updateNodeBounds(rightIndex);
+
+	// Large subtrees are handed to the task pool, the right subtree is always handled by the current thread
+#pragma omp task if(leftCount > BUILD_TASK_THRESHOLD)
+	subdivide(leftIndex);
+	subdivide(rightIndex);
+}
+
+// Bounds of the part of a triangle that lies between 2 planes along an axis
+static AABB clipTriangleBounds(const Triangle& tri, U32 axis, F32 planeMin, F32 planeMax)
+{
+	const Float3 vertices[3] = { tri.v0, tri.v1, tri.v2 };
+	const F32 planes[2] = { planeMin, planeMax };
+
+	AABB bounds = AABB();
+	for (U32 i = 0; i < 3; i++)
+	{
+		const Float3& start = vertices[i];
+		const Float3& end = vertices[(i + 1) % 3];
+
+		if (start[axis] >= planeMin && start[axis] <= planeMax)
+			bounds.grow(start);
+
+		for (F32 plane : planes)
+		{
+			if ((start[axis] < plane && end[axis] > plane) || (start[axis] > plane && end[axis] < plane))
+			{
+				F32 t = (plane - start[axis]) / (end[axis] - start[axis]);
+				bounds.grow(start + t * (end - start));
+			}
+		}
+	}
+
+	return bounds;
+}
+
+static AABB intersectBounds(const AABB& a, const AABB& b)
+{
+	AABB result = AABB();
+	result.bbMin = max(a.bbMin, b.bbMin);
+	result.bbMax = min(a.bbMax, b.bbMax);
+	return result;
+}
+
+// Clips a reference to one side of a split plane, the clipped bounds never exceed the original reference bounds
+static AABB clipReference(const Triangle& tri, const BvhReference& reference, U32 axis, F32 planeMin, F32 planeMax)
+{
+	AABB clipped = intersectBounds(clipTriangleBounds(tri, axis, planeMin, planeMax), reference.boundingBox);
+
+	// Snap to the clipping planes, interpolated crossings may land slightly outside of them
+	clipped.bbMin.xyz[axis] = max(clipped.bbMin[axis], planeMin);
+	clipped.bbMax.xyz[axis] = min(clipped.bbMax[axis], planeMax);
+
+	return clipped;
+}
+
+F32 BvhBLAS::findSpatialSplitPlane(const std::vector<BvhReference>& references, const AABB& bounds, F32& cost, U32& axis) const
+{
+	F32 bestCost = F32_INF;
+	F32 bestSplit = 0.0f;
+	U32 bestAxis = 0;
+
+	for (U32 a = 0; a < 3; a++)
+	{
+		const F32 boundsMin = bounds.bbMin[a];
+		const F32 boundsMax = bounds.bbMax[a];
+		if (boundsMin >= boundsMax)
+			continue;
+
+		// Spatial bins evenly divide the node bounds, references are clipped into every bin they overlap
+		const F32 binExtent = (boundsMax - boundsMin) / static_cast<F32>(BIN_COUNT);
+		const F32 binScale = static_cast<F32>(BIN_COUNT) / (boundsMax - boundsMin);
+
+		AABB bins[BIN_COUNT];
+		U32 entryCount[BIN_COUNT]{}, exitCount[BIN_COUNT]{};
+
+		for (const BvhReference& reference : references)
+		{
+			const Triangle& tri = m_mesh->triangles[reference.primitiveIndex];
+			const F32 refMin = reference.boundingBox.bbMin[a];
+			const F32 refMax = reference.boundingBox.bbMax[a];
+
+			U32 firstBin = static_cast<U32>(clamp((refMin - boundsMin) * binScale, 0.0f, static_cast<F32>(BIN_COUNT - 1)));
+			U32 lastBin = static_cast<U32>(clamp((refMax - boundsMin) * binScale, 0.0f, static_cast<F32>(BIN_COUNT - 1)));
+			lastBin = max(firstBin, lastBin);
+
+			for (U32 bin = firstBin; bin <= lastBin; bin++)
+			{
+				const F32 binMin = boundsMin + binExtent * static_cast<F32>(bin);
+				const F32 binMax = (bin == BIN_COUNT - 1) ? boundsMax : binMin + binExtent;
+
+				AABB clipped = clipReference(tri, reference, a, max(binMin, refMin), min(binMax, refMax));
+				if (!isEmpty(clipped))
+					bins[bin].grow(clipped);
+			}
+
+			entryCount[firstBin]++;
+			exitCount[lastBin]++;
+		}
+
+		// Sweep planes, references entering left of a plane go left and references exiting right of it go right
+		F32 leftArea[BIN_COUNT - 1]{}, rightArea[BIN_COUNT - 1]{};
+		U32 leftCount[BIN_COUNT - 1]{}, rightCount[BIN_COUNT - 1]{};
+		AABB leftBox = AABB(), rightBox = AABB();
+		U32 leftSum = 0, rightSum = 0;
+
+		for (U32 planeIdx = 0; planeIdx < BIN_COUNT - 1; planeIdx++)
+		{
+			leftSum += entryCount[planeIdx];
+			leftCount[planeIdx] = leftSum;
+			leftBox.grow(bins[planeIdx]);
+			leftArea[planeIdx] = leftBox.area();
+
+			const U32 RIGHT_BIN = BIN_COUNT - 1 - planeIdx;
+			const U32 RIGHT_PLANE = RIGHT_BIN - 1;
+			rightSum += exitCount[RIGHT_BIN];
+			rightCount[RIGHT_PLANE] = rightSum;
+			rightBox.grow(bins[RIGHT_BIN]);
+			rightArea[RIGHT_PLANE] = rightBox.area();
+		}
+
+		// Splits must reduce the reference count on both sides, otherwise thin diagonal primitives could be split indefinitely
+		const U32 count = static_cast<U32>(references.size());
+		for (U32 planeIdx = 0; planeIdx < BIN_COUNT - 1; planeIdx++)
+		{
+			if (leftCount[planeIdx] == 0 || rightCount[planeIdx] == 0 || leftCount[planeIdx] == count || rightCount[planeIdx] == count)
+				continue;
+
+			F32 planeCost = blockCount<BVH_LEAF_BLOCK_SIZE>(leftCount[planeIdx]) * leftArea[planeIdx] + blockCount<BVH_LEAF_BLOCK_SIZE>(rightCount[planeIdx]) * rightArea[planeIdx];
+			if (planeCost < bestCost)
+			{
+				bestCost = planeCost;
+				bestSplit = boundsMin + binExtent * static_cast<F32>(planeIdx + 1);
+				bestAxis = a;
+			}
+		}
+	}
+
+	cost = bestCost;
+	axis = bestAxis;
+	return bestSplit;
+}
+
+void BvhBLAS::buildSpatial(SizeType maxReferences)
+{
+	BvhNode& rootNode = m_nodePool[BVH_ROOT_INDEX];
+	AABB rootBounds = rootNode.bounds();
+
+	std::vector<BvhReference> references(m_triCount);
+	for (SizeType i = 0; i < m_triCount; i++)
+	{
+		const Triangle& tri = m_mesh->triangles[i];
+
+		BvhReference& reference = references[i];
+		reference.primitiveIndex = static_cast<U32>(i);
+		reference.boundingBox = AABB();
+		reference.boundingBox.grow(tri.v0);
+		reference.boundingBox.grow(tri.v1);
+		reference.boundingBox.grow(tri.v2);
+
+		rootBounds.grow(reference.boundingBox);
+	}
+
+	rootNode.setBounds(rootBounds);
+
+	// References end up in leaves in depth first order, building the new index array
+	std::vector<U32> leafIndices;
+	leafIndices.reserve(maxReferences);
+
+	SizeType referenceCount = m_triCount;
+	subdivideSpatial(BVH_ROOT_INDEX, references, 0, maxReferences, referenceCount, leafIndices);
+	assert(leafIndices.size() <= maxReferences);
+
+	if (leafIndices.size() != m_indexCount)
+	{
+		delete[] m_indices;
+		m_indexCount = leafIndices.size();
+		m_indices = new U32[m_indexCount]{};
+	}
+
+	memcpy(m_indices, leafIndices.data(), m_indexCount * sizeof(U32));
+}
+
+void BvhBLAS::subdivideSpatial(SizeType nodeIndex, std::vector<BvhReference>& references, U32 depth, SizeType maxReferences, SizeType& referenceCount, std::vector<U32>& leafIndices)
+{
+	assert(nodeIndex < m_nodeCapacity);
+	BvhNode& node = m_nodePool[nodeIndex];
+
+	const U32 count = static_cast<U32>(references.size());
+	const F32 parentCost = static_cast<F32>(blockCount<BVH_LEAF_BLOCK_SIZE>(count)) * node.bounds().area();
+
+	F32 objectCost = F32_INF;
+	U32 objectAxis = 0;
+	F32 objectSplit = findBinnedSplitPlane<BIN_COUNT, BVH_LEAF_BLOCK_SIZE>(count, [&references](U32 i) {
+		const AABB& bounds = references[i].boundingBox;
+		const __m128 bbMin = _mm_load_ps(bounds.bbMin.xyz);
+		const __m128 bbMax = _mm_load_ps(bounds.bbMax.xyz);
+
+		return PrimitiveBounds{
+			bbMin,
+			bbMax,
+			_mm_mul_ps(_mm_add_ps(bbMin, bbMax), _mm_set1_ps(0.5f))
+		};
+	}, objectCost, objectAxis);
+
+	// Spatial splits are only worth trying if the object split children overlap and the index budget is not yet exhausted
+	F32 spatialCost = F32_INF;
+	U32 spatialAxis = 0;
+	F32 spatialSplit = 0.0f;
+	if (depth < SBVH_MAX_DEPTH && referenceCount < maxReferences)
+	{
+		AABB objectLeft = AABB(), objectRight = AABB();
+		for (const BvhReference& reference : references)
+		{
+			if (reference.boundingBox.center()[objectAxis] < objectSplit)
+				objectLeft.grow(reference.boundingBox);
+			else
+				objectRight.grow(reference.boundingBox);
+		}
+
+		const AABB overlap = intersectBounds(objectLeft, objectRight);
+		const F32 rootArea = m_nodePool[BVH_ROOT_INDEX].bounds().area();
+
+		if (objectCost == F32_INF || (!isEmpty(overlap) && overlap.area() > SBVH_OVERLAP_THRESHOLD * rootArea))
+			spatialSplit = findSpatialSplitPlane(references, node.bounds(), spatialCost, spatialAxis);
+	}
+
+	const bool useSpatialSplit = spatialCost < objectCost;
+	if (min(objectCost, spatialCost) >= parentCost)
+	{
+		// Create leaf node
+		node.leftFirst = static_cast<U32>(leafIndices.size());
+		node.count = count;
+
+		for (const BvhReference& reference : references)
+			leafIndices.push_back(reference.primitiveIndex);
+
+		return;
+	}
+
+	std::vector<BvhReference> leftReferences, rightReferences;
+	if (useSpatialSplit)
+	{
+		for (const BvhReference& reference : references)
+		{
+			const F32 refMin = reference.boundingBox.bbMin[spatialAxis];
+			const F32 refMax = reference.boundingBox.bbMax[spatialAxis];
+
+			if (refMax <= spatialSplit)
+			{
+				leftReferences.push_back(reference);
+			}
+			else if (refMin >= spatialSplit)
+			{
+				rightReferences.push_back(reference);
+			}
+			else
+			{
+				// Straddling references are split in 2, unless that would exceed the index budget
+				const Triangle& tri = m_mesh->triangles[reference.primitiveIndex];
+				AABB leftBounds = clipReference(tri, reference, spatialAxis, refMin, spatialSplit);
+				AABB rightBounds = clipReference(tri, reference, spatialAxis, spatialSplit, refMax);
+
+				const bool canDuplicate = referenceCount < maxReferences;
+				if (!isEmpty(leftBounds) && (isEmpty(rightBounds) || !canDuplicate))
+				{
+					leftReferences.push_back(reference);
+				}
+				else if (!isEmpty(rightBounds) && (isEmpty(leftBounds) || !canDuplicate))
+				{
+					rightReferences.push_back(reference);
+				}
+				else
+				{
+					leftReferences.push_back(BvhReference{ leftBounds, reference.primitiveIndex });
+					rightReferences.push_back(BvhReference{ rightBounds, reference.primitiveIndex });
+					referenceCount++;
+				}
+			}
+		}
+	}
+	else
+	{
+		for (const BvhReference& reference : references)
+		{
+			if (reference.boundingBox.center()[objectAxis] < objectSplit)
+				leftReferences.push_back(reference);
+			else
+				rightReferences.push_back(reference);
+		}
+	}
+
+	if (leftReferences.empty() || rightReferences.empty())
+	{
+		node.leftFirst = static_cast<U32>(leafIndices.size());
+		node.count = count;
+
+		for (const BvhReference& reference : references)
+			leafIndices.push_back(reference.primitiveIndex);
+
+		return;
+	}
+
+	// Parent references are no longer needed, release them before recursing to limit peak memory use
+	std::vector<BvhReference>().swap(references);
+
+	U32 leftIndex = m_nodesUsed;
+	U32 rightIndex = leftIndex + 1;
+	m_nodesUsed += 2;
+	assert(m_nodesUsed <= m_nodeCapacity);
+
+	BvhNode& left = m_nodePool[leftIndex];
+	left.leftFirst = 0;
+	left.count = 0;
+	AABB leftBounds = AABB();
+	for (const BvhReference& reference : leftReferences)
+		leftBounds.grow(reference.boundingBox);
+	left.setBounds(leftBounds);
+
+	BvhNode& right = m_nodePool[rightIndex];
+	right.leftFirst = 0;
+	right.count = 0;
+	AABB rightBounds = AABB();
+	for (const BvhReference& reference : rightReferences)
+		rightBounds.grow(reference.boundingBox);
+	right.setBounds(rightBounds);
+
+	node.leftFirst = leftIndex;
+	node.count = 0;
+
+	subdivideSpatial(leftIndex, leftReferences, depth + 1, maxReferences, referenceCount, leafIndices);
+	subdivideSpatial(rightIndex, rightReferences, depth + 1, maxReferences, referenceCount, leafIndices);
+}
+
+void BvhBLAS::resizeNodePool(U32 nodeCount)
+{
+	assert(nodeCount >= m_nodesUsed);
+
+	BvhNode* nodePool = static_cast<BvhNode*>(MALLOC64(nodeCount * sizeof(BvhNode)));
+	assert(nodePool != nullptr);
+	memset(nodePool, 0, nodeCount * sizeof(BvhNode));
+
+	if (m_nodePool != nullptr)
+	{
+		memcpy(nodePool, m_nodePool, m_nodesUsed * sizeof(BvhNode));
+		FREE64(m_nodePool);
+	}
+
+	m_nodePool = nodePool;
+	m_nodeCapacity = nodeCount;
+}
+
+void BvhBLAS::buildLeafBlocks()
+{
+	// Analytic primitives have no block format, their wide leaves keep referencing index ranges
+	if (m_mesh->isAnalytic())
+		return;
+
+	// Every leaf gets its own run of blocks, so a leaf never shares a block with another leaf
+	U32 requiredBlocks = 0;
+	for (U32 i = 0; i < m_nodesUsed; i++)
 	{
-		return;
+		if (i != 1 && m_nodePool[i].isLeaf())
+			requiredBlocks += blockCount<TRIANGLE4_WIDTH>(m_nodePool[i].count);
 	}
 
-	U32 leftIndex = m_nodesUsed;
-	U32 rightIndex = m_nodesUsed + 1;
-	m_nodesUsed += 2;
+	if (requiredBlocks != m_leafBlockCount)
+	{
+		FREE64(m_leafBlocks);
+		m_leafBlockCount = requiredBlocks;
+		m_leafBlocks = static_cast<Triangle4*>(MALLOC64(m_leafBlockCount * sizeof(Triangle4)));
+		assert(m_leafBlocks != nullptr);
+	}
 
-	// Update left node
-	BvhNode& left = m_nodePool[leftIndex];
-	left.leftFirst = node.first();
-	left.count = leftCount;
-	left.boundingBox = AABB();
+	// Blocks are allocated in node pool order, so leaves of nearby nodes end up close in memory
+	U32 blocksUsed = 0;
+	m_wideBvh.remapLeaves([this, &blocksUsed](U32 first, U32 count) {
+		const U32 firstBlock = blocksUsed;
+		blocksUsed += blockCount<TRIANGLE4_WIDTH>(count);
+		assert(blocksUsed <= m_leafBlockCount);
 
-	// Update right node
-	BvhNode& right = m_nodePool[rightIndex];
-	right.leftFirst = pivotPosition;
-	right.count = node.count - leftCount;
-	right.boundingBox = AABB();
+		for (U32 block = firstBlock; block < blocksUsed; block++)
+			m_leafBlocks[block].clear();
 
-	// Update parent node
-	node.leftFirst = leftIndex;
-	node.count = 0;
+		for (U32 i = 0; i < count; i++)
+		{
+			const U32 primitiveIndex = m_indices[first + i];
+			m_leafBlocks[firstBlock + i / TRIANGLE4_WIDTH].setTriangle(i % TRIANGLE4_WIDTH, m_mesh->triangles[primitiveIndex], primitiveIndex);
+		}
 
-	updateNodeBounds(leftIndex);
-	updateNodeBounds(rightIndex);
-	subdivide(leftIndex);
-	subdivide(rightIndex);
+		return firstBlock;
+	});
 }
 
 Instance::Instance(BvhBLAS* blas, Material* material, Mat4 transform)
 	:
-	bvh(blas),
+	Instance(static_cast<IAccelerationStructure*>(blas), material, transform)
+{
+	bvh = blas;
+}
+
+Instance::Instance(IAccelerationStructure* accel, Material* material, Mat4 transform)
+	:
+	accel(accel),
+	bvh(nullptr),
+	assembly(nullptr),
 	material(material),
 	bounds(),
+	animated(false),
+	visibilityMask(VISIBILITY_ALL),
 	m_transform(transform),
-	m_invTransform(1.0f)
+	m_invTransform(),
+	m_dirty(true)
 {
-	assert(bvh != nullptr);
+	assert(accel != nullptr);
 	assert(material != nullptr);
 
 	setTransform(transform);
 }
 
+Instance::Instance(const BvhTLAS* assembly, Mat4 transform)
+	:
+	accel(nullptr),
+	bvh(nullptr),
+	assembly(assembly),
+	material(nullptr),
+	bounds(),
+	animated(false),
+	visibilityMask(VISIBILITY_ALL),
+	m_transform(transform),
+	m_invTransform(),
+	m_dirty(true)
+{
+	assert(assembly != nullptr);
+
+	for (auto const& member : assembly->instances())
+	{
+		assert(!member.isAssembly());
+		assert(!member.isEmitter());
+	}
+
+	setTransform(transform);
+}
+
 bool Instance::intersect(Ray& ray) const
 {
-	assert(bvh != nullptr);
+	assert(accel != nullptr || assembly != nullptr);
 	Ray oldRay = ray;
 
-	glm::vec4 tPos = m_invTransform * static_cast<glm::vec4>(Float4(ray.origin, 1.0f));
-	glm::vec4 tDir = m_invTransform * static_cast<glm::vec4>(Float4(ray.direction, 0.0f));
-	ray.origin = Float3(tPos.x, tPos.y, tPos.z) / tPos.w;
-	ray.direction = Float3(tDir.x, tDir.y, tDir.z);
+	ray.origin = m_invTransform.transformPoint(ray.origin);
+	ray.direction = m_invTransform.transformVector(ray.direction);
+
+	bool intersected = false;
+	if (isAssembly())
+	{
+		// The assembly TLAS stores the member in the instance index, the caller stores the assembly instance there
+		intersected = assembly->intersect(ray);
+		if (intersected)
+			ray.metadata.nestedInstanceIndex = ray.metadata.instanceIndex;
+
+		ray.metadata.instanceIndex = oldRay.metadata.instanceIndex;
+	}
+	else
+	{
+		// Traversal data is calculated once for the instance space ray, not per node visit
+		intersected = bvh != nullptr ? bvh->intersect(ray, TraversalRay(ray)) : accel->intersect(ray);
+	}
 
-	bool intersected = bvh->intersect(ray);
 	ray.origin = oldRay.origin;
 	ray.direction = oldRay.direction;
 
@@ -497,63 +1472,136 @@ bool Instance::intersect(Ray& ray) const
 
 bool Instance::intersectAny(Ray& ray) const
 {
-	assert(bvh != nullptr);
+	assert(accel != nullptr || assembly != nullptr);
 	Ray oldRay = ray;
 
-	glm::vec4 tPos = m_invTransform * static_cast<glm::vec4>(Float4(ray.origin, 1.0f));
-	glm::vec4 tDir = m_invTransform * static_cast<glm::vec4>(Float4(ray.direction, 0.0f));
-	ray.origin = Float3(tPos.x, tPos.y, tPos.z) / tPos.w;
-	ray.direction = Float3(tDir.x, tDir.y, tDir.z);
+	ray.origin = m_invTransform.transformPoint(ray.origin);
+	ray.direction = m_invTransform.transformVector(ray.direction);
+
+	bool intersected = false;
+	if (isAssembly())
+	{
+		intersected = assembly->intersectAny(ray);
+		if (intersected)
+			ray.metadata.nestedInstanceIndex = ray.metadata.instanceIndex;
+
+		ray.metadata.instanceIndex = oldRay.metadata.instanceIndex;
+	}
+	else
+	{
+		intersected = bvh != nullptr ? bvh->intersectAny(ray, TraversalRay(ray)) : accel->intersectAny(ray);
+	}
 
-	bool intersected = bvh->intersectAny(ray);
 	ray.origin = oldRay.origin;
 	ray.direction = oldRay.direction;
 
 	return intersected;
 }
 
+void Instance::intersect(RayPacket& packet, U32 firstActive) const
+{
+	assert(accel != nullptr || assembly != nullptr);
+
+	// Transformed directions are not renormalized, so instance space hits are copied back as is
+	RayPacket instancePacket(packet, m_invTransform);
+	if (!isAssembly())
+	{
+		accel->intersect(instancePacket, firstActive);
+		packet.copyHits(instancePacket);
+		return;
+	}
+
+	// Rays with a closer hit than before hit the member the assembly TLAS stored in the instance index
+	assembly->intersect(instancePacket, firstActive);
+	for (U32 lane = firstActive; lane < packet.laneCount; lane++)
+	{
+		const __m128 hit = _mm_cmplt_ps(instancePacket.depth[lane], packet.depth[lane]);
+		packet.nestedInstanceIndex[lane] = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(packet.nestedInstanceIndex[lane]), _mm_castsi128_ps(instancePacket.instanceIndex[lane]), hit));
+	}
+
+	packet.copyHits(instancePacket);
+}
+
 Float3 Instance::normal(U32 primitiveIndex, const Float2& barycentric) const
 {
-	Float3 normal = bvh->mesh()->normal(primitiveIndex, barycentric);
-	glm::vec4 tNormal = m_transform * static_cast<glm::vec4>(Float4(normal, 0.0f));
-	tNormal = glm::normalize(tNormal);	// Renormalize to avoid rounding errors
+	Float3 normal = accel->mesh()->normal(primitiveIndex, barycentric);
+	return m_transform.transformVector(normal).normalize();	// Renormalize to avoid rounding errors
+}
+
+Float3 Instance::normal(const RayMetadata& hit) const
+{
+	if (!isAssembly())
+		return normal(hit.primitiveIndex, hit.hitCoordinates);
 
-	return Float3(tNormal.x, tNormal.y, tNormal.z);
+	const Instance& member = hitLeaf(hit);
+	Float3 normal = member.mesh()->normal(hit.primitiveIndex, hit.hitCoordinates);
+	return m_transform.transformVector(member.m_transform.transformVector(normal)).normalize();
 }
 
 void Instance::setTransform(const Mat4& transform)
 {
-	m_invTransform = glm::inverse(transform);
-	m_transform = transform;
+	assert(transform[0][3] == 0.0f && transform[1][3] == 0.0f && transform[2][3] == 0.0f && transform[3][3] == 1.0f);
+
+	m_invTransform = Mat3x4(glm::inverse(transform));
+	m_transform = Mat3x4(transform);
 
 	updateBounds();
 	calculateMeshArea();
+	m_dirty = true;
 }
 
-SamplePoint Instance::samplePoint(U32& seed) const
+SamplePoint Instance::samplePoint(U32& seed, const Float3& receiver) const
 {
-	const Mesh* pMesh = bvh->mesh();
-	F32 u = randomRange(seed, 0.0f, 1.0f);
-	F32 v = randomRange(seed, 0.0f, 1.0f - u);
+	assert(m_triangleTable.size() != 0 && !isAssembly());
+
+	const Mesh* pMesh = accel->mesh();
+	U32 index = m_triangleTable.sample(seed);
+
+	if (pMesh->isAnalytic())
+	{
+		// Sampled on the world space primitive, so the density is uniform over its world space area
+		const PrimitiveType type = pMesh->primitiveType;
+		F32 random0 = randomF32(seed);
+		F32 random1 = randomF32(seed);
+		AnalyticPrimitive primitive = pMesh->analyticPrimitives[index].transformed(type, m_transform);
+
+		// Half of a sphere faces away from any receiver outside of it, only its visible cap is worth a sample
+		if (type == PrimitiveType::Sphere)
+		{
+			SamplePoint point;
+			point.pdf = m_triangleTable.probability(index) * primitive.sampleSphereCap(receiver, random0, random1, point.position, point.normal);
+			point.primitiveIndex = index;
+			return point;
+		}
 
-	Float2 barycentric = Float2(u, v);
-	U32 index = randomRange(seed, 0, static_cast<U32>(pMesh->triangles.size()));
+		Float2 coordinates = AnalyticPrimitive::sampleCoordinates(type, random0, random1);
+		return SamplePoint{
+			primitive.position(type, coordinates),
+			primitive.normal(type, coordinates),
+			m_triangleTable.probability(index) / primitive.area(type),
+			index,
+		};
+	}
 
-	Float4 position = Float4(pMesh->position(index, barycentric), 1);
-	Float4 normal = Float4(pMesh->normal(index, barycentric), 0);
+	// Uniform point on the triangle, the barycentric weights belong to v0 & v2
+	F32 sqrtU = sqrtf(randomF32(seed));
+	Float2 barycentric = Float2(1.0f - sqrtU, randomF32(seed) * sqrtU);
 
-	glm::vec4 tPos = m_transform * static_cast<glm::vec4>(position);
-	glm::vec4 tNormal = m_transform * static_cast<glm::vec4>(normal);
+	const Triangle& tri = pMesh->triangles[index];
+	Float3 a = m_transform.transformVector(tri.v1 - tri.v0), b = m_transform.transformVector(tri.v2 - tri.v0);
+	F32 triangleArea = 0.5f * a.cross(b).magnitude();
 
 	return SamplePoint{
-		Float3(tPos.x, tPos.y, tPos.z) / tPos.w,
-		Float3(tNormal.x, tNormal.y, tNormal.z).normalize(),
+		m_transform.transformPoint(pMesh->position(index, barycentric)),
+		m_transform.transformVector(pMesh->normal(index, barycentric)).normalize(),
+		m_triangleTable.probability(index) / triangleArea,
+		index,
 	};
 }
 
 void Instance::updateBounds()
 {
-	const AABB& localBounds = bvh->bounds();
+	const AABB localBounds = isAssembly() ? assembly->bounds() : accel->bounds();
 	bounds = AABB();
 
 	Float3 positions[] = {
@@ -568,39 +1616,62 @@ void Instance::updateBounds()
 	};
 
 	for (auto const& pos : positions)
-	{
-		glm::vec4 transformedPos = m_transform * static_cast<glm::vec4>(Float4(pos, 1.0f));
-		bounds.grow(Float3(transformedPos.x, transformedPos.y, transformedPos.z) / transformedPos.w);
-	}
+		bounds.grow(m_transform.transformPoint(pos));
 }
 
 void Instance::calculateMeshArea()
 {
+	// Only emitters are sampled by area, other instances skip the table
+	const bool emitter = isEmitter();
+	std::vector<F32> triangleAreas;
+
 	area = 0.0f;
-	for (auto const& tri : bvh->mesh()->triangles)
+	if (isAssembly())
+		return;
+
+	const Mesh* pMesh = accel->mesh();
+	for (auto const& primitive : pMesh->analyticPrimitives)
 	{
-		// transform tri verts, calc area
-		glm::vec4 tv0 = m_transform * static_cast<glm::vec4>(Float4(tri.v0, 1.0));
-		glm::vec4 tv1 = m_transform * static_cast<glm::vec4>(Float4(tri.v1, 1.0));
-		glm::vec4 tv2 = m_transform * static_cast<glm::vec4>(Float4(tri.v2, 1.0));
+		F32 primitiveArea = primitive.transformed(pMesh->primitiveType, m_transform).area(pMesh->primitiveType);
+		area += primitiveArea;
+
+		if (emitter)
+			triangleAreas.push_back(primitiveArea);
+	}
 
-		Float3 v0 = Float3(tv0.x, tv0.y, tv0.z) / tv0.w;
-		Float3 v1 = Float3(tv1.x, tv1.y, tv1.z) / tv1.w;
-		Float3 v2 = Float3(tv2.x, tv2.y, tv2.z) / tv2.w;
+	for (auto const& tri : pMesh->triangles)
+	{
+		// transform tri verts, calc area
+		Float3 v0 = m_transform.transformPoint(tri.v0);
+		Float3 v1 = m_transform.transformPoint(tri.v1);
+		Float3 v2 = m_transform.transformPoint(tri.v2);
 
 		Float3 a = v1 - v0, b = v2 - v0;
-		area += 0.5f * a.cross(b).magnitude();
+		F32 triangleArea = 0.5f * a.cross(b).magnitude();
+		area += triangleArea;
+
+		if (emitter)
+			triangleAreas.push_back(triangleArea);
 	}
+
+	if (emitter)
+		m_triangleTable.build(triangleAreas.data(), static_cast<U32>(triangleAreas.size()));
 }
 
-BvhTLAS::BvhTLAS(std::vector<Instance> instances)
+BvhTLAS::BvhTLAS(std::vector<Instance> instances, BvhBuildMode buildMode)
 	:
 	m_instances(instances),
+	m_buildMode(buildMode),
 	m_indices(new U32[m_instances.size()]{}),
 	m_nodesUsed(2),
-	m_nodePool(static_cast<BvhNode*>(MALLOC64(2 * m_instances.size() * sizeof(BvhNode))))
+	m_nodePool(static_cast<BvhNode*>(MALLOC64(2 * m_instances.size() * sizeof(BvhNode)))),
+	m_nodeCost(0.0),
+	m_buildCost(0.0f),
+	m_rotationCursor(0),
+	m_buildTime(0.0f)
 {
 	assert(m_nodePool != nullptr && m_indices != nullptr);
+	assert(buildMode != BvhBuildMode::SpatialSplits);	// Instances are never split
 	memset(m_nodePool, 0, 2 * m_instances.size() * sizeof(BvhNode));
 
 	// Fill out indices array
@@ -620,9 +1691,19 @@ BvhTLAS::~BvhTLAS()
 BvhTLAS::BvhTLAS(const BvhTLAS& other) noexcept
 	:
 	m_instances(other.m_instances),
+	m_buildMode(other.m_buildMode),
 	m_indices(nullptr),
 	m_nodesUsed(other.m_nodesUsed),
-	m_nodePool(nullptr)
+	m_nodePool(nullptr),
+	m_wideBvh(other.m_wideBvh),
+	m_parentIndices(other.m_parentIndices),
+	m_instanceLeaves(other.m_instanceLeaves),
+	m_nodeMasks(other.m_nodeMasks),
+	m_wideChildMasks(other.m_wideChildMasks),
+	m_nodeCost(other.m_nodeCost),
+	m_buildCost(other.m_buildCost),
+	m_rotationCursor(other.m_rotationCursor),
+	m_buildTime(other.m_buildTime)
 {
 	m_indices = new U32[m_instances.size()];
 	m_nodePool = static_cast<BvhNode*>(MALLOC64(2 * m_instances.size() * sizeof(BvhNode)));
@@ -641,269 +1722,483 @@ BvhTLAS& BvhTLAS::operator=(const BvhTLAS& other) noexcept
 	}
 
 	this->m_instances = other.m_instances;
+	this->m_buildMode = other.m_buildMode;
 	this->m_indices = new U32[m_instances.size()]{};
 	memcpy(this->m_indices, other.m_indices, sizeof(U32) * m_instances.size());
 
 	this->m_nodesUsed = other.m_nodesUsed;
 	this->m_nodePool = static_cast<BvhNode*>(MALLOC64(2 * m_instances.size() * sizeof(BvhNode)));
 	memcpy(m_nodePool, other.m_nodePool, 2 * m_instances.size() * sizeof(BvhNode));
+	this->m_wideBvh = other.m_wideBvh;
+
+	this->m_parentIndices = other.m_parentIndices;
+	this->m_instanceLeaves = other.m_instanceLeaves;
+	this->m_nodeMasks = other.m_nodeMasks;
+	this->m_wideChildMasks = other.m_wideChildMasks;
+	this->m_nodeCost = other.m_nodeCost;
+	this->m_buildCost = other.m_buildCost;
+	this->m_rotationCursor = other.m_rotationCursor;
+	this->m_buildTime = other.m_buildTime;
 
 	return *this;
 }
 
 bool BvhTLAS::intersect(Ray& ray) const
 {
-	BvhNode* node = &m_nodePool[BVH_ROOT_INDEX];
-	BvhNode* stack[TRAVERSAL_STACK_SIZE]{};
-	SizeType stackPtr = 0;
+	return traverse<false>(ray, TraversalRay(ray));
+}
 
-	bool intersected = false;
-	while(true)
-	{
-		if (node->isLeaf())
+bool BvhTLAS::intersectAny(Ray& ray) const
+{
+	return traverse<true>(ray, TraversalRay(ray));
+}
+
+bool BvhTLAS::intersect(Ray& ray, const TraversalRay& traversalRay) const
+{
+	return traverse<false>(ray, traversalRay);
+}
+
+bool BvhTLAS::intersectAny(Ray& ray, const TraversalRay& traversalRay) const
+{
+	return traverse<true>(ray, traversalRay);
+}
+
+template <bool AnyHit>
+bool BvhTLAS::traverse(Ray& ray, const TraversalRay& traversalRay) const
+{
+	auto intersectLeaf = [this](Ray& ray, U32 first, U32 count) {
+		bool intersected = false;
+		for (U32 i = 0; i < count; i++)
 		{
-			for (U32 i = 0; i < node->count; i++)
+			U32 instanceIndex = m_indices[first + i];
+			const Instance& instance = m_instances[instanceIndex];
+			if ((instance.visibilityMask & ray.visibilityMask) == 0)
+				continue;
+
+			if (AnyHit)
 			{
-				U32 instanceIndex = m_indices[node->first() + i];
-				const Instance& instance = m_instances[instanceIndex];
+				if (instance.intersectAny(ray))
+					return true;
 
-				if (instance.intersect(ray))
-				{
-					intersected = true;
-					ray.metadata.instanceIndex = instanceIndex;
-				}
+				continue;
 			}
 
-			if (stackPtr == 0)
-				break;
-
-			node = stack[stackPtr - 1];
-			stackPtr--;
-			continue;
+			if (instance.intersect(ray))
+			{
+				intersected = true;
+				ray.metadata.instanceIndex = instanceIndex;
+				if (!instance.isAssembly())
+					ray.metadata.nestedInstanceIndex = UNSET_INDEX;
+			}
 		}
 
-		BvhNode* childNear = &m_nodePool[node->left()];
-		BvhNode* childFar = &m_nodePool[node->right()];
-
-		F32 distNear = childNear->boundingBox.intersect(ray);
-		F32 distFar = childFar->boundingBox.intersect(ray);
+		return intersected;
+	};
 
-		if (distNear > distFar) {
-			swap(distNear, distFar);
-			swap(childNear, childFar);
-		}
+#if BVH_WIDE_TRAVERSAL == 1
+	const VisibilityMaskedNodes<TraversalBvh::NodeType> nodes = { m_wideBvh.nodePool(), m_wideChildMasks.data() };
+	return traverseBvh<AnyHit>(&nodes, TraversalEntry{ WIDE_BVH_ROOT_INDEX, 0, 0.0f }, traversalRay, ray, intersectLeaf);
+#else
+	const BvhNode& root = m_nodePool[BVH_ROOT_INDEX];
+	return traverseBvh<AnyHit>(m_nodePool, TraversalEntry{ root.leftFirst, root.count, 0.0f }, traversalRay, ray, intersectLeaf);
+#endif
+}
 
-		if (distNear == F32_FAR_AWAY)
+void BvhTLAS::intersect(RayPacket& packet, U32 firstActive) const
+{
+	// Packets are traced on the binary nodes, which leave the visibility masks to the leaves
+	traversePacket(m_nodePool, BVH_ROOT_INDEX, firstActive, packet, [this](RayPacket& packet, U32 first, U32 count, U32 firstActive) {
+		for (U32 i = 0; i < count; i++)
 		{
-			if (stackPtr == 0)
-				break;
+			U32 instanceIndex = m_indices[first + i];
+			const Instance& instance = m_instances[instanceIndex];
+			if ((instance.visibilityMask & packet.visibilityMask) == 0)
+				continue;
 
-			node = stack[stackPtr - 1];
-			stackPtr--;
-		}
-		else
-		{
-			node = childNear;
-			if (distFar != F32_FAR_AWAY)
+			__m128 depths[RAY_PACKET_LANES];
+			for (U32 lane = firstActive; lane < packet.laneCount; lane++)
+				depths[lane] = packet.depth[lane];
+
+			instance.intersect(packet, firstActive);
+
+			// Rays with a closer hit than before hit this instance, assemblies set the nested index of their hits themselves
+			const __m128i index = _mm_set1_epi32(static_cast<I32>(instanceIndex));
+			const __m128i unset = _mm_set1_epi32(static_cast<I32>(UNSET_INDEX));
+			for (U32 lane = firstActive; lane < packet.laneCount; lane++)
 			{
-				stack[stackPtr] = childFar;
-				stackPtr++;
+				const __m128 hit = _mm_cmplt_ps(packet.depth[lane], depths[lane]);
+				packet.instanceIndex[lane] = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(packet.instanceIndex[lane]), _mm_castsi128_ps(index), hit));
+				if (!instance.isAssembly())
+					packet.nestedInstanceIndex[lane] = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(packet.nestedInstanceIndex[lane]), _mm_castsi128_ps(unset), hit));
 			}
 		}
-	}
+	});
+}
 
-	return intersected;
+void BvhTLAS::intersect(RayStream& stream) const
+{
+	traverseStream<false>(stream);
 }
 
-bool BvhTLAS::intersectAny(Ray& ray) const
+void BvhTLAS::intersectAny(RayStream& stream) const
 {
-	BvhNode* node = &m_nodePool[BVH_ROOT_INDEX];
-	BvhNode* stack[TRAVERSAL_STACK_SIZE]{};
-	SizeType stackPtr = 0;
+	traverseStream<true>(stream);
+}
 
-	while(true)
-	{
-		if (node->isLeaf())
+template <bool AnyHit>
+void BvhTLAS::traverseStream(RayStream& stream) const
+{
+	auto intersectLeaf = [this, &stream](Ray* rays, const StreamRay* activeRays, U32 rayCount, U32 first, U32 count) {
+		for (U32 i = 0; i < count; i++)
 		{
-			for (U32 i = 0; i < node->count; i++)
-			{
-				U32 instanceIndex = m_indices[node->first() + i];
-				const Instance& instance = m_instances[instanceIndex];
+			U32 instanceIndex = m_indices[first + i];
+			const Instance& instance = m_instances[instanceIndex];
+			const Mat3x4& invTransform = instance.invTransform();
 
-				if (instance.intersectAny(ray))
+			// Assemblies are traced ray by ray, the stream workspace only has room for a single level of instances
+			if (instance.isAssembly())
+			{
+				for (U32 r = 0; r < rayCount; r++)
 				{
-					return true;
-				}
-			}
-
-			if (stackPtr == 0)
-				break;
+					Ray& ray = rays[activeRays[r].rayIndex];
+					if ((instance.visibilityMask & ray.visibilityMask) == 0 || (AnyHit && ray.metadata.primitiveIndex != UNSET_INDEX))
+						continue;
 
-			node = stack[stackPtr - 1];
-			stackPtr--;
-			continue;
-		}
+					if (AnyHit ? instance.intersectAny(ray) : instance.intersect(ray))
+						ray.metadata.instanceIndex = instanceIndex;
+				}
 
-		BvhNode* childNear = &m_nodePool[node->left()];
-		BvhNode* childFar = &m_nodePool[node->right()];
+				continue;
+			}
 
-		F32 distNear = childNear->boundingBox.intersect(ray);
-		F32 distFar = childFar->boundingBox.intersect(ray);
+			// Instance space copies of the rays in the leaf that see the instance, transformed directions are not renormalized so depths are shared
+			stream.instanceRays.clear();
+			stream.instanceRayIndices.clear();
+			for (U32 r = 0; r < rayCount; r++)
+			{
+				Ray ray = rays[activeRays[r].rayIndex];
+				if ((instance.visibilityMask & ray.visibilityMask) == 0)
+					continue;
+
+				ray.origin = invTransform.transformPoint(ray.origin);
+				ray.direction = invTransform.transformVector(ray.direction);
+				stream.instanceRays.push_back(ray);
+				stream.instanceRayIndices.push_back(activeRays[r].rayIndex);
+			}
 
-		if (distNear > distFar) {
-			swap(distNear, distFar);
-			swap(childNear, childFar);
-		}
+			const U32 instanceRayCount = static_cast<U32>(stream.instanceRays.size());
+			if (instanceRayCount == 0)
+				continue;
 
-		if (distNear == F32_FAR_AWAY)
-		{
-			if (stackPtr == 0)
-				break;
+			if (AnyHit)
+				instance.accel->intersectAny(stream.instanceRays.data(), instanceRayCount, stream.instanceWorkspace);
+			else
+				instance.accel->intersect(stream.instanceRays.data(), instanceRayCount, stream.instanceWorkspace);
 
-			node = stack[stackPtr - 1];
-			stackPtr--;
-		}
-		else
-		{
-			node = childNear;
-			if (distFar != F32_FAR_AWAY)
+			for (U32 r = 0; r < instanceRayCount; r++)
 			{
-				stack[stackPtr] = childFar;
-				stackPtr++;
+				const Ray& instanceRay = stream.instanceRays[r];
+				Ray& ray = rays[stream.instanceRayIndices[r]];
+				if (instanceRay.depth >= ray.depth)
+					continue;
+
+				ray.depth = instanceRay.depth;
+				ray.metadata.primitiveIndex = instanceRay.metadata.primitiveIndex;
+				ray.metadata.instanceIndex = instanceIndex;
+				ray.metadata.hitCoordinates = instanceRay.metadata.hitCoordinates;
+				ray.metadata.nestedInstanceIndex = UNSET_INDEX;
 			}
 		}
-	}
+	};
 
-	return false;
+	const U32 rayCount = static_cast<U32>(stream.rays.size());
+#if BVH_WIDE_TRAVERSAL == 1
+	const VisibilityMaskedNodes<TraversalBvh::NodeType> nodes = { m_wideBvh.nodePool(), m_wideChildMasks.data() };
+	traverseBvhStream<AnyHit>(&nodes, TraversalEntry{ WIDE_BVH_ROOT_INDEX, 0, 0.0f }, stream.rays.data(), rayCount, stream.workspace, intersectLeaf);
+#else
+	const BvhNode& root = m_nodePool[BVH_ROOT_INDEX];
+	traverseBvhStream<AnyHit>(m_nodePool, TraversalEntry{ root.leftFirst, root.count, 0.0f }, stream.rays.data(), rayCount, stream.workspace, intersectLeaf);
+#endif
 }
 
 void BvhTLAS::build()
 {
+	const std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+
 	// Reset nodes used
 	m_nodesUsed = 2;
 
 	BvhNode& rootNode = m_nodePool[BVH_ROOT_INDEX];
 	rootNode.leftFirst = 0;
 	rootNode.count = static_cast<U32>(m_instances.size());
+	rootNode.setBounds(AABB());
+
+	if (m_buildMode == BvhBuildMode::Morton)
+	{
+		std::vector<PrimitiveBounds> instanceBounds(m_instances.size());
+		for (SizeType i = 0; i < m_instances.size(); i++)
+		{
+			const AABB& bounds = m_instances[i].bounds;
+			const __m128 bbMin = _mm_load_ps(bounds.bbMin.xyz);
+			const __m128 bbMax = _mm_load_ps(bounds.bbMax.xyz);
+			instanceBounds[i] = PrimitiveBounds{ bbMin, bbMax, _mm_mul_ps(_mm_add_ps(bbMin, bbMax), _mm_set1_ps(0.5f)) };
+		}
+
+		// Single instance leaves, a TLAS leaf traces every instance it holds
+		m_nodesUsed = buildMortonNodes(m_nodePool, instanceBounds.data(), static_cast<U32>(m_instances.size()), 1, m_indices);
+	}
+	else
+	{
+		updateNodeBounds(BVH_ROOT_INDEX);
+		runBuildTasks([this]() { subdivide(BVH_ROOT_INDEX); });
+	}
+
+#if BVH_DEPTH_FIRST_LAYOUT == 1
+	m_nodesUsed = reorderDepthFirst(m_nodePool, m_nodesUsed, m_indices, m_instances.size());
+#endif
+
+	linkNodes();
+
+#if BVH_WIDE_TRAVERSAL == 1
+	m_wideBvh.collapse(m_nodePool, m_nodesUsed);
+#endif
+
+	updateVisibilityMasks();
 
-	updateNodeBounds(BVH_ROOT_INDEX);
-	subdivide(BVH_ROOT_INDEX);
+	m_buildTime = std::chrono::duration<F32>(std::chrono::steady_clock::now() - buildStart).count();
+}
+
+BvhStats BvhTLAS::stats() const
+{
+	// Instance bounds stand in for the instance geometry, clipping them yields the area of the bounds inside the box
+	auto clippedBounds = [this](U32 primitive, const Float3& bbMin, const Float3& bbMax) {
+		const AABB& bounds = m_instances[primitive].bounds;
+		AABB clipped = AABB();
+		clipped.bbMin = max(bounds.bbMin, bbMin);
+		clipped.bbMax = min(bounds.bbMax, bbMax);
+
+		const Float3 extent = clipped.bbMax - clipped.bbMin;
+		return (extent.x < 0.0f || extent.y < 0.0f || extent.z < 0.0f) ? 0.0f : clipped.area();
+	};
+
+	BvhStats stats = {};
+	gatherBvhStats(m_nodePool, m_indices, static_cast<U32>(m_instances.size()), stats,
+		[](U32 count) { return static_cast<F32>(count); },
+		[this](U32 primitive) { return m_instances[primitive].bounds; },
+		clippedBounds
+	);
+
+	stats.nodeMemory = 2 * m_instances.size() * sizeof(BvhNode);
+	stats.traversalMemory = m_wideBvh.memoryUsage();
+	stats.leafMemory = 0;
+	stats.buildTime = m_buildTime;
+	return stats;
 }
 
 void BvhTLAS::refit()
 {
-	for (I64 i = m_nodesUsed - 1; i >= 0; i--)
+	bool refitted = false;
+	for (SizeType instanceIndex = 0; instanceIndex < m_instances.size(); instanceIndex++)
 	{
-		if (i == 1) continue;
-		
-		BvhNode& node = m_nodePool[i];
-		if (node.isLeaf())
-		{
-			// Update node instance because instance data may have changed after a blas refit
-			for (SizeType idx = 0; idx < node.count; idx++)
-			{
-				Instance& instance = m_instances[m_indices[node.first() + idx]];
-				instance.updateInstanceData();
-			}
-
-			updateNodeBounds(i);
+		Instance& instance = m_instances[instanceIndex];
+		if (!instance.isDirty())
 			continue;
-		}
 
-		const BvhNode& left = m_nodePool[node.left()];
-		const BvhNode& right = m_nodePool[node.right()];
+		instance.clearDirty();
+		refitFromLeaf(m_instanceLeaves[instanceIndex]);
+		refitted = true;
+	}
+
+	if (!refitted)
+		return;
 
-		node.boundingBox.bbMin = min(left.boundingBox.bbMin, right.boundingBox.bbMin);
-		node.boundingBox.bbMax = max(left.boundingBox.bbMax, right.boundingBox.bbMax);
+	if (sahCost() > TLAS_REBUILD_THRESHOLD * m_buildCost)
+	{
+		build();
+		return;
 	}
+
+#if BVH_WIDE_TRAVERSAL == 1
+	// Wide nodes store copies of the child bounds, so they are recollapsed from the refitted binary nodes
+	m_wideBvh.collapse(m_nodePool, m_nodesUsed);
+	updateVisibilityMasks();
+#endif
 }
 
-F32 BvhTLAS::calculateNodeCost(const BvhNode& node) const
+bool BvhTLAS::optimize(F32 timeBudget)
 {
-	return static_cast<F32>(node.count) * node.boundingBox.area();
+	// Moved subtrees keep their parent & instance links pointing at the slot they were swapped into
+	auto relink = [this](U32 nodeIndex) {
+		const BvhNode& node = m_nodePool[nodeIndex];
+		if (!node.isLeaf())
+		{
+			m_parentIndices[node.left()] = nodeIndex;
+			m_parentIndices[node.right()] = nodeIndex;
+			return;
+		}
+
+		for (U32 i = 0; i < node.count; i++)
+			m_instanceLeaves[m_indices[node.first() + i]] = nodeIndex;
+	};
+
+	bool rotated = runRotations(m_nodesUsed, m_rotationCursor, timeBudget, [this, &relink](U32 nodeIndex) {
+		const F32 delta = rotateNode(m_nodePool, nodeIndex, relink);
+		m_nodeCost += delta;
+		return delta < 0.0f;
+	});
+
+	if (!rotated)
+		return false;
+
+#if BVH_WIDE_TRAVERSAL == 1
+	m_wideBvh.collapse(m_nodePool, m_nodesUsed);
+#endif
+
+	updateVisibilityMasks();
+	return true;
 }
 
-F32 BvhTLAS::findSplitPlane(const BvhNode& node, F32& cost, U32& axis) const
+void BvhTLAS::updateVisibilityMasks()
 {
-	F32 bestCost = F32_INF;
-	F32 bestSplit = 0.0f;
-	U32 bestAxis = 0;
+	m_nodeMasks.assign(m_nodesUsed, 0);
+	gatherNodeMask(BVH_ROOT_INDEX);
+
+#if BVH_WIDE_TRAVERSAL == 1
+	m_wideChildMasks.assign(m_wideBvh.nodesUsed(), 0);
+	gatherWideMask(WIDE_BVH_ROOT_INDEX);
+#endif
+}
 
-	for (U32 axis = 0; axis < 3; axis++)
+U32 BvhTLAS::gatherNodeMask(U32 nodeIndex)
+{
+	const BvhNode& node = m_nodePool[nodeIndex];
+
+	U32 mask = 0;
+	if (node.isLeaf())
 	{
-		// Calculate centroid based bin extent
-		F32 boundsMin = F32_MAX;
-		F32 boundsMax = F32_MIN;
-		for (SizeType i = 0; i < node.count; i++)
-		{
-			SizeType idx = node.first() + i;
-			const AABB& bounds = m_instances[m_indices[idx]].bounds;
+		for (U32 i = 0; i < node.count; i++)
+			mask |= m_instances[m_indices[node.first() + i]].visibilityMask;
+	}
+	else
+	{
+		mask = gatherNodeMask(node.left()) | gatherNodeMask(node.right());
+	}
+
+	m_nodeMasks[nodeIndex] = mask;
+	return mask;
+}
 
-			boundsMin = min(boundsMin, bounds.center()[axis]);
-			boundsMax = max(boundsMax, bounds.center()[axis]);
+U32 BvhTLAS::gatherWideMask(U32 wideIndex)
+{
+	const TraversalBvh::NodeType& node = m_wideBvh.nodePool()[wideIndex];
+
+	U32 nodeMask = 0;
+	U32 childMasks = 0;
+	for (U32 i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		U32 mask = 0;
+		if (node.count[i] != 0)
+		{
+			for (U32 p = 0; p < node.count[i]; p++)
+				mask |= m_instances[m_indices[node.leftFirst[i] + p]].visibilityMask;
 		}
+		else if (node.leftFirst[i] != WIDE_BVH_ROOT_INDEX)	// Unused slots reference the root, which is never a child
+		{
+			mask = gatherWideMask(node.leftFirst[i]);
+		}
+
+		childMasks |= mask << (i * WIDE_BVH_CHILD_MASK_BITS);
+		nodeMask |= mask;
+	}
 
-		if (boundsMin == boundsMax)
+	m_wideChildMasks[wideIndex] = childMasks;
+	return nodeMask;
+}
+
+void BvhTLAS::linkNodes()
+{
+	m_parentIndices.assign(m_nodesUsed, BVH_ROOT_INDEX);
+	m_instanceLeaves.assign(m_instances.size(), BVH_ROOT_INDEX);
+	m_nodeCost = 0.0;
+
+	for (U32 nodeIndex = 0; nodeIndex < m_nodesUsed; nodeIndex++)
+	{
+		if (nodeIndex == 1) continue;
+
+		const BvhNode& node = m_nodePool[nodeIndex];
+		m_nodeCost += nodeSahWeight(node) * node.bounds().area();
+
+		if (!node.isLeaf())
 		{
+			m_parentIndices[node.left()] = nodeIndex;
+			m_parentIndices[node.right()] = nodeIndex;
 			continue;
 		}
 
-		// Populate BVH bins
-		const F32 binScale = static_cast<F32>(BIN_COUNT) / (boundsMax - boundsMin);
-		BvhBin bins[BIN_COUNT];
+		for (U32 i = 0; i < node.count; i++)
+			m_instanceLeaves[m_indices[node.first() + i]] = nodeIndex;
+	}
 
-		for (SizeType i = 0; i < node.count; i++)
-		{
-			SizeType idx = node.first() + i;
-			const AABB& bounds = m_instances[m_indices[idx]].bounds;
+	// Instance bounds are up to date with the fresh nodes
+	for (Instance& instance : m_instances)
+		instance.clearDirty();
 
-			SizeType section = static_cast<SizeType>((bounds.center()[axis] - boundsMin) * binScale);
-			SizeType binIndex = min(BIN_COUNT - 1, section);
-			
-			BvhBin& bin = bins[binIndex];
-			bin.count++;
-			bin.boundingBox.grow(bounds);
-		}
+	m_buildCost = sahCost();
+}
 
-		// Calculate areas & primitive counts for bins
-		F32 leftArea[PLANE_COUNT]{}, rightArea[PLANE_COUNT]{};
-		U32 leftCount[PLANE_COUNT]{}, rightCount[PLANE_COUNT]{};
-		AABB leftBox = AABB(), rightBox = AABB();
-		U32 leftSum = 0, rightSum = 0;
+void BvhTLAS::refitFromLeaf(U32 nodeIndex)
+{
+	// Stops early once a node keeps its bounds, everything above it already encloses them
+	while (true)
+	{
+		BvhNode& node = m_nodePool[nodeIndex];
 
-		for (SizeType planeIdx = 0; planeIdx < PLANE_COUNT; planeIdx++)
+		AABB bounds = AABB();
+		if (node.isLeaf())
 		{
-			leftSum += bins[planeIdx].count;
-			leftCount[planeIdx] = leftSum;
-			leftBox.grow(bins[planeIdx].boundingBox);
-			leftArea[planeIdx] = leftBox.area();
-
-			const SizeType RIGHT_BIN = BIN_COUNT - 1 - planeIdx;
-			const SizeType RIGHT_PLANE = RIGHT_BIN - 1;
-			rightSum += bins[RIGHT_BIN].count;
-			rightCount[RIGHT_PLANE] = rightSum;
-			rightBox.grow(bins[RIGHT_BIN].boundingBox);
-			rightArea[RIGHT_PLANE] = rightBox.area();
+			for (U32 i = 0; i < node.count; i++)
+				bounds.grow(m_instances[m_indices[node.first() + i]].bounds);
 		}
-
-		// Calculate best split position
-		F32 binExtent = (boundsMax - boundsMin) / static_cast<F32>(BIN_COUNT);
-		for (SizeType planeIdx = 0; planeIdx < PLANE_COUNT; planeIdx++)
+		else
 		{
-			F32 planeCost = leftCount[planeIdx] * leftArea[planeIdx] + rightCount[planeIdx] * rightArea[planeIdx];
-
-			if (planeCost < bestCost)
-			{
-				bestCost = planeCost;
-				bestSplit = boundsMin + binExtent * (planeIdx + 1);
-				bestAxis = axis;
-			}
+			bounds.grow(m_nodePool[node.left()].bounds());
+			bounds.grow(m_nodePool[node.right()].bounds());
 		}
+
+		const AABB oldBounds = node.bounds();
+		if (bounds.bbMin.x == oldBounds.bbMin.x && bounds.bbMin.y == oldBounds.bbMin.y && bounds.bbMin.z == oldBounds.bbMin.z
+			&& bounds.bbMax.x == oldBounds.bbMax.x && bounds.bbMax.y == oldBounds.bbMax.y && bounds.bbMax.z == oldBounds.bbMax.z)
+			return;
+
+		m_nodeCost += nodeSahWeight(node) * (bounds.area() - oldBounds.area());
+		node.setBounds(bounds);
+
+		if (nodeIndex == BVH_ROOT_INDEX)
+			return;
+
+		nodeIndex = m_parentIndices[nodeIndex];
 	}
+}
 
-	cost = bestCost;
-	axis = bestAxis;
-	return bestSplit;
+F32 BvhTLAS::calculateNodeCost(const BvhNode& node) const
+{
+	return static_cast<F32>(node.count) * node.bounds().area();
+}
+
+template <U32 BinCount>
+F32 BvhTLAS::findSplitPlane(const BvhNode& node, F32& cost, U32& axis) const
+{
+	return findBinnedSplitPlane<BinCount>(node.count, [this, &node](U32 i) {
+		const AABB& bounds = m_instances[m_indices[node.first() + i]].bounds;
+		const __m128 bbMin = _mm_load_ps(bounds.bbMin.xyz);
+		const __m128 bbMax = _mm_load_ps(bounds.bbMax.xyz);
+
+		return PrimitiveBounds{
+			bbMin,
+			bbMax,
+			_mm_mul_ps(_mm_add_ps(bbMin, bbMax), _mm_set1_ps(0.5f))
+		};
+	}, cost, axis);
 }
 
 U32 BvhTLAS::partitionNode(const BvhNode& node, F32 splitPosition, U32 axis) const
@@ -935,12 +2230,14 @@ void BvhTLAS::updateNodeBounds(SizeType nodeIndex)
 	assert(nodeIndex < 2 * m_instances.size());
 	BvhNode& node = m_nodePool[nodeIndex];
 
+	AABB bounds = node.bounds();
 	for (SizeType i = 0; i < node.count; i++)
 	{
 		SizeType idx = node.first() + i;
-		const AABB& bounds = m_instances[m_indices[idx]].bounds;
-		node.boundingBox.grow(bounds);
+		bounds.grow(m_instances[m_indices[idx]].bounds);
 	}
+
+	node.setBounds(bounds);
 }
 
 void BvhTLAS::subdivide(SizeType nodeIndex)
@@ -950,7 +2247,7 @@ void BvhTLAS::subdivide(SizeType nodeIndex)
 
 	F32 cost = F32_INF;
 	U32 axis = 0;
-	F32 splitPosition = findSplitPlane(node, cost, axis);
+	F32 splitPosition = findSplitPlane<BIN_COUNT>(node, cost, axis);
 	F32 parentCost = calculateNodeCost(node);
 
 	if (cost >= parentCost)
@@ -966,21 +2263,23 @@ void BvhTLAS::subdivide(SizeType nodeIndex)
 		return;
 	}
 
-	U32 leftIndex = m_nodesUsed;
-	U32 rightIndex = m_nodesUsed + 1;
-	m_nodesUsed += 2;
+	// Child pairs are allocated atomically, concurrent subdivisions only ever touch their own node range
+	U32 leftIndex = 0;
+#pragma omp atomic capture
+	{ leftIndex = m_nodesUsed; m_nodesUsed += 2; }
+	U32 rightIndex = leftIndex + 1;
 
 	// Update left node
 	BvhNode& left = m_nodePool[leftIndex];
 	left.leftFirst = node.first();
 	left.count = leftCount;
-	left.boundingBox = AABB();
+	left.setBounds(AABB());
 
 	// Update right node
 	BvhNode& right = m_nodePool[rightIndex];
 	right.leftFirst = pivotPosition;
 	right.count = node.count - leftCount;
-	right.boundingBox = AABB();
+	right.setBounds(AABB());
 
 	// Update parent node
 	node.leftFirst = leftIndex;
@@ -988,6 +2287,9 @@ void BvhTLAS::subdivide(SizeType nodeIndex)
 
 	updateNodeBounds(leftIndex);
 	updateNodeBounds(rightIndex);
+
+	// Large subtrees are handed to the task pool, the right subtree is always handled by the current thread
+#pragma omp task if(leftCount > BUILD_TASK_THRESHOLD)
 	subdivide(leftIndex);
 	subdivide(rightIndex);
 }
@@ -0,0 +1,161 @@
+#include "bvh_morton.h"
+
+#include <algorithm>
+#include <cassert>
+#include <immintrin.h>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bvh_binning.h"
+#include "surf.h"
+#include "types.h"
+
+#define MORTON_RADIX_BUCKETS	(1 << MORTON_RADIX_BITS)
+#define MORTON_RADIX_PASSES		((3 * MORTON_AXIS_BITS + MORTON_RADIX_BITS - 1) / MORTON_RADIX_BITS)
+
+// Spreads the lower 10 bits of value so 2 zero bits follow every bit
+static U32 expandBits(U32 value)
+{
+	value = (value * 0x00010001u) & 0xFF0000FFu;
+	value = (value * 0x00000101u) & 0x0F00F00Fu;
+	value = (value * 0x00000011u) & 0xC30C30C3u;
+	value = (value * 0x00000005u) & 0x49249249u;
+	return value;
+}
+
+U32 mortonCode(U32 x, U32 y, U32 z)
+{
+	return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+void sortByMortonCode(const PrimitiveBounds* primitiveBounds, U32 count, U32* indices, U32* codes)
+{
+	assert(primitiveBounds != nullptr);
+	assert(indices != nullptr && codes != nullptr);
+
+	if (count == 0)
+		return;
+
+	__m128 centroidMin = _mm_set1_ps(F32_INF);
+	__m128 centroidMax = _mm_set1_ps(F32_NEG_INF);
+	for (U32 i = 0; i < count; i++)
+	{
+		centroidMin = _mm_min_ps(centroidMin, primitiveBounds[i].centroid);
+		centroidMax = _mm_max_ps(centroidMax, primitiveBounds[i].centroid);
+	}
+
+	// Flat axes get a scale of 0, so all centroids land in the first grid cell along that axis
+	const F32 gridSize = static_cast<F32>(1 << MORTON_AXIS_BITS);
+	const __m128 extent = _mm_sub_ps(centroidMax, centroidMin);
+	const __m128 scale = _mm_andnot_ps(_mm_cmple_ps(extent, _mm_setzero_ps()), _mm_div_ps(_mm_set1_ps(gridSize), extent));
+	const __m128i maxCell = _mm_set1_epi32((1 << MORTON_AXIS_BITS) - 1);
+
+	std::vector<U32> sortedIndices(count);
+	std::vector<U32> sortedCodes(count);
+
+	I32 threadCount = 1;
+#ifdef _OPENMP
+	if (count >= MORTON_PARALLEL_COUNT && !omp_in_parallel())
+		threadCount = omp_get_max_threads();
+#endif
+
+	// Per thread digit counts, turned into the scatter offsets of every thread's chunk by the prefix sum of each pass
+	std::vector<U32> offsets(static_cast<SizeType>(threadCount) * MORTON_RADIX_BUCKETS);
+
+#pragma omp parallel num_threads(threadCount)
+	{
+		I32 thread = 0;
+#ifdef _OPENMP
+		thread = omp_get_thread_num();
+#endif
+		const U32 chunkFirst = static_cast<U32>(static_cast<U64>(count) * thread / threadCount);
+		const U32 chunkEnd = static_cast<U32>(static_cast<U64>(count) * (thread + 1) / threadCount);
+
+		for (U32 i = chunkFirst; i < chunkEnd; i++)
+		{
+			ALIGN(16) I32 cell[4];
+			const __m128 position = _mm_mul_ps(_mm_sub_ps(primitiveBounds[i].centroid, centroidMin), scale);
+			_mm_store_si128(reinterpret_cast<__m128i*>(cell), _mm_min_epi32(_mm_cvttps_epi32(position), maxCell));
+
+			indices[i] = i;
+			codes[i] = mortonCode(cell[0], cell[1], cell[2]);
+		}
+
+		U32* keys = codes;
+		U32* values = indices;
+		U32* sortedKeys = sortedCodes.data();
+		U32* sortedValues = sortedIndices.data();
+		U32* threadOffsets = &offsets[static_cast<SizeType>(thread) * MORTON_RADIX_BUCKETS];
+
+		for (U32 pass = 0; pass < MORTON_RADIX_PASSES; pass++)
+		{
+			const U32 shift = pass * MORTON_RADIX_BITS;
+
+			for (U32 bucket = 0; bucket < MORTON_RADIX_BUCKETS; bucket++)
+				threadOffsets[bucket] = 0;
+
+			for (U32 i = chunkFirst; i < chunkEnd; i++)
+				threadOffsets[(keys[i] >> shift) & (MORTON_RADIX_BUCKETS - 1)]++;
+
+#pragma omp barrier
+#pragma omp single
+			{
+				// Buckets in order, chunks in thread order within every bucket, keeping the sort stable
+				U32 offset = 0;
+				for (U32 bucket = 0; bucket < MORTON_RADIX_BUCKETS; bucket++)
+				{
+					for (I32 t = 0; t < threadCount; t++)
+					{
+						U32& bucketOffset = offsets[static_cast<SizeType>(t) * MORTON_RADIX_BUCKETS + bucket];
+						const U32 bucketCount = bucketOffset;
+						bucketOffset = offset;
+						offset += bucketCount;
+					}
+				}
+			}
+
+			for (U32 i = chunkFirst; i < chunkEnd; i++)
+			{
+				const U32 target = threadOffsets[(keys[i] >> shift) & (MORTON_RADIX_BUCKETS - 1)]++;
+				sortedKeys[target] = keys[i];
+				sortedValues[target] = values[i];
+			}
+
+			std::swap(keys, sortedKeys);
+			std::swap(values, sortedValues);
+
+#pragma omp barrier
+		}
+	}
+
+	// An odd pass count leaves the result in the scratch arrays
+	if (MORTON_RADIX_PASSES % 2 == 1)
+	{
+		std::copy(sortedIndices.begin(), sortedIndices.end(), indices);
+		std::copy(sortedCodes.begin(), sortedCodes.end(), codes);
+	}
+}
+
+U32 findMortonSplit(const U32* codes, U32 count)
+{
+	assert(codes != nullptr && count >= 2);
+
+	const U32 differingBits = codes[0] ^ codes[count - 1];
+	if (differingBits == 0)
+		return count / 2;
+
+	U32 highestBit = differingBits;
+	highestBit |= highestBit >> 1;
+	highestBit |= highestBit >> 2;
+	highestBit |= highestBit >> 4;
+	highestBit |= highestBit >> 8;
+	highestBit |= highestBit >> 16;
+	highestBit ^= highestBit >> 1;
+
+	// Codes of a sorted range share all bits above the highest differing bit, so the range splits where that bit turns on
+	const U32* split = std::partition_point(codes, codes + count, [highestBit](U32 code) { return (code & highestBit) == 0; });
+	return static_cast<U32>(split - codes);
+}
@@ -0,0 +1,118 @@
+#include "bvh_rebuilder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bvh.h"
+#include "types.h"
+
+BvhRebuilder::BvhRebuilder()
+	:
+	m_jobs()
+{
+}
+
+BvhRebuilder::~BvhRebuilder()
+{
+	for (auto& job : m_jobs)
+	{
+		if (job->worker.joinable())
+			job->worker.join();
+	}
+}
+
+void BvhRebuilder::buildFastFirst(const std::vector<BvhBLAS*>& blasList)
+{
+	// Same task layout as BvhBLAS::buildConcurrent, only the build mode differs
+#pragma omp parallel
+#pragma omp single
+	for (BvhBLAS* blas : blasList)
+	{
+		assert(blas != nullptr);
+
+#pragma omp task firstprivate(blas)
+		blas->build(BvhBuildMode::Morton);
+	}
+
+	for (BvhBLAS* blas : blasList)
+	{
+		// Morton is the fast build already, there is nothing better to swap in
+		if (blas->buildMode() != BvhBuildMode::Morton)
+			requestRebuild(blas);
+	}
+}
+
+void BvhRebuilder::requestRebuild(BvhBLAS* blas)
+{
+	assert(blas != nullptr);
+
+	for (auto& job : m_jobs)
+	{
+		if (job->target == blas)
+			job->superseded = true;
+	}
+
+	std::unique_ptr<RebuildJob> job = std::make_unique<RebuildJob>();
+	job->target = blas;
+	job->finished = false;
+	job->superseded = false;
+
+	// The new tree is built into its own BLAS, the target is only touched by the swap
+	RebuildJob* pJob = job.get();
+	job->worker = std::thread([pJob]() {
+		// Outside of a parallel region the build tasks & Morton sort would start a team as large as the machine per worker
+#ifdef _OPENMP
+		omp_set_num_threads(std::max(1, omp_get_num_procs() / BVH_REBUILD_CORE_SHARE));
+#endif
+
+		const BvhBLAS* target = pJob->target;
+		pJob->result = std::make_unique<BvhBLAS>(target->mesh(), false, target->buildMode(), target->indexBudget());
+		pJob->finished.store(true, std::memory_order_release);
+	});
+
+	m_jobs.push_back(std::move(job));
+}
+
+bool BvhRebuilder::swapFinished()
+{
+	bool swapped = false;
+	for (SizeType i = 0; i < m_jobs.size();)
+	{
+		RebuildJob& job = *m_jobs[i];
+		if (!job.finished.load(std::memory_order_acquire))
+		{
+			i++;
+			continue;
+		}
+
+		if (job.worker.joinable())
+			job.worker.join();
+
+		if (!job.superseded)
+		{
+			job.target->swapTree(*job.result);
+			swapped = true;
+		}
+
+		m_jobs.erase(m_jobs.begin() + i);
+	}
+
+	return swapped;
+}
+
+void BvhRebuilder::finish()
+{
+	for (auto& job : m_jobs)
+		job->worker.join();
+
+	swapFinished();
+}
@@ -0,0 +1,77 @@
+#include "bvh_stats.h"
+
+#include <cstdio>
+
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+#define CLIP_MAX_VERTICES	9	// Clipping a triangle against the 6 box planes adds at most 1 vertex per plane
+
+F32 clippedTriangleArea(const Float3& v0, const Float3& v1, const Float3& v2, const Float3& bbMin, const Float3& bbMax)
+{
+	Float3 polygon[CLIP_MAX_VERTICES] = { v0, v1, v2 };
+	Float3 clipped[CLIP_MAX_VERTICES];
+	U32 vertexCount = 3;
+
+	// Sutherland-Hodgman against the min & max plane of every axis
+	for (U32 plane = 0; plane < 6 && vertexCount > 0; plane++)
+	{
+		const U32 axis = plane / 2;
+		const bool isMax = (plane & 1) != 0;
+		const F32 bound = isMax ? bbMax.xyz[axis] : bbMin.xyz[axis];
+
+		// Signed distance to the plane, positive inside the box
+		auto distance = [axis, isMax, bound](const Float3& vertex) {
+			return isMax ? bound - vertex.xyz[axis] : vertex.xyz[axis] - bound;
+		};
+
+		U32 clippedCount = 0;
+		for (U32 i = 0; i < vertexCount; i++)
+		{
+			const Float3& current = polygon[i];
+			const Float3& next = polygon[(i + 1) % vertexCount];
+			const F32 currentDistance = distance(current);
+			const F32 nextDistance = distance(next);
+
+			if (currentDistance >= 0.0f)
+				clipped[clippedCount++] = current;
+
+			if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f))
+			{
+				const F32 t = currentDistance / (currentDistance - nextDistance);
+				clipped[clippedCount++] = current + (next - current) * t;
+			}
+		}
+
+		for (U32 i = 0; i < clippedCount; i++)
+			polygon[i] = clipped[i];
+
+		vertexCount = clippedCount;
+	}
+
+	// The clipped polygon stays convex & planar, so it is summed up as a triangle fan
+	Float3 areaVector = Float3(0.0f);
+	for (U32 i = 1; i + 1 < vertexCount; i++)
+		areaVector = areaVector + (polygon[i] - polygon[0]).cross(polygon[i + 1] - polygon[0]);
+
+	return 0.5f * areaVector.magnitude();
+}
+
+void printBvhStats(const char* name, const BvhStats& stats)
+{
+	printf("%s: %u nodes, %u leaves, depth %u max %.1f avg, built in %.2fms\n",
+		name, stats.nodeCount, stats.leafCount, stats.maxDepth, stats.averageDepth, stats.buildTime * 1'000.0f);
+	printf("\tSAH cost %.2f, EPO %.3f, sibling overlap %.3f\n", stats.sahCost, stats.epo, stats.siblingOverlap);
+	printf("\tmemory %.2fKiB binary, %.2fKiB traversal, %.2fKiB leaf primitives\n",
+		stats.nodeMemory / 1024.0f, stats.traversalMemory / 1024.0f, stats.leafMemory / 1024.0f);
+
+	printf("\tleaf sizes");
+	for (U32 i = 1; i < BVH_STATS_LEAF_BUCKETS; i++)
+	{
+		if (stats.leafHistogram[i] != 0)
+			printf(" %u%s:%u", i, i == BVH_STATS_LEAF_BUCKETS - 1 ? "+" : "", stats.leafHistogram[i]);
+	}
+
+	printf("\n");
+}
@@ -0,0 +1,110 @@
+#include "instance_flattener.h"
+
+#include <cassert>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "bvh.h"
+#include "material.h"
+#include "mesh.h"
+#include "surf_math.h"
+#include "types.h"
+
+InstanceFlattener::InstanceFlattener(const std::vector<Instance>& instances, BvhBuildMode buildMode)
+	:
+	m_meshes(),
+	m_blasses(),
+	m_instances(),
+	m_bakedInstanceCount(0)
+{
+	// Static copies of every BLAS, baking them duplicates all but one copy of the mesh
+	std::map<const BvhBLAS*, SizeType> staticCopies;
+	for (auto const& instance : instances)
+	{
+		if (!instance.animated && instance.bvh != nullptr)
+			staticCopies[instance.bvh]++;
+	}
+
+	// Baked instances get a BVH, other acceleration structures, analytic meshes & assemblies are kept as they are
+	auto isBakeable = [&staticCopies](const Instance& instance) {
+		return !instance.animated && instance.bvh != nullptr && !instance.mesh()->isAnalytic() && instance.bvh->triCount() * (staticCopies[instance.bvh] - 1) <= FLATTEN_MAX_DUPLICATED_TRIS;
+	};
+
+	// Instances sharing a material & visibility mask, in order of their first instance.
+	// Merging a lone instance only costs memory, so groups need at least 2 instances
+	typedef std::pair<Material*, U8> GroupKey;
+	std::vector<GroupKey> groupKeys;
+	std::map<GroupKey, std::vector<SizeType>> groups;
+	for (SizeType i = 0; i < instances.size(); i++)
+	{
+		if (!isBakeable(instances[i]))
+			continue;
+
+		const GroupKey key = GroupKey(instances[i].material, instances[i].visibilityMask);
+		std::vector<SizeType>& group = groups[key];
+		if (group.empty())
+			groupKeys.push_back(key);
+
+		group.push_back(i);
+	}
+
+	std::vector<bool> baked(instances.size(), false);
+	for (const GroupKey& key : groupKeys)
+	{
+		const std::vector<SizeType>& group = groups[key];
+		if (group.size() < 2)
+			continue;
+
+		std::vector<Triangle> triangles;
+		std::vector<TriExtension> triExtensions;
+		for (SizeType instanceIndex : group)
+		{
+			const Instance& instance = instances[instanceIndex];
+			const Mesh* mesh = instance.bvh->mesh();
+			const Mat3x4 transform = Mat3x4(instance.transform());
+			baked[instanceIndex] = true;
+
+			for (SizeType i = 0; i < mesh->triangles.size(); i++)
+			{
+				const Triangle& tri = mesh->triangles[i];
+				triangles.push_back(Triangle(
+					transform.transformPoint(tri.v1),
+					transform.transformPoint(tri.v0),
+					transform.transformPoint(tri.v2)
+				));
+
+				// Normals go through the same transform as instance hits use, so baking does not change shading
+				TriExtension ext = mesh->triExtensions[i];
+				ext.n0 = transform.transformVector(ext.n0).normalize();
+				ext.n1 = transform.transformVector(ext.n1).normalize();
+				ext.n2 = transform.transformVector(ext.n2).normalize();
+				triExtensions.push_back(ext);
+			}
+		}
+
+		m_meshes.push_back(std::make_unique<Mesh>(std::move(triangles), std::move(triExtensions)));
+		m_blasses.push_back(std::make_unique<BvhBLAS>(m_meshes.back().get(), false, buildMode));
+	}
+
+	for (SizeType i = 0; i < instances.size(); i++)
+	{
+		if (!baked[i])
+			m_instances.push_back(instances[i]);
+	}
+
+	SizeType blasIndex = 0;
+	for (const GroupKey& key : groupKeys)
+	{
+		if (groups[key].size() < 2)
+			continue;
+
+		Instance bakedInstance = Instance(m_blasses[blasIndex++].get(), key.first, Mat4(1.0f));
+		bakedInstance.visibilityMask = key.second;
+		m_instances.push_back(bakedInstance);
+		m_bakedInstanceCount++;
+	}
+
+	assert(blasIndex == m_blasses.size());
+}
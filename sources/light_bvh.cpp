@@ -0,0 +1,393 @@
+#include "light_bvh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "bvh.h"
+#include "surf_math.h"
+#include "types.h"
+
+// cos(max(0, a - b)) & sin(max(0, a - b)) of two angles given by their sine & cosine
+static inline F32 cosSubClamped(F32 sinA, F32 cosA, F32 sinB, F32 cosB) { return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB; }
+static inline F32 sinSubClamped(F32 sinA, F32 cosA, F32 sinB, F32 cosB) { return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB; }
+
+static inline F32 sinFromCos(F32 cosTheta) { return sqrtf(max(0.0f, 1.0f - cosTheta * cosTheta)); }
+
+// Grows the cone to the smallest cone holding both cones
+static void mergeCones(Float3& axis, F32& cosTheta, const Float3& otherAxis, F32 otherCosTheta)
+{
+	const F32 theta = acosf(clamp(cosTheta, -1.0f, 1.0f));
+	const F32 otherTheta = acosf(clamp(otherCosTheta, -1.0f, 1.0f));
+	const F32 thetaD = acosf(clamp(axis.dot(otherAxis), -1.0f, 1.0f));
+
+	if (min(thetaD + otherTheta, F32_PI) <= theta)
+		return;
+
+	if (min(thetaD + theta, F32_PI) <= otherTheta)
+	{
+		axis = otherAxis;
+		cosTheta = otherCosTheta;
+		return;
+	}
+
+	const F32 thetaO = 0.5f * (theta + thetaD + otherTheta);
+	const Float3 rotationAxis = axis.cross(otherAxis);
+	if (thetaO >= F32_PI || rotationAxis.dot(rotationAxis) < 1e-12f)
+	{
+		cosTheta = -1.0f;
+		return;
+	}
+
+	// Rotate the axis towards the other axis, so the cone edge opposite of the other cone stays in place
+	const F32 thetaR = thetaO - theta;
+	const Float3 k = rotationAxis.normalize();
+	axis = (axis * cosf(thetaR) + k.cross(axis) * sinf(thetaR)).normalize();
+	cosTheta = cosf(thetaO);
+}
+
+void LightBounds::grow(const LightBounds& other)
+{
+	if (other.count == 0)
+		return;
+
+	if (count == 0)
+	{
+		*this = other;
+		return;
+	}
+
+	bounds.grow(other.bounds);
+	mergeCones(axis, cosThetaO, other.axis, other.cosThetaO);
+	cosThetaE = min(cosThetaE, other.cosThetaE);
+	power += other.power;
+	count += other.count;
+}
+
+F32 LightBounds::cost() const
+{
+	const F32 thetaO = acosf(clamp(cosThetaO, -1.0f, 1.0f));
+	const F32 thetaE = acosf(clamp(cosThetaE, -1.0f, 1.0f));
+	const F32 thetaW = min(thetaO + thetaE, F32_PI);
+	const F32 sinThetaO = sinFromCos(cosThetaO);
+
+	// Solid angle measure of the directions lit by the cone, including the cosine falloff beyond the normal spread
+	const F32 orientation = 2.0f * F32_PI * (1.0f - cosThetaO)
+		+ 0.5f * F32_PI * (2.0f * thetaW * sinThetaO - cosf(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinThetaO + cosThetaO);
+
+	return power * orientation * bounds.area();
+}
+
+F32 LightBvhNode::importance(const Float3& position, const Float3& normal) const
+{
+	const Float3 center = (bbMin + bbMax) * 0.5f;
+	const Float3 halfExtent = (bbMax - bbMin) * 0.5f;
+	const F32 radius2 = halfExtent.dot(halfExtent);
+	const Float3 toReceiver = position - center;
+	const F32 distance2 = toReceiver.dot(toReceiver);
+
+	// Receivers inside the bounding sphere may be lit from any direction
+	if (distance2 <= radius2)
+		return power / max(radius2, F32_EPSILON);
+
+	const Float3 wi = toReceiver / sqrtf(distance2);
+	const F32 sinThetaB = sqrtf(radius2 / distance2);
+	const F32 cosThetaB = sinFromCos(sinThetaB);
+
+	// Smallest angle between an emitter normal & a direction from the bounds towards the receiver
+	const F32 cosThetaW = axis.dot(wi);
+	const F32 cosThetaX = cosSubClamped(sinFromCos(cosThetaW), cosThetaW, sinFromCos(cosThetaO), cosThetaO);
+	const F32 sinThetaX = sinSubClamped(sinFromCos(cosThetaW), cosThetaW, sinFromCos(cosThetaO), cosThetaO);
+	const F32 cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+	if (cosThetaP <= cosThetaE)
+		return 0.0f;
+
+	// Smallest angle between the receiver normal & a direction towards the bounds
+	const F32 cosThetaI = -normal.dot(wi);
+	const F32 cosThetaIP = cosSubClamped(sinFromCos(cosThetaI), cosThetaI, sinThetaB, cosThetaB);
+
+	return max(0.0f, power * cosThetaP * cosThetaIP / distance2);
+}
+
+LightBvh::LightBvh()
+	:
+	m_nodesUsed(0)
+{
+	//
+}
+
+LightBvh::LightBvh(const std::vector<Instance>& instances)
+	:
+	LightBvh()
+{
+	build(instances);
+}
+
+void LightBvh::build(const std::vector<Instance>& instances)
+{
+	m_emitters.clear();
+	for (U32 instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++)
+	{
+		const Instance& instance = instances[instanceIndex];
+		if (!instance.isEmitter())
+			continue;
+
+		const Mat3x4 transform = Mat3x4(instance.transform());
+		const Mesh* mesh = instance.mesh();
+		for (U32 primitiveIndex = 0; primitiveIndex < mesh->analyticPrimitives.size(); primitiveIndex++)
+		{
+			Emitter emitter = {};
+			emitter.type = mesh->primitiveType;
+			emitter.analytic = mesh->analyticPrimitives[primitiveIndex].transformed(emitter.type, transform);
+			emitter.emittance = instance.material->emittance();
+			emitter.area = emitter.analytic.area(emitter.type);
+			emitter.instanceIndex = instanceIndex;
+			emitter.primitiveIndex = primitiveIndex;
+
+			if (emitter.area > 0.0f)
+				m_emitters.push_back(emitter);
+		}
+
+		for (U32 primitiveIndex = 0; primitiveIndex < mesh->triangles.size(); primitiveIndex++)
+		{
+			const Triangle& triangle = mesh->triangles[primitiveIndex];
+			const TriExtension& extension = mesh->triExtensions[primitiveIndex];
+
+			Emitter emitter = {};
+			emitter.type = PrimitiveType::Triangle;
+			emitter.v0 = transform.transformPoint(triangle.v0);
+			emitter.v1 = transform.transformPoint(triangle.v1);
+			emitter.v2 = transform.transformPoint(triangle.v2);
+			emitter.n0 = transform.transformVector(extension.n0).normalize();
+			emitter.n1 = transform.transformVector(extension.n1).normalize();
+			emitter.n2 = transform.transformVector(extension.n2).normalize();
+			emitter.emittance = instance.material->emittance();
+			emitter.area = 0.5f * (emitter.v1 - emitter.v0).cross(emitter.v2 - emitter.v0).magnitude();
+			emitter.instanceIndex = instanceIndex;
+			emitter.primitiveIndex = primitiveIndex;
+
+			// Degenerate triangles emit nothing
+			if (emitter.area > 0.0f)
+				m_emitters.push_back(emitter);
+		}
+	}
+
+	const U32 emitterCount = static_cast<U32>(m_emitters.size());
+	m_nodes.resize(emitterCount > 0 ? 2 * emitterCount - 1 : 0);
+	m_nodesUsed = 0;
+
+	if (emitterCount == 0)
+		return;
+
+	std::vector<LightBounds> emitterBounds(emitterCount);
+	std::vector<U32> emitterIndices(emitterCount);
+	for (U32 i = 0; i < emitterCount; i++)
+	{
+		const Emitter& emitter = m_emitters[i];
+		LightBounds& bounds = emitterBounds[i];
+		if (emitter.type != PrimitiveType::Triangle)
+		{
+			// Spheres emit in every direction, flat primitives along their single normal
+			emitter.analytic.bounds(emitter.type, bounds.bounds.bbMin, bounds.bounds.bbMax);
+			bounds.axis = emitter.type == PrimitiveType::Sphere ? Float3(0.0f, 0.0f, 1.0f) : emitter.analytic.normal(emitter.type, Float2(0.0f));
+			bounds.cosThetaO = emitter.type == PrimitiveType::Sphere ? -1.0f : 1.0f;
+		}
+		else
+		{
+			bounds.bounds.grow(emitter.v0);
+			bounds.bounds.grow(emitter.v1);
+			bounds.bounds.grow(emitter.v2);
+
+			// The cone holds the interpolated shading normals, which the estimator weighs the emission with
+			const Float3 normalSum = emitter.n0 + emitter.n1 + emitter.n2;
+			if (normalSum.dot(normalSum) > 0.0f)
+			{
+				bounds.axis = normalSum.normalize();
+				bounds.cosThetaO = min(bounds.axis.dot(emitter.n0), min(bounds.axis.dot(emitter.n1), bounds.axis.dot(emitter.n2)));
+			}
+			else
+			{
+				bounds.axis = (emitter.v1 - emitter.v0).cross(emitter.v2 - emitter.v0).normalize();
+				bounds.cosThetaO = -1.0f;
+			}
+		}
+
+		bounds.cosThetaE = 0.0f;	// Diffuse emitters light the hemisphere around their normal
+		bounds.power = luminance(emitter.emittance) * emitter.area * F32_PI;
+		bounds.count = 1;
+		emitterIndices[i] = i;
+	}
+
+	m_nodesUsed = 1;
+	buildNode(emitterBounds.data(), emitterIndices.data(), 0, 0, emitterCount);
+	assert(m_nodesUsed == m_nodes.size());
+}
+
+void LightBvh::buildNode(const LightBounds* emitterBounds, U32* emitterIndices, U32 nodeIndex, U32 first, U32 count)
+{
+	LightBounds nodeBounds;
+	AABB centroidBounds;
+	for (U32 i = first; i < first + count; i++)
+	{
+		nodeBounds.grow(emitterBounds[emitterIndices[i]]);
+		centroidBounds.grow(emitterBounds[emitterIndices[i]].bounds.center());
+	}
+
+	LightBvhNode& node = m_nodes[nodeIndex];
+	node.bbMin = nodeBounds.bounds.bbMin;
+	node.bbMax = nodeBounds.bounds.bbMax;
+	node.power = nodeBounds.power;
+	node.axis = nodeBounds.axis;
+	node.cosThetaO = nodeBounds.cosThetaO;
+	node.cosThetaE = nodeBounds.cosThetaE;
+	node.instanceIndex = UNSET_INDEX;
+	node.primitiveIndex = UNSET_INDEX;
+
+	if (count == 1)
+	{
+		const Emitter& emitter = m_emitters[emitterIndices[first]];
+		node.left = emitterIndices[first];
+		node.instanceIndex = emitter.instanceIndex;
+		node.primitiveIndex = emitter.primitiveIndex;
+		return;
+	}
+
+	// Binned surface area orientation heuristic, elongated nodes are split across their long axis more eagerly
+	const Float3 extent = nodeBounds.bounds.bbMax - nodeBounds.bounds.bbMin;
+	const Float3 centroidExtent = centroidBounds.bbMax - centroidBounds.bbMin;
+	const F32 maxExtent = max(extent.x, max(extent.y, extent.z));
+
+	F32 bestCost = F32_INF;
+	I32 bestAxis = -1;
+	U32 bestSplit = 0;
+	for (U32 axis = 0; axis < 3; axis++)
+	{
+		if (centroidExtent.xyz[axis] <= 0.0f)
+			continue;
+
+		const F32 scale = LIGHT_BVH_BINS / centroidExtent.xyz[axis];
+		auto binIndex = [&](U32 emitterIndex) {
+			const F32 centroid = emitterBounds[emitterIndex].bounds.center().xyz[axis];
+			return min(static_cast<U32>((centroid - centroidBounds.bbMin.xyz[axis]) * scale), static_cast<U32>(LIGHT_BVH_BINS - 1));
+		};
+
+		LightBounds bins[LIGHT_BVH_BINS];
+		for (U32 i = first; i < first + count; i++)
+			bins[binIndex(emitterIndices[i])].grow(emitterBounds[emitterIndices[i]]);
+
+		// Costs of the bins right of every split plane, swept from the right
+		F32 rightCosts[LIGHT_BVH_BINS - 1];
+		LightBounds right;
+		for (U32 split = LIGHT_BVH_BINS - 1; split > 0; split--)
+		{
+			right.grow(bins[split]);
+			rightCosts[split - 1] = right.count > 0 ? right.cost() : F32_INF;
+		}
+
+		const F32 axisWeight = maxExtent / extent.xyz[axis];
+		LightBounds left;
+		for (U32 split = 1; split < LIGHT_BVH_BINS; split++)
+		{
+			left.grow(bins[split - 1]);
+			if (left.count == 0 || left.count == count)
+				continue;
+
+			const F32 cost = axisWeight * (left.cost() + rightCosts[split - 1]);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = static_cast<I32>(axis);
+				bestSplit = split;
+			}
+		}
+	}
+
+	U32 leftCount = count / 2;
+	if (bestAxis >= 0)
+	{
+		const U32 axis = static_cast<U32>(bestAxis);
+		const F32 scale = LIGHT_BVH_BINS / centroidExtent.xyz[axis];
+		U32* middle = std::partition(emitterIndices + first, emitterIndices + first + count, [&](U32 emitterIndex) {
+			const F32 centroid = emitterBounds[emitterIndex].bounds.center().xyz[axis];
+			return min(static_cast<U32>((centroid - centroidBounds.bbMin.xyz[axis]) * scale), static_cast<U32>(LIGHT_BVH_BINS - 1)) < bestSplit;
+		});
+
+		leftCount = static_cast<U32>(middle - (emitterIndices + first));
+	}
+
+	// Emitters sharing one centroid are split in the middle
+	assert(leftCount > 0 && leftCount < count);
+
+	const U32 left = m_nodesUsed;
+	m_nodesUsed += 2;
+	m_nodes[nodeIndex].left = left;
+
+	buildNode(emitterBounds, emitterIndices, left, first, leftCount);
+	buildNode(emitterBounds, emitterIndices, left + 1, first + leftCount, count - leftCount);
+}
+
+bool LightBvh::sample(U32& seed, const Float3& position, const Float3& normal, EmitterSample& sample) const
+{
+	if (m_nodesUsed == 0)
+		return false;
+
+	U32 nodeIndex = BVH_ROOT_INDEX;
+	F32 probability = 1.0f;
+	while (!m_nodes[nodeIndex].isLeaf())
+	{
+		const U32 left = m_nodes[nodeIndex].left;
+		const F32 leftImportance = m_nodes[left].importance(position, normal);
+		const F32 rightImportance = m_nodes[left + 1].importance(position, normal);
+		const F32 totalImportance = leftImportance + rightImportance;
+		if (totalImportance <= 0.0f)
+			return false;
+
+		const F32 leftProbability = leftImportance / totalImportance;
+		if (randomF32(seed) < leftProbability)
+		{
+			nodeIndex = left;
+			probability *= leftProbability;
+		}
+		else
+		{
+			nodeIndex = left + 1;
+			probability *= 1.0f - leftProbability;
+		}
+	}
+
+	const Emitter& emitter = m_emitters[m_nodes[nodeIndex].left];
+	if (emitter.type != PrimitiveType::Triangle)
+	{
+		const F32 random0 = randomF32(seed);
+		const F32 random1 = randomF32(seed);
+		if (emitter.type == PrimitiveType::Sphere)
+		{
+			sample.pdf = probability * emitter.analytic.sampleSphereCap(position, random0, random1, sample.position, sample.normal);
+			sample.emittance = emitter.emittance;
+			sample.instanceIndex = emitter.instanceIndex;
+			return true;
+		}
+
+		const Float2 coordinates = AnalyticPrimitive::sampleCoordinates(emitter.type, random0, random1);
+
+		sample.position = emitter.analytic.position(emitter.type, coordinates);
+		sample.normal = emitter.analytic.normal(emitter.type, coordinates);
+		sample.emittance = emitter.emittance;
+		sample.pdf = probability / emitter.area;
+		sample.instanceIndex = emitter.instanceIndex;
+		return true;
+	}
+
+	// Uniform point on the emitter triangle
+	const F32 sqrtU = sqrtf(randomF32(seed));
+	const F32 b1 = 1.0f - sqrtU;
+	const F32 b2 = randomF32(seed) * sqrtU;
+	const F32 b0 = 1.0f - b1 - b2;
+
+	sample.position = emitter.v0 * b0 + emitter.v1 * b1 + emitter.v2 * b2;
+	sample.normal = (emitter.n0 * b0 + emitter.n1 * b1 + emitter.n2 * b2).normalize();
+	sample.emittance = emitter.emittance;
+	sample.pdf = probability / emitter.area;
+	sample.instanceIndex = emitter.instanceIndex;
+	return true;
+}
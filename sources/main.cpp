@@ -1,16 +1,22 @@
 #include "surf.h"
 
 #include <cstdio>
+#include <map>
+#include <memory>
 
 #include "bvh.h"
+#include "bvh_rebuilder.h"
 #include "camera.h"
+#include "instance_flattener.h"
 #include "material.h"
 #include "mesh.h"
 #include "render_context.h"
 #include "renderer.h"
 #include "scene.h"
+#include "uniform_grid.h"
 #include "surf_math.h"
 #include "pixel_buffer.h"
+#include "ray_stream.h"
 #include "timer.h"
 #include "types.h"
 #include "ui_manager.h"
@@ -33,6 +39,14 @@
 
 #define FRAMEDATA_OUTPUT		1
 #define GPU_PATH_TRACING		1
+#define TRAVERSAL_BENCHMARK		0	// Compare single ray & ray stream traversal on diffuse bounce rays before rendering
+#define BENCHMARK_REPEATS		5
+#define BVH_STATS_REPORT		0	// Print tree quality & memory statistics of every BLAS and the TLAS after building
+#define FLATTEN_STATIC_INSTANCES	1	// Bake static instances sharing a material into world space BLASses before building the scene
+#define BVH_FAST_FIRST_BUILD		1	// Render on Morton built BLASses first, the configured builds finish in the background & are swapped in
+#define ACCEL_BENCHMARK			0	// Trace the same rays through the scene on BVH & uniform grid BLASses before rendering
+#define ANALYTIC_LIGHTS			1	// Light the scene with analytic spheres instead of the tessellated rounded cubes
+#define INSTANCE_ASSEMBLIES		0	// Line the back of the room with rows of small cubes, a single row assembly is placed for every row
 
 void handleCameraInput(GLFWwindow* window, Camera& camera, F32 deltaTime, bool& updated)
 {
@@ -112,6 +126,174 @@ void handleCameraInput(GLFWwindow* window, Camera& camera, F32 deltaTime, bool&
 	camera.up = camera.forward.cross(right).normalize();
 }
 
+// One diffuse bounce ray from every primary hit
+std::vector<Ray> generateBounceRays(Scene& scene, Camera& camera)
+{
+	U32 seed = initSeed(1799);
+	std::vector<Ray> bounceRays;
+	for (U32 y = 0; y < static_cast<U32>(camera.screenHeight); y++)
+	{
+		for (U32 x = 0; x < static_cast<U32>(camera.screenWidth); x++)
+		{
+			Ray ray = camera.getPrimaryRay(seed, static_cast<F32>(x), static_cast<F32>(y));
+			if (!scene.intersect(ray))
+				continue;
+
+			Float3 N = scene.hitNormal(ray.metadata);
+			if (ray.direction.dot(N) > 0.0f)
+				N *= -1.0f;
+
+			Float3 R = randomOnHemisphereCosineWeighted(seed, N);
+			bounceRays.push_back(Ray(ray.hitPosition() + F32_EPSILON * R, R, VISIBILITY_INDIRECT));
+		}
+	}
+
+	return bounceRays;
+}
+
+// Traces one diffuse bounce from every primary hit, first as single rays, then in RAY_STREAM_SIZE sized streams
+void benchmarkTraversal(Scene& scene, Camera& camera)
+{
+	const std::vector<Ray> bounceRays = generateBounceRays(scene, camera);
+	if (bounceRays.empty())
+		return;
+
+	// Any hit rays are clamped like shadow rays towards a light at a fixed distance
+	std::vector<Ray> occlusionRays = bounceRays;
+	for (Ray& ray : occlusionRays)
+		ray.depth = 5.0f;
+
+	const F32 rayCount = static_cast<F32>(bounceRays.size() * BENCHMARK_REPEATS);
+	Timer timer;
+	std::vector<Ray> rays;
+	U32 hits = 0;
+
+	auto report = [&](const char* name)
+	{
+		timer.tick();
+		printf("%-20s %08.2fMrays/s - %u hits\n", name, rayCount / (timer.deltaTime() * 1'000'000.0f), hits / BENCHMARK_REPEATS);
+		hits = 0;
+	};
+
+	timer.tick();
+	for (U32 repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
+	{
+		rays = bounceRays;
+		for (Ray& ray : rays)
+			hits += scene.intersect(ray) ? 1 : 0;
+	}
+	report("Single ray closest");
+
+	for (U32 repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
+	{
+		rays = occlusionRays;
+		for (Ray& ray : rays)
+			hits += scene.intersectAny(ray) ? 1 : 0;
+	}
+	report("Single ray any");
+
+	RayStream stream;
+	for (U32 repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
+	{
+		for (SizeType first = 0; first < bounceRays.size(); first += RAY_STREAM_SIZE)
+		{
+			const SizeType last = min(first + RAY_STREAM_SIZE, bounceRays.size());
+			stream.rays.assign(bounceRays.begin() + first, bounceRays.begin() + last);
+			scene.intersect(stream);
+
+			for (const Ray& ray : stream.rays)
+				hits += ray.metadata.instanceIndex != UNSET_INDEX ? 1 : 0;
+		}
+	}
+	report("Stream closest");
+
+	for (U32 repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
+	{
+		for (SizeType first = 0; first < occlusionRays.size(); first += RAY_STREAM_SIZE)
+		{
+			const SizeType last = min(first + RAY_STREAM_SIZE, occlusionRays.size());
+			stream.rays.assign(occlusionRays.begin() + first, occlusionRays.begin() + last);
+			scene.intersectAny(stream);
+
+			for (const Ray& ray : stream.rays)
+				hits += ray.metadata.instanceIndex != UNSET_INDEX ? 1 : 0;
+		}
+	}
+	report("Stream any");
+}
+
+// Traces the benchmark bounce rays through the scene twice, once on the BLASses of the instances & once on uniform grids
+// over the same meshes, so the faster structure can be picked per mesh
+void benchmarkAccelerationStructures(const SceneBackground& background, const std::vector<Instance>& instances, Camera& camera)
+{
+	std::map<const Mesh*, std::unique_ptr<UniformGrid>> grids;
+	std::vector<Instance> gridInstances;
+	for (auto const& instance : instances)
+	{
+		// Assemblies are traced on the BLASses of their members in both scenes
+		if (instance.isAssembly())
+		{
+			gridInstances.push_back(instance);
+			continue;
+		}
+
+		std::unique_ptr<UniformGrid>& grid = grids[instance.mesh()];
+		if (grid == nullptr)
+		{
+			grid = std::make_unique<UniformGrid>(instance.accel->mesh());
+			printf("%zu primitives: BVH %.2fms %.2fKiB, grid %.2fms %.2fKiB\n", instance.mesh()->primitiveCount(),
+				instance.accel->buildTime() * 1'000.0f, instance.accel->memoryUsage() / 1024.0f, grid->buildTime() * 1'000.0f, grid->memoryUsage() / 1024.0f);
+		}
+
+		Instance gridInstance(grid.get(), instance.material, instance.transform());
+		gridInstance.animated = instance.animated;
+		gridInstance.visibilityMask = instance.visibilityMask;
+		gridInstances.push_back(gridInstance);
+	}
+
+	Scene bvhScene(background, instances);
+	Scene gridScene(background, gridInstances);
+
+	const std::vector<Ray> bounceRays = generateBounceRays(bvhScene, camera);
+	if (bounceRays.empty())
+		return;
+
+	std::vector<Ray> occlusionRays = bounceRays;
+	for (Ray& ray : occlusionRays)
+		ray.depth = 5.0f;
+
+	const F32 rayCount = static_cast<F32>(bounceRays.size() * BENCHMARK_REPEATS);
+	std::vector<Ray> rays;
+	Timer timer;
+
+	for (Scene* scene : { &bvhScene, &gridScene })
+	{
+		const char* name = scene == &bvhScene ? "BVH" : "Grid";
+		U32 hits = 0;
+
+		timer.tick();
+		for (U32 repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
+		{
+			rays = bounceRays;
+			for (Ray& ray : rays)
+				hits += scene->intersect(ray) ? 1 : 0;
+		}
+		timer.tick();
+		printf("%-5s closest %08.2fMrays/s - %u hits\n", name, rayCount / (timer.deltaTime() * 1'000'000.0f), hits / BENCHMARK_REPEATS);
+
+		hits = 0;
+		timer.tick();
+		for (U32 repeat = 0; repeat < BENCHMARK_REPEATS; repeat++)
+		{
+			rays = occlusionRays;
+			for (Ray& ray : rays)
+				hits += scene->intersectAny(ray) ? 1 : 0;
+		}
+		timer.tick();
+		printf("%-5s any     %08.2fMrays/s - %u hits\n", name, rayCount / (timer.deltaTime() * 1'000'000.0f), hits / BENCHMARK_REPEATS);
+	}
+}
+
 int main()
 {
 #ifdef _WIN32
@@ -164,11 +346,62 @@ int main()
 	Mesh cubeMesh("assets/cube.obj");
 	Mesh lensMesh("assets/lens.obj");
 	Mesh planeMesh("assets/plane.obj");
+#if ANALYTIC_LIGHTS == 1
+	Mesh sphereMesh(PrimitiveType::Sphere, { AnalyticPrimitive::sphere(Float3(0.0f), 1.0f) });
+#endif
+
+	// BLAS builds are deferred and run concurrently, large meshes are split into build tasks as well.
+	// Dense static meshes use spatial splits, trading build time for tighter nodes.
+	BvhBLAS susanneBVH(&susanneMesh, true, BvhBuildMode::SpatialSplits);
+	BvhBLAS cubeBVH(&cubeMesh, true);
+	BvhBLAS lensBVH(&lensMesh, true, BvhBuildMode::SpatialSplits);
+	BvhBLAS planeBVH(&planeMesh, true);
+#if ANALYTIC_LIGHTS == 1
+	BvhBLAS sphereBVH(&sphereMesh, true);
+	BvhBLAS* lightBVH = &sphereBVH;
+#else
+	BvhBLAS* lightBVH = &cubeBVH;
+#endif
+
+	const std::vector<BvhBLAS*> sceneBLASses = {
+		&susanneBVH, &cubeBVH, &lensBVH, &planeBVH,
+#if ANALYTIC_LIGHTS == 1
+		&sphereBVH,
+#endif
+	};
+
+	Timer bvhBuildTimer;
+#if BVH_FAST_FIRST_BUILD == 1
+	BvhRebuilder bvhRebuilder;
+	bvhRebuilder.buildFastFirst(sceneBLASses);
+
+#if TRAVERSAL_BENCHMARK == 1 || ACCEL_BENCHMARK == 1 || BVH_STATS_REPORT == 1
+	// Benchmarks & reports measure the configured builds
+	bvhRebuilder.finish();
+#endif
+#else
+	BvhBLAS::buildConcurrent(sceneBLASses);
+#endif
+	bvhBuildTimer.tick();
+	printf("Built scene BLASses in %.2fms\n", bvhBuildTimer.deltaTime() * 1'000.0f);
+
+	SizeType binaryNodeMemory = 0;
+	SizeType traversalNodeMemory = 0;
+	SizeType leafTriangleMemory = 0;
+	for (const BvhBLAS* blas : sceneBLASses)
+	{
+		binaryNodeMemory += blas->nodeMemoryUsage();
+		traversalNodeMemory += blas->wideBvh().memoryUsage();
+		leafTriangleMemory += blas->leafMemoryUsage();
+	}
+
+	printf("BLAS node memory: %.2fKiB binary, %.2fKiB traversal, %.2fKiB leaf triangles\n", binaryNodeMemory / 1024.0f, traversalNodeMemory / 1024.0f, leafTriangleMemory / 1024.0f);
 
-	BvhBLAS susanneBVH(&susanneMesh);
-	BvhBLAS cubeBVH(&cubeMesh);
-	BvhBLAS lensBVH(&lensMesh);
-	BvhBLAS planeBVH(&planeMesh);
+#if BVH_STATS_REPORT == 1
+	const char* sceneBLASNames[] = { "susanne", "cube", "lens", "plane", "sphere" };
+	for (SizeType i = 0; i < sceneBLASses.size(); i++)
+		printBvhStats(sceneBLASNames[i], sceneBLASses[i]->stats());
+#endif
 
 	Material floorMaterial = Material{};
 	floorMaterial.albedo = RgbColor(0.8f);
@@ -202,7 +435,7 @@ int main()
 	redLightMaterial.emissionStrength = 5.0f;
 
 	Instance cubeL(
-		&cubeBVH,
+		lightBVH,
 		&softLightMaterial,
 		glm::scale(
 			glm::translate(
@@ -214,7 +447,7 @@ int main()
 	);
 
 	Instance cubeR(
-		&cubeBVH,
+		lightBVH,
 		&redLightMaterial,
 		glm::scale(
 			glm::translate(
@@ -345,10 +578,61 @@ int main()
 	background.gradient.colorA = RgbColor(0.8f, 0.8f, 0.8f);
 	background.gradient.colorB = RgbColor(0.1f, 0.4f, 0.6f);
 
+	susanne0.animated = true;	// Spun around by the scene updates
+	std::vector<Instance> sceneInstances = { floor, cubeL, cubeR, susanne0, susanne1, lens0, wallL, wallR, wallTop, wallFront, wallBack };
+
+#if INSTANCE_ASSEMBLIES == 1
+	// The row is traced as one instance of the scene TLAS, however many cubes it holds
+	std::vector<Instance> rowCubes;
+	for (U32 i = 0; i < 16; i++)
+	{
+		rowCubes.push_back(Instance(
+			&cubeBVH,
+			i % 2 == 0 ? &specularMaterial : &floorMaterial,
+			glm::scale(
+				glm::translate(
+					Mat4(1.0f),
+					static_cast<glm::vec3>(Float3(static_cast<F32>(i) - 7.5f, 0.0f, 0.0f))
+				),
+				static_cast<glm::vec3>(Float3(0.25f, 0.25f, 0.25f))
+			)
+		));
+	}
+
+	BvhTLAS cubeRow(rowCubes);
+	for (U32 row = 0; row < 4; row++)
+	{
+		sceneInstances.push_back(Instance(
+			&cubeRow,
+			glm::translate(
+				Mat4(1.0f),
+				static_cast<glm::vec3>(Float3(0.0f, -0.75f, -9.0f + static_cast<F32>(row)))
+			)
+		));
+	}
+#endif
+
+#if FLATTEN_STATIC_INSTANCES == 1
+	InstanceFlattener flattener(sceneInstances);
+	printf("Flattened %zu instances into %zu, %u baked world space BLASses\n", sceneInstances.size(), flattener.instances().size(), flattener.bakedInstanceCount());
+	sceneInstances = flattener.instances();
+#endif
+
 	// -- END Scene setup
 
+#if TRAVERSAL_BENCHMARK == 1
+	{
+		Scene benchmarkScene(background, sceneInstances);
+		benchmarkTraversal(benchmarkScene, worldCam);
+	}
+#endif
+
+#if ACCEL_BENCHMARK == 1
+	benchmarkAccelerationStructures(background, sceneInstances, worldCam);
+#endif
+
 #if GPU_PATH_TRACING == 0
-	Scene scene(background, { floor, cubeL, cubeR, susanne0, susanne1, lens0, wallL, wallR, wallTop, wallFront, wallBack });
+	Scene scene(background, sceneInstances);
 
 	RendererConfig rendererConfig = RendererConfig{
 		7,	// Max bounces
@@ -357,7 +641,7 @@ int main()
 
 	Renderer renderer(&renderContext, &uiManager, rendererConfig, resultBuffer, worldCam, scene);
 #else
-	GPUScene scene(&renderContext, background, { floor, cubeL, cubeR, susanne0, susanne1, lens0, wallL, wallR, wallTop, wallFront, wallBack });
+	GPUScene scene(&renderContext, background, sceneInstances);
 
 	RendererConfig rendererConfig = RendererConfig{
 		7,	// Max bounces
@@ -372,6 +656,10 @@ int main()
 	WaveFrontRenderer renderer(&renderContext, &uiManager, rendererConfig, renderResolution, worldCam, scene);
 #endif
 
+#if BVH_STATS_REPORT == 1
+	printBvhStats("TLAS", scene.tlas().stats());
+#endif
+
 	// Create frame timer
 	Timer frameTimer;
 
@@ -397,6 +685,12 @@ int main()
 		if (uiState.animate)
 			scene.update(deltaTime);
 
+#if BVH_FAST_FIRST_BUILD == 1
+		// Between frames no traversal runs, so finished BLAS rebuilds are swapped in here
+		if (bvhRebuilder.busy() && bvhRebuilder.swapFinished())
+			scene.refreshBlasData();
+#endif
+
 		// Render frame
 		RendererConfig& config = renderer.config();	// Used only for debug info now -> can be updated using UI
 		uiManager.drawUI(AVERAGE_FRAMETIME, uiState);
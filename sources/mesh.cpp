@@ -4,6 +4,7 @@
 #include <iostream>
 #include <string>
 #include <tiny_obj_loader.h>
+#include <utility>
 #include <vector>
 
 #include "ray.h"
@@ -14,10 +15,9 @@ Triangle::Triangle(Float3 v1, Float3 v0, Float3 v2)
 	:
 	v0(v0),
 	v1(v1),
-	v2(v2),
-	centroid(0.0f)
+	v2(v2)
 {
-	centroid = (v0 + v1 + v2) * 0.333f;
+	//
 }
 
 bool Triangle::intersect(Ray& ray) const
@@ -66,10 +66,267 @@ Float3 Triangle::normal() const
 	return (v1 - v0).cross(v2 - v0).normalize();
 }
 
+AnalyticPrimitive AnalyticPrimitive::sphere(const Float3& center, F32 radius)
+{
+	assert(radius > 0.0f);
+	return AnalyticPrimitive{ center, Float3(radius, 0.0f, 0.0f), Float3(0.0f) };
+}
+
+AnalyticPrimitive AnalyticPrimitive::quad(const Float3& corner, const Float3& edgeU, const Float3& edgeV)
+{
+	return AnalyticPrimitive{ corner, edgeU, edgeV };
+}
+
+AnalyticPrimitive AnalyticPrimitive::disk(const Float3& center, const Float3& normal, F32 radius)
+{
+	assert(radius > 0.0f);
+
+	// Any orthonormal pair around the normal, the axis least aligned with it avoids a degenerate cross product
+	Float3 N = normal.normalize();
+	Float3 axis = fabsf(N.x) < 0.9f ? Float3(1.0f, 0.0f, 0.0f) : Float3(0.0f, 1.0f, 0.0f);
+	Float3 u = N.cross(axis).normalize();
+	Float3 v = N.cross(u);
+
+	return AnalyticPrimitive{ center, u * radius, v * radius };
+}
+
+bool AnalyticPrimitive::intersect(PrimitiveType type, Ray& ray) const
+{
+	if (type == PrimitiveType::Sphere)
+	{
+		// Instance space directions are not normalized, so the quadratic keeps its leading coefficient.
+		// The discriminant is taken from the closest approach to the center & the roots avoid cancellation, distant spheres stay precise
+		const F32 radius = u.x;
+		Float3 oc = ray.origin - origin;
+		F32 a = ray.direction.dot(ray.direction);
+		F32 b = oc.dot(ray.direction);
+		F32 c = oc.dot(oc) - radius * radius;
+
+		Float3 closest = oc - ray.direction * (b / a);
+		F32 discriminant = a * (radius * radius - closest.dot(closest));
+		if (discriminant < 0.0f)
+		{
+			return false;
+		}
+
+		F32 q = -b - copysignf(sqrtf(discriminant), b);
+		F32 nearDepth = c / q, farDepth = q / a;
+		if (nearDepth > farDepth)
+			swap(nearDepth, farDepth);
+
+		// Rays starting inside the sphere hit the far side
+		F32 depth = nearDepth;
+		if (!depthInBounds(depth, ray.depth))
+		{
+			depth = farDepth;
+			if (!depthInBounds(depth, ray.depth))
+			{
+				return false;
+			}
+		}
+
+		Float3 N = (oc + ray.direction * depth) / radius;
+		F32 azimuth = atan2f(N.y, N.x);
+		if (azimuth < 0.0f)
+			azimuth += F32_2PI;
+
+		ray.depth = depth;
+		ray.metadata.hitCoordinates = Float2(acosf(clamp(N.z, -1.0f, 1.0f)) * F32_INV_PI, azimuth * F32_INV_2PI);
+		return true;
+	}
+
+	// Quads & disks are intersected with their plane, the hit is expressed in the (u, v) basis of the plane
+	Float3 n = u.cross(v);
+	F32 denominator = n.dot(ray.direction);
+	if (fabsf(denominator) < F32_EPSILON)
+	{
+		return false;
+	}
+
+	F32 depth = n.dot(origin - ray.origin) / denominator;
+	if (!depthInBounds(depth, ray.depth))
+	{
+		return false;
+	}
+
+	Float3 q = ray.origin + ray.direction * depth - origin;
+	Float3 w = n / n.dot(n);
+	F32 s = w.dot(q.cross(v));
+	F32 t = w.dot(u.cross(q));
+
+	if (type == PrimitiveType::Quad)
+	{
+		if (0.0f > s || s > 1.0f || 0.0f > t || t > 1.0f)
+		{
+			return false;
+		}
+
+		ray.depth = depth;
+		ray.metadata.hitCoordinates = Float2(s, t);
+		return true;
+	}
+
+	F32 radius2 = s * s + t * t;
+	if (radius2 > 1.0f)
+	{
+		return false;
+	}
+
+	F32 angle = atan2f(t, s);
+	if (angle < 0.0f)
+		angle += F32_2PI;
+
+	ray.depth = depth;
+	ray.metadata.hitCoordinates = Float2(sqrtf(radius2), angle * F32_INV_2PI);
+	return true;
+}
+
+void AnalyticPrimitive::bounds(PrimitiveType type, Float3& bbMin, Float3& bbMax) const
+{
+	if (type == PrimitiveType::Sphere)
+	{
+		bbMin = origin - u.x;
+		bbMax = origin + u.x;
+	}
+	else if (type == PrimitiveType::Quad)
+	{
+		bbMin = min(min(origin, origin + u), min(origin + v, origin + u + v));
+		bbMax = max(max(origin, origin + u), max(origin + v, origin + u + v));
+	}
+	else
+	{
+		// The ellipse extent along an axis is the length of the radius vectors projected onto it
+		Float3 extent = Float3(
+			sqrtf(u.x * u.x + v.x * v.x),
+			sqrtf(u.y * u.y + v.y * v.y),
+			sqrtf(u.z * u.z + v.z * v.z)
+		);
+
+		bbMin = origin - extent;
+		bbMax = origin + extent;
+	}
+}
+
+F32 AnalyticPrimitive::area(PrimitiveType type) const
+{
+	if (type == PrimitiveType::Sphere)
+		return 4.0f * F32_PI * u.x * u.x;
+
+	F32 parallelogramArea = u.cross(v).magnitude();
+	return type == PrimitiveType::Quad ? parallelogramArea : F32_PI * parallelogramArea;
+}
+
+Float3 AnalyticPrimitive::position(PrimitiveType type, const Float2& coordinates) const
+{
+	if (type == PrimitiveType::Sphere)
+		return origin + normal(type, coordinates) * u.x;
+
+	if (type == PrimitiveType::Quad)
+		return origin + u * coordinates.u + v * coordinates.v;
+
+	F32 angle = coordinates.v * F32_2PI;
+	return origin + (u * cosf(angle) + v * sinf(angle)) * coordinates.u;
+}
+
+Float3 AnalyticPrimitive::normal(PrimitiveType type, const Float2& coordinates) const
+{
+	if (type == PrimitiveType::Sphere)
+	{
+		F32 polar = coordinates.u * F32_PI;
+		F32 azimuth = coordinates.v * F32_2PI;
+		return Float3(sinf(polar) * cosf(azimuth), sinf(polar) * sinf(azimuth), cosf(polar));
+	}
+
+	return u.cross(v).normalize();
+}
+
+AnalyticPrimitive AnalyticPrimitive::transformed(PrimitiveType type, const Mat3x4& transform) const
+{
+	if (type == PrimitiveType::Sphere)
+		return sphere(transform.transformPoint(origin), transform.transformVector(Float3(u.x, 0.0f, 0.0f)).magnitude());
+
+	return AnalyticPrimitive{ transform.transformPoint(origin), transform.transformVector(u), transform.transformVector(v) };
+}
+
+Float2 AnalyticPrimitive::sampleCoordinates(PrimitiveType type, F32 random0, F32 random1)
+{
+	assert(type != PrimitiveType::Triangle);
+
+	// Uniform over the sphere area by inverting the cosine of the polar angle, uniform over the disk area by the square root of the radius
+	if (type == PrimitiveType::Sphere)
+		return Float2(acosf(clamp(1.0f - 2.0f * random0, -1.0f, 1.0f)) * F32_INV_PI, random1);
+
+	if (type == PrimitiveType::Disk)
+		return Float2(sqrtf(random0), random1);
+
+	return Float2(random0, random1);
+}
+
+F32 AnalyticPrimitive::sampleSphereCap(const Float3& receiver, F32 random0, F32 random1, Float3& position, Float3& normal) const
+{
+	const F32 radius = u.x;
+	const Float3 toCenter = origin - receiver;
+	const F32 distanceSquared = toCenter.dot(toCenter);
+	const F32 sinMaxSquared = radius * radius / distanceSquared;
+	if (sinMaxSquared >= 1.0f)
+	{
+		const Float2 coordinates = sampleCoordinates(PrimitiveType::Sphere, random0, random1);
+		position = this->position(PrimitiveType::Sphere, coordinates);
+		normal = this->normal(PrimitiveType::Sphere, coordinates);
+		return 1.0f / area(PrimitiveType::Sphere);
+	}
+
+	// 1 - cos written through the sine, so the cap of a distant sphere keeps its precision
+	const F32 cosMax = sqrtf(1.0f - sinMaxSquared);
+	const F32 capHeight = sinMaxSquared / (1.0f + cosMax);
+	const F32 oneMinusCos = random0 * capHeight;
+	const F32 cosTheta = 1.0f - oneMinusCos;
+	const F32 sinThetaSquared = oneMinusCos * (2.0f - oneMinusCos);
+	const F32 sinTheta = sqrtf(sinThetaSquared);
+	const F32 phi = F32_2PI * random1;
+
+	const F32 distance = sqrtf(distanceSquared);
+	const Float3 axis = toCenter * (1.0f / distance);
+	const Float3 tangent = axis.cross(fabsf(axis.x) < 0.9f ? Float3(1.0f, 0.0f, 0.0f) : Float3(0.0f, 1.0f, 0.0f)).normalize();
+	const Float3 bitangent = axis.cross(tangent);
+	const Float3 direction = tangent * (sinTheta * cosf(phi)) + bitangent * (sinTheta * sinf(phi)) + axis * cosTheta;
+
+	// Nearest intersection along the sampled direction, which lies inside the cap by construction
+	const F32 t = distance * cosTheta - sqrtf(max(radius * radius - distanceSquared * sinThetaSquared, 0.0f));
+	position = receiver + direction * t;
+	normal = (position - origin).normalize();
+
+	// Solid angle density of the cap to area measure, the light sample turns it back with the same distance & cosine
+	const F32 cosLight = max(-normal.dot(direction), 0.0f);
+	return cosLight / (t * t * F32_2PI * capHeight);
+}
+
+Mesh::Mesh(std::vector<Triangle> triangles, std::vector<TriExtension> triExtensions)
+	:
+	primitiveType(PrimitiveType::Triangle),
+	triangles(std::move(triangles)),
+	triExtensions(std::move(triExtensions)),
+	analyticPrimitives()
+{
+	assert(this->triangles.size() == this->triExtensions.size());
+}
+
+Mesh::Mesh(PrimitiveType primitiveType, std::vector<AnalyticPrimitive> analyticPrimitives)
+	:
+	primitiveType(primitiveType),
+	triangles(),
+	triExtensions(),
+	analyticPrimitives(std::move(analyticPrimitives))
+{
+	assert(primitiveType != PrimitiveType::Triangle);
+}
+
 Mesh::Mesh(const std::string& path)
 	:
+	primitiveType(PrimitiveType::Triangle),
 	triangles(),
-	triExtensions()
+	triExtensions(),
+	analyticPrimitives()
 {
 	tinyobj::ObjReaderConfig config;
 	config.triangulate = true;
@@ -0,0 +1,174 @@
+#include "quantized_bvh.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include "bvh.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+template <typename QuantType>
+QuantizedWideBvh<QuantType>::QuantizedWideBvh()
+	:
+	m_nodeCapacity(0),
+	m_nodesUsed(0),
+	m_nodePool(nullptr)
+{
+	//
+}
+
+template <typename QuantType>
+QuantizedWideBvh<QuantType>::~QuantizedWideBvh()
+{
+	release();
+}
+
+template <typename QuantType>
+QuantizedWideBvh<QuantType>::QuantizedWideBvh(const QuantizedWideBvh& other) noexcept
+	:
+	m_nodeCapacity(other.m_nodeCapacity),
+	m_nodesUsed(other.m_nodesUsed),
+	m_nodePool(nullptr)
+{
+	if (m_nodeCapacity == 0)
+		return;
+
+	m_nodePool = static_cast<NodeType*>(MALLOC64(m_nodeCapacity * sizeof(NodeType)));
+	assert(m_nodePool != nullptr);
+	memcpy(m_nodePool, other.m_nodePool, m_nodeCapacity * sizeof(NodeType));
+}
+
+template <typename QuantType>
+QuantizedWideBvh<QuantType>& QuantizedWideBvh<QuantType>::operator=(const QuantizedWideBvh& other) noexcept
+{
+	if (this == &other)
+	{
+		return *this;
+	}
+
+	release();
+	this->m_nodeCapacity = other.m_nodeCapacity;
+	this->m_nodesUsed = other.m_nodesUsed;
+
+	if (m_nodeCapacity != 0)
+	{
+		this->m_nodePool = static_cast<NodeType*>(MALLOC64(m_nodeCapacity * sizeof(NodeType)));
+		assert(m_nodePool != nullptr);
+		memcpy(m_nodePool, other.m_nodePool, m_nodeCapacity * sizeof(NodeType));
+	}
+
+	return *this;
+}
+
+template <typename QuantType>
+void QuantizedWideBvh<QuantType>::swap(QuantizedWideBvh& other) noexcept
+{
+	std::swap(m_nodeCapacity, other.m_nodeCapacity);
+	std::swap(m_nodesUsed, other.m_nodesUsed);
+	std::swap(m_nodePool, other.m_nodePool);
+}
+
+template <typename QuantType>
+void QuantizedWideBvh<QuantType>::collapse(const BvhNode* nodePool, U32 nodesUsed)
+{
+	assert(nodePool != nullptr);
+
+	U32 requiredCapacity = nodesUsed / 2 + 1;
+	if (requiredCapacity > m_nodeCapacity)
+	{
+		release();
+		m_nodeCapacity = requiredCapacity;
+		m_nodePool = static_cast<NodeType*>(MALLOC64(m_nodeCapacity * sizeof(NodeType)));
+		assert(m_nodePool != nullptr);
+	}
+
+	m_nodesUsed = 0;
+	collapseNode(nodePool, BVH_ROOT_INDEX);
+}
+
+template <typename QuantType>
+U32 QuantizedWideBvh<QuantType>::collapseNode(const BvhNode* nodePool, U32 nodeIndex)
+{
+	const F32 quantMax = static_cast<F32>(std::numeric_limits<QuantType>::max());
+	const AABB parentBounds = nodePool[nodeIndex].bounds();
+
+	U32 children[WIDE_BVH_WIDTH] = {};
+	U32 childCount = gatherWideChildren(nodePool, nodeIndex, children);
+
+	U32 quantizedIndex = m_nodesUsed++;
+	assert(quantizedIndex < m_nodeCapacity);
+
+	NodeType& quantizedNode = m_nodePool[quantizedIndex];
+	memset(&quantizedNode, 0, sizeof(NodeType));
+
+	QuantType* qMin[3] = { quantizedNode.qMinX, quantizedNode.qMinY, quantizedNode.qMinZ };
+	QuantType* qMax[3] = { quantizedNode.qMaxX, quantizedNode.qMaxY, quantizedNode.qMaxZ };
+
+	for (U32 axis = 0; axis < 3; axis++)
+	{
+		const F32 origin = parentBounds.bbMin[axis];
+		F32 scale = (parentBounds.bbMax[axis] - origin) / quantMax;
+
+		// Grow the scale until the largest quantized value covers the parent bounds, compensating for rounding
+		while (origin + quantMax * scale < parentBounds.bbMax[axis])
+			scale = nextafterf(scale, F32_INF);
+
+		quantizedNode.origin[axis] = origin;
+		quantizedNode.scale[axis] = scale;
+
+		for (U32 i = 0; i < childCount; i++)
+		{
+			const AABB childBounds = nodePool[children[i]].bounds();
+			if (scale == 0.0f)
+				continue;
+
+			F32 lower = clamp(floorf((childBounds.bbMin[axis] - origin) / scale), 0.0f, quantMax);
+			F32 upper = clamp(ceilf((childBounds.bbMax[axis] - origin) / scale), 0.0f, quantMax);
+
+			// Decoding must be conservative, correct for the division rounding towards the child bounds
+			while (lower > 0.0f && origin + lower * scale > childBounds.bbMin[axis])
+				lower -= 1.0f;
+
+			while (upper < quantMax && origin + upper * scale < childBounds.bbMax[axis])
+				upper += 1.0f;
+
+			qMin[axis][i] = static_cast<QuantType>(lower);
+			qMax[axis][i] = static_cast<QuantType>(upper);
+		}
+	}
+
+	for (U32 i = 0; i < childCount; i++)
+	{
+		const BvhNode& child = nodePool[children[i]];
+		if (child.isLeaf())
+		{
+			quantizedNode.leftFirst[i] = child.first();
+			quantizedNode.count[i] = child.count;
+		}
+		else
+		{
+			quantizedNode.leftFirst[i] = collapseNode(nodePool, children[i]);
+			quantizedNode.count[i] = 0;
+		}
+	}
+
+	return quantizedIndex;
+}
+
+template <typename QuantType>
+void QuantizedWideBvh<QuantType>::release()
+{
+	if (m_nodePool != nullptr)
+		FREE64(m_nodePool);
+
+	m_nodePool = nullptr;
+	m_nodeCapacity = 0;
+	m_nodesUsed = 0;
+}
+
+template class QuantizedWideBvh<U8>;
+template class QuantizedWideBvh<U16>;
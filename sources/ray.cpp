@@ -1,11 +1,12 @@
 #include "ray.h"
 
-Ray::Ray(Float3 origin, Float3 direction)
+Ray::Ray(Float3 origin, Float3 direction, U8 visibilityMask)
 	:
 	origin(origin),
 	depth(F32_FAR_AWAY),
 	direction(direction),
 	inMedium(false),
+	visibilityMask(visibilityMask),
 	metadata{}
 {
 	//
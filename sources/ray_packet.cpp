@@ -0,0 +1,188 @@
+#include "ray_packet.h"
+
+#include <cassert>
+
+#include "ray.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+RayPacket::RayPacket(const Ray* rays, U32 count)
+	:
+	rayCount(count),
+	laneCount((count + 3) / 4)
+{
+	assert(rays != nullptr);
+	assert(count > 0 && count <= RAY_PACKET_SIZE);
+
+	visibilityMask = rays[0].visibilityMask;
+
+	for (U32 lane = 0; lane < laneCount; lane++)
+	{
+		ALIGN(16) F32 values[7][4];
+		for (U32 i = 0; i < 4; i++)
+		{
+			// Padding rays duplicate the first ray with a depth of 0, which no triangle test accepts
+			U32 rayIndex = lane * 4 + i;
+			const Ray& ray = rays[rayIndex < count ? rayIndex : 0];
+			assert(ray.visibilityMask == visibilityMask);
+
+			values[0][i] = ray.origin.x;
+			values[1][i] = ray.origin.y;
+			values[2][i] = ray.origin.z;
+			values[3][i] = ray.direction.x;
+			values[4][i] = ray.direction.y;
+			values[5][i] = ray.direction.z;
+			values[6][i] = rayIndex < count ? ray.depth : 0.0f;
+		}
+
+		originX[lane] = _mm_load_ps(values[0]);
+		originY[lane] = _mm_load_ps(values[1]);
+		originZ[lane] = _mm_load_ps(values[2]);
+		directionX[lane] = _mm_load_ps(values[3]);
+		directionY[lane] = _mm_load_ps(values[4]);
+		directionZ[lane] = _mm_load_ps(values[5]);
+		depth[lane] = _mm_load_ps(values[6]);
+		hitU[lane] = _mm_setzero_ps();
+		hitV[lane] = _mm_setzero_ps();
+		primitiveIndex[lane] = _mm_set1_epi32(static_cast<I32>(UNSET_INDEX));
+		instanceIndex[lane] = _mm_set1_epi32(static_cast<I32>(UNSET_INDEX));
+		nestedInstanceIndex[lane] = _mm_set1_epi32(static_cast<I32>(UNSET_INDEX));
+	}
+
+	updateTraversalData();
+}
+
+RayPacket::RayPacket(const RayPacket& packet, const Mat3x4& transform)
+	:
+	rayCount(packet.rayCount),
+	laneCount(packet.laneCount),
+	visibilityMask(packet.visibilityMask)
+{
+	// Matrix elements broadcast once for all lanes, indexed by column first
+	__m128 m[4][3];
+	for (U32 column = 0; column < 4; column++)
+	{
+		for (U32 row = 0; row < 3; row++)
+			m[column][row] = _mm_set1_ps(transform.rows[row].xyzw[column]);
+	}
+
+	for (U32 lane = 0; lane < laneCount; lane++)
+	{
+		const __m128 oX = packet.originX[lane], oY = packet.originY[lane], oZ = packet.originZ[lane];
+		const __m128 dX = packet.directionX[lane], dY = packet.directionY[lane], dZ = packet.directionZ[lane];
+
+		originX[lane] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], oX), _mm_mul_ps(m[1][0], oY)), _mm_add_ps(_mm_mul_ps(m[2][0], oZ), m[3][0]));
+		originY[lane] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][1], oX), _mm_mul_ps(m[1][1], oY)), _mm_add_ps(_mm_mul_ps(m[2][1], oZ), m[3][1]));
+		originZ[lane] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][2], oX), _mm_mul_ps(m[1][2], oY)), _mm_add_ps(_mm_mul_ps(m[2][2], oZ), m[3][2]));
+
+		// Directions are not renormalized, so hit depths in both spaces are equal
+		directionX[lane] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], dX), _mm_mul_ps(m[1][0], dY)), _mm_mul_ps(m[2][0], dZ));
+		directionY[lane] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][1], dX), _mm_mul_ps(m[1][1], dY)), _mm_mul_ps(m[2][1], dZ));
+		directionZ[lane] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][2], dX), _mm_mul_ps(m[1][2], dY)), _mm_mul_ps(m[2][2], dZ));
+
+		depth[lane] = packet.depth[lane];
+		hitU[lane] = packet.hitU[lane];
+		hitV[lane] = packet.hitV[lane];
+		primitiveIndex[lane] = packet.primitiveIndex[lane];
+		instanceIndex[lane] = packet.instanceIndex[lane];
+		nestedInstanceIndex[lane] = packet.nestedInstanceIndex[lane];
+	}
+
+	updateTraversalData();
+}
+
+void RayPacket::store(Ray* rays) const
+{
+	assert(rays != nullptr);
+
+	for (U32 lane = 0; lane < laneCount; lane++)
+	{
+		ALIGN(16) F32 depths[4], u[4], v[4];
+		ALIGN(16) U32 primitives[4], instances[4], nestedInstances[4];
+		_mm_store_ps(depths, depth[lane]);
+		_mm_store_ps(u, hitU[lane]);
+		_mm_store_ps(v, hitV[lane]);
+		_mm_store_si128(reinterpret_cast<__m128i*>(primitives), primitiveIndex[lane]);
+		_mm_store_si128(reinterpret_cast<__m128i*>(instances), instanceIndex[lane]);
+		_mm_store_si128(reinterpret_cast<__m128i*>(nestedInstances), nestedInstanceIndex[lane]);
+
+		for (U32 i = 0; i < 4 && lane * 4 + i < rayCount; i++)
+		{
+			Ray& ray = rays[lane * 4 + i];
+			if (instances[i] == UNSET_INDEX)
+				continue;
+
+			ray.depth = depths[i];
+			ray.metadata.primitiveIndex = primitives[i];
+			ray.metadata.instanceIndex = instances[i];
+			ray.metadata.hitCoordinates = Float2(u[i], v[i]);
+			ray.metadata.nestedInstanceIndex = nestedInstances[i];
+		}
+	}
+}
+
+void RayPacket::copyHits(const RayPacket& other)
+{
+	assert(laneCount == other.laneCount);
+
+	for (U32 lane = 0; lane < laneCount; lane++)
+	{
+		depth[lane] = other.depth[lane];
+		hitU[lane] = other.hitU[lane];
+		hitV[lane] = other.hitV[lane];
+		primitiveIndex[lane] = other.primitiveIndex[lane];
+	}
+}
+
+void RayPacket::updateTraversalData()
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 dirSumX = zero, dirSumY = zero, dirSumZ = zero;
+	__m128 oMinX = originX[0], oMinY = originY[0], oMinZ = originZ[0];
+	__m128 oMaxX = originX[0], oMaxY = originY[0], oMaxZ = originZ[0];
+	__m128 rMinX = _mm_set1_ps(F32_INF), rMinY = _mm_set1_ps(F32_INF), rMinZ = _mm_set1_ps(F32_INF);
+	__m128 rMaxX = _mm_set1_ps(F32_NEG_INF), rMaxY = _mm_set1_ps(F32_NEG_INF), rMaxZ = _mm_set1_ps(F32_NEG_INF);
+
+	for (U32 lane = 0; lane < laneCount; lane++)
+	{
+		rDirX[lane] = _mm_div_ps(one, directionX[lane]);
+		rDirY[lane] = _mm_div_ps(one, directionY[lane]);
+		rDirZ[lane] = _mm_div_ps(one, directionZ[lane]);
+
+		dirSumX = _mm_add_ps(dirSumX, directionX[lane]);
+		dirSumY = _mm_add_ps(dirSumY, directionY[lane]);
+		dirSumZ = _mm_add_ps(dirSumZ, directionZ[lane]);
+
+		oMinX = _mm_min_ps(oMinX, originX[lane]); oMaxX = _mm_max_ps(oMaxX, originX[lane]);
+		oMinY = _mm_min_ps(oMinY, originY[lane]); oMaxY = _mm_max_ps(oMaxY, originY[lane]);
+		oMinZ = _mm_min_ps(oMinZ, originZ[lane]); oMaxZ = _mm_max_ps(oMaxZ, originZ[lane]);
+		rMinX = _mm_min_ps(rMinX, rDirX[lane]); rMaxX = _mm_max_ps(rMaxX, rDirX[lane]);
+		rMinY = _mm_min_ps(rMinY, rDirY[lane]); rMaxY = _mm_max_ps(rMaxY, rDirY[lane]);
+		rMinZ = _mm_min_ps(rMinZ, rDirZ[lane]); rMaxZ = _mm_max_ps(rMaxZ, rDirZ[lane]);
+	}
+
+	// Reduce the per ray lanes into xyz vectors
+	auto horizontalMin = [](__m128 v) { v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1))); return _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2))); };
+	auto horizontalMax = [](__m128 v) { v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1))); return _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2))); };
+	auto horizontalSum = [](__m128 v) { v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1))); return _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2))); };
+	auto combine = [](__m128 x, __m128 y, __m128 z) { return _mm_setr_ps(_mm_cvtss_f32(x), _mm_cvtss_f32(y), _mm_cvtss_f32(z), 0.0f); };
+
+	originMin = combine(horizontalMin(oMinX), horizontalMin(oMinY), horizontalMin(oMinZ));
+	originMax = combine(horizontalMax(oMaxX), horizontalMax(oMaxY), horizontalMax(oMaxZ));
+	rDirMin = combine(horizontalMin(rMinX), horizontalMin(rMinY), horizontalMin(rMinZ));
+	rDirMax = combine(horizontalMax(rMaxX), horizontalMax(rMaxY), horizontalMax(rMaxZ));
+
+	const __m128 dirSum = combine(horizontalSum(dirSumX), horizontalSum(dirSumY), horizontalSum(dirSumZ));
+	octantMask = _mm_cmplt_ps(dirSum, zero);
+	octant = static_cast<U32>(_mm_movemask_ps(octantMask)) & 7;
+
+	// Interval culling requires every reciprocal direction to be finite & share the sign of the average direction
+	const __m128 finiteBound = _mm_set1_ps(F32_FAR_AWAY);
+	const __m128 negative = _mm_and_ps(_mm_cmplt_ps(rDirMax, zero), _mm_cmpgt_ps(rDirMin, _mm_sub_ps(zero, finiteBound)));
+	const __m128 positive = _mm_and_ps(_mm_cmpgt_ps(rDirMin, zero), _mm_cmplt_ps(rDirMax, finiteBound));
+	const __m128 sameSign = _mm_blendv_ps(positive, negative, octantMask);
+	coherent = (_mm_movemask_ps(sameSign) & 7) == 7;
+}
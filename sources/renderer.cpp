@@ -6,6 +6,8 @@
 
 #include "camera.h"
 #include "ray.h"
+#include "ray_packet.h"
+#include "ray_stream.h"
 #include "render_context.h"
 #include "scene.h"
 #include "surf_math.h"
@@ -21,6 +23,14 @@
 #include "vk_layer/vk_check.h"
 
 #define RECURSIVE_IMPLEMENTATION    0   // Use a simple recursive path tracing implementation with no variance reduction & clamped depth
+#define PACKET_TRACING              1   // Trace primary rays as packets over RAY_PACKET_WIDTH sized pixel tiles
+#define STREAM_TRACING              0   // Trace the paths of multiple tiles bounce by bounce as ray streams, non recursive implementation only
+
+#if STREAM_TRACING == 1
+#define STREAM_TILE_COUNT           (RAY_STREAM_SIZE / RAY_PACKET_SIZE)    // Tiles gathered into a single ray stream
+#else
+#define STREAM_TILE_COUNT           1
+#endif
 #define COLOR_BLACK                 RgbColor(0.0f, 0.0f, 0.0f)
 
 // Threshold for difference in ray counts between waves in wavefront path tracing
@@ -160,6 +170,103 @@ void Renderer::render(F32 deltaTime)
     // Start CPU ray tracing loop
     const F32 invSamples = 1.0f / static_cast<F32>(m_accumulator.totalSamples + m_config.samplesPerFrame);
 
+#if PACKET_TRACING == 1 || STREAM_TRACING == 1
+    const U32 tilesX = (m_resultBuffer.width + RAY_PACKET_WIDTH - 1) / RAY_PACKET_WIDTH;
+    const U32 tilesY = (m_resultBuffer.height + RAY_PACKET_WIDTH - 1) / RAY_PACKET_WIDTH;
+    const I32 taskCount = static_cast<I32>((tilesX * tilesY + STREAM_TILE_COUNT - 1) / STREAM_TILE_COUNT);
+
+#pragma omp parallel
+    {
+        std::vector<Ray> primaryRays;
+        std::vector<SizeType> pixelIndices;
+        std::vector<U32> pixelSeeds;
+        std::vector<U32> tileOffsets;
+#if STREAM_TRACING == 1
+        RayStream stream;
+        std::vector<RgbColor> energies;
+#endif
+
+#pragma omp for schedule(dynamic)
+        for (I32 task = 0; task < taskCount; task++)
+        {
+            // Gather the pixels of all tiles in the task, pixels of a tile are stored contiguously
+            pixelIndices.clear();
+            pixelSeeds.clear();
+            tileOffsets.clear();
+
+            const U32 firstTile = static_cast<U32>(task) * STREAM_TILE_COUNT;
+            const U32 lastTile = min(firstTile + STREAM_TILE_COUNT, tilesX * tilesY);
+            for (U32 tile = firstTile; tile < lastTile; tile++)
+            {
+                const U32 tileX = (tile % tilesX) * RAY_PACKET_WIDTH;
+                const U32 tileY = (tile / tilesX) * RAY_PACKET_WIDTH;
+                const U32 tileWidth = min(static_cast<U32>(RAY_PACKET_WIDTH), m_resultBuffer.width - tileX);
+                const U32 tileHeight = min(static_cast<U32>(RAY_PACKET_WIDTH), m_resultBuffer.height - tileY);
+
+                tileOffsets.push_back(static_cast<U32>(pixelIndices.size()));
+                for (U32 y = tileY; y < tileY + tileHeight; y++)
+                {
+                    for (U32 x = tileX; x < tileX + tileWidth; x++)
+                    {
+                        SizeType pixelIndex = x + y * m_resultBuffer.width;
+                        pixelIndices.push_back(pixelIndex);
+                        pixelSeeds.push_back(initSeed(static_cast<U32>(pixelIndex + m_accumulator.totalSamples * 1799))); // Init with random very large value -> too small and randomization 'smears' screen
+                    }
+                }
+            }
+
+            tileOffsets.push_back(static_cast<U32>(pixelIndices.size()));
+            const U32 pixelCount = static_cast<U32>(pixelIndices.size());
+
+            for (SizeType sample = 0; sample < m_config.samplesPerFrame; sample++)
+            {
+                primaryRays.clear();
+                for (U32 i = 0; i < pixelCount; i++)
+                {
+                    const SizeType x = pixelIndices[i] % m_resultBuffer.width;
+                    const SizeType y = pixelIndices[i] / m_resultBuffer.width;
+
+                    primaryRays.push_back(m_camera.getPrimaryRay(
+                        pixelSeeds[i],
+                        static_cast<F32>(x) + randomRange(pixelSeeds[i], -0.5f, 0.5f),
+                        static_cast<F32>(y) + randomRange(pixelSeeds[i], -0.5f, 0.5f)
+                    ));
+                }
+
+#if PACKET_TRACING == 1
+                // Primary visibility is resolved per tile, shading continues per ray from the packet hits
+                for (SizeType tile = 0; tile + 1 < tileOffsets.size(); tile++)
+                {
+                    RayPacket packet(&primaryRays[tileOffsets[tile]], tileOffsets[tile + 1] - tileOffsets[tile]);
+                    m_scene.intersect(packet);
+                    packet.store(&primaryRays[tileOffsets[tile]]);
+                }
+#endif
+
+#if STREAM_TRACING == 1
+                stream.rays = primaryRays;
+                energies.resize(pixelCount);
+                traceStream(stream, pixelSeeds.data(), energies.data(), PACKET_TRACING == 1);
+
+                for (U32 i = 0; i < pixelCount; i++)
+                    m_accumulator.buffer[pixelIndices[i]] += RgbaColor(energies[i], 1.0f);
+#else
+                for (U32 i = 0; i < pixelCount; i++)
+                {
+                    RgbaColor color = RgbaColor(trace(pixelSeeds[i], primaryRays[i], 0, PACKET_TRACING == 1), 1.0f);
+                    m_accumulator.buffer[pixelIndices[i]] += color;
+                }
+#endif
+            }
+
+            for (U32 i = 0; i < pixelCount; i++)
+            {
+                RgbaColor outColor = m_accumulator.buffer[pixelIndices[i]] * invSamples;
+                m_resultBuffer.pixels[pixelIndices[i]] = RgbaToU32(outColor);
+            }
+        }
+    }
+#else
 #pragma omp parallel for schedule(dynamic)
     for (I32 y = 0; y < static_cast<I32>(m_resultBuffer.height); y++)
     {
@@ -184,6 +291,7 @@ void Renderer::render(F32 deltaTime)
             m_resultBuffer.pixels[pixelIndex] = RgbaToU32(outColor);
         }
     }
+#endif
 
     m_accumulator.totalSamples += m_config.samplesPerFrame;
 
@@ -247,17 +355,18 @@ void Renderer::render(F32 deltaTime)
     m_currentFrame = (m_currentFrame + 1) % FRAMES_IN_FLIGHT;
 }
 
-RgbColor Renderer::trace(U32& seed, Ray& ray, U32 depth)
+RgbColor Renderer::trace(U32& seed, Ray& ray, U32 depth, bool primaryIntersected)
 {
 #if RECURSIVE_IMPLEMENTATION == 1
     if (depth > m_config.maxBounces)
         return COLOR_BLACK;
 
-    if (!m_scene.intersect(ray))
+    bool intersected = primaryIntersected ? ray.metadata.instanceIndex != UNSET_INDEX : m_scene.intersect(ray);
+    if (!intersected)
         return m_scene.sampleBackground(ray);
 
-    const Instance& instance = m_scene.hitInstance(ray.metadata.instanceIndex);
-    const Mesh* mesh = instance.bvh->mesh();
+    const Instance& instance = m_scene.hitInstance(ray.metadata);
+    const Mesh* mesh = instance.mesh();
     const Material* material = instance.material;
 
     if (material->isLight())
@@ -265,7 +374,7 @@ RgbColor Renderer::trace(U32& seed, Ray& ray, U32 depth)
         return material->emittance();
     }
 
-    Float3 normal = instance.normal(ray.metadata.primitiveIndex, ray.metadata.hitCoordinates);
+    Float3 normal = m_scene.hitNormal(ray.metadata);
     Float2 textureCoordinate = mesh->textureCoordinate(ray.metadata.primitiveIndex, ray.metadata.hitCoordinates);
 
     // Handle backface hits -> normal needs to be flipped if colinear with hit direction
@@ -281,7 +390,7 @@ RgbColor Renderer::trace(U32& seed, Ray& ray, U32 depth)
     {
         Float3 newDirection = reflect(ray.direction, normal);
         Float3 newOrigin = ray.hitPosition() + F32_EPSILON * newDirection;
-        Ray newRay(newOrigin, newDirection);
+        Ray newRay(newOrigin, newDirection, VISIBILITY_INDIRECT);
         newRay.inMedium = ray.inMedium;
         return material->albedo * mediumScale * trace(seed, newRay, depth + 1);
     }
@@ -304,7 +413,7 @@ RgbColor Renderer::trace(U32& seed, Ray& ray, U32 depth)
 
             Float3 newDirection = iorRatio * ray.direction + ((iorRatio * cosI - sqrtf(fabsf(cosTheta2))) * normal);
             Float3 newOrigin = ray.hitPosition() + F32_EPSILON * newDirection;
-            Ray newTransmit(newOrigin, newDirection);
+            Ray newTransmit(newOrigin, newDirection, VISIBILITY_INDIRECT);
             newTransmit.inMedium = !ray.inMedium;
 
             if (randomF32(seed) > Fresnel)
@@ -313,7 +422,7 @@ RgbColor Renderer::trace(U32& seed, Ray& ray, U32 depth)
 
         Float3 newDirection = reflect(ray.direction, normal);
         Float3 newOrigin = ray.hitPosition() + F32_EPSILON * newDirection;
-        Ray newReflect(newOrigin, newDirection);
+        Ray newReflect(newOrigin, newDirection, VISIBILITY_INDIRECT);
         newReflect.inMedium = ray.inMedium;
         return material->albedo * mediumScale * trace(seed, newReflect, depth + 1);
     }
@@ -323,144 +432,226 @@ RgbColor Renderer::trace(U32& seed, Ray& ray, U32 depth)
 
         Float3 newDirection = randomOnHemisphere(seed, normal);
         Float3 newOrigin = ray.hitPosition() + F32_EPSILON * newDirection;
-        Ray newRay(newOrigin, newDirection);
+        Ray newRay(newOrigin, newDirection, VISIBILITY_INDIRECT);
 
         F32 cosTheta = newDirection.dot(normal);
         return material->emittance() + F32_2PI * cosTheta * brdf * mediumScale * trace(seed, newRay, depth + 1);
     }
 #else
     // Non recursive path tracing implementation
-    RgbColor energy(0.0f);
-    RgbColor transmission(1.0f);
-    bool lastSpecular = true;
+    PathState path;
+    bool intersected = primaryIntersected ? ray.metadata.instanceIndex != UNSET_INDEX : m_scene.intersect(ray);
+
     for (;;)
     {
-        if (!m_scene.intersect(ray))
-        {
-            energy += transmission * m_scene.sampleBackground(ray);
-            break;
-        }
+        LightSample lightSample;
+        bool extended = shade(seed, ray, intersected, path, lightSample);
 
-        const Instance& instance = m_scene.hitInstance(ray.metadata.instanceIndex);
-        const Mesh* mesh = instance.bvh->mesh();
-        const Material* material = instance.material;
+        if (lightSample.valid && !m_scene.intersectAny(lightSample.shadowRay))
+            path.energy += lightSample.contribution;
 
-        if (material->isLight())
-        {
-            energy += lastSpecular ? transmission * material->emittance() : COLOR_BLACK;
+        if (!extended)
             break;
-        }
 
-        Float3 mediumScale(1.0f);
-        if (ray.inMedium)
-            mediumScale = expf(material->absorption * -ray.depth);
+        intersected = m_scene.intersect(ray);
+    }
 
-        Float3 I = ray.hitPosition();
-        Float3 N = instance.normal(ray.metadata.primitiveIndex, ray.metadata.hitCoordinates);
-        Float2 UV = mesh->textureCoordinate(ray.metadata.primitiveIndex, ray.metadata.hitCoordinates);
-        F32 rng = randomF32(seed);
+    return path.energy;
+#endif
+}
 
-        Float3 R = Float3(0);
-        bool inMedium = ray.inMedium;
+void Renderer::traceStream(RayStream& stream, U32* seeds, RgbColor* energies, bool primaryIntersected)
+{
+    assert(seeds != nullptr && energies != nullptr);
 
-        // Flip normal on backface hits
-        if (ray.direction.dot(N) > 0.0f)
-            N *= -1.0f;
+    const U32 pathCount = static_cast<U32>(stream.rays.size());
+    std::vector<PathState> paths(pathCount);
+    std::vector<U32> activePaths(pathCount);
+    for (U32 i = 0; i < pathCount; i++)
+        activePaths[i] = i;
 
-        if (rng < material->reflectivity)
-        {
-            R = reflect(ray.direction, N);
-            lastSpecular = true;
-            transmission *= material->albedo * mediumScale;
-        }
-        else if (rng < (material->reflectivity + material->refractivity))
+    RayStream shadowStream;
+    std::vector<U32> shadowPaths;
+    std::vector<RgbColor> contributions;
+    std::vector<Ray> extendedRays;
+    std::vector<U32> extendedPaths;
+
+    if (!primaryIntersected)
+        m_scene.intersect(stream);
+
+    // Every iteration shades one bounce of all active paths, then traces their shadow & extension rays as streams
+    while (!activePaths.empty())
+    {
+        shadowStream.rays.clear();
+        shadowPaths.clear();
+        contributions.clear();
+        extendedRays.clear();
+        extendedPaths.clear();
+
+        for (SizeType i = 0; i < activePaths.size(); i++)
         {
-            // Assume reflect & precalculate ray
-            bool mustRefract = false;
-            R = reflect(ray.direction, N);
+            const U32 pathIndex = activePaths[i];
+            Ray& ray = stream.rays[i];
 
-            // Check for refraction
-            F32 n1 = ray.inMedium ? material->indexOfRefraction : 1.0f;
-            F32 n2 = ray.inMedium ? 1.0f : material->indexOfRefraction;
-            F32 iorRatio = n1 / n2;
+            LightSample lightSample;
+            bool extended = shade(seeds[pathIndex], ray, ray.metadata.instanceIndex != UNSET_INDEX, paths[pathIndex], lightSample);
 
-            F32 cosI = -ray.direction.dot(N);
-            F32 cosTheta2 = 1.0f - (iorRatio * iorRatio) * (1.0f - cosI * cosI);
-            F32 Fresnel = 1.0f;
+            if (lightSample.valid)
+            {
+                shadowStream.rays.push_back(lightSample.shadowRay);
+                shadowPaths.push_back(pathIndex);
+                contributions.push_back(lightSample.contribution);
+            }
 
-            if (cosTheta2 > 0.0f)
+            if (extended)
             {
-                F32 a = n1 - n2, b = n1 + n2;
-                F32 r0 = (a * a) / (b * b);
-                F32 c = 1.0f - cosI;
-                F32 Fresnel = r0 + (1.0f - r0) * (c * c * c * c * c);
-
-                mustRefract = randomF32(seed) > Fresnel;
-                if (mustRefract)
-                    R = iorRatio * ray.direction + ((iorRatio * cosI - sqrtf(fabsf(cosTheta2))) * N);
+                extendedRays.push_back(ray);
+                extendedPaths.push_back(pathIndex);
             }
+        }
 
-            lastSpecular = true;
-            transmission *= material->albedo * mediumScale;
-            inMedium = mustRefract ? !inMedium : inMedium;
+        if (!shadowStream.rays.empty())
+        {
+            m_scene.intersectAny(shadowStream);
+            for (SizeType i = 0; i < shadowStream.rays.size(); i++)
+            {
+                if (shadowStream.rays[i].metadata.instanceIndex == UNSET_INDEX)
+                    paths[shadowPaths[i]].energy += contributions[i];
+            }
         }
-        else
+
+        stream.rays.swap(extendedRays);
+        activePaths.swap(extendedPaths);
+
+        if (!stream.rays.empty())
+            m_scene.intersect(stream);
+    }
+
+    for (U32 i = 0; i < pathCount; i++)
+        energies[i] = paths[i].energy;
+}
+
+bool Renderer::shade(U32& seed, Ray& ray, bool intersected, PathState& path, LightSample& lightSample)
+{
+    if (!intersected)
+    {
+        path.energy += path.transmission * m_scene.sampleBackground(ray);
+        return false;
+    }
+
+    const Instance& instance = m_scene.hitInstance(ray.metadata);
+    const Mesh* mesh = instance.mesh();
+    const Material* material = instance.material;
+
+    if (material->isLight())
+    {
+        path.energy += path.lastSpecular ? path.transmission * material->emittance() : COLOR_BLACK;
+        return false;
+    }
+
+    Float3 mediumScale(1.0f);
+    if (ray.inMedium)
+        mediumScale = expf(material->absorption * -ray.depth);
+
+    Float3 I = ray.hitPosition();
+    Float3 N = m_scene.hitNormal(ray.metadata);
+    Float2 UV = mesh->textureCoordinate(ray.metadata.primitiveIndex, ray.metadata.hitCoordinates);
+    F32 rng = randomF32(seed);
+
+    Float3 R = Float3(0);
+    bool inMedium = ray.inMedium;
+
+    // Flip normal on backface hits
+    if (ray.direction.dot(N) > 0.0f)
+        N *= -1.0f;
+
+    if (rng < material->reflectivity)
+    {
+        R = reflect(ray.direction, N);
+        path.lastSpecular = true;
+        path.transmission *= material->albedo * mediumScale;
+    }
+    else if (rng < (material->reflectivity + material->refractivity))
+    {
+        // Assume reflect & precalculate ray
+        bool mustRefract = false;
+        R = reflect(ray.direction, N);
+
+        // Check for refraction
+        F32 n1 = ray.inMedium ? material->indexOfRefraction : 1.0f;
+        F32 n2 = ray.inMedium ? 1.0f : material->indexOfRefraction;
+        F32 iorRatio = n1 / n2;
+
+        F32 cosI = -ray.direction.dot(N);
+        F32 cosTheta2 = 1.0f - (iorRatio * iorRatio) * (1.0f - cosI * cosI);
+        F32 Fresnel = 1.0f;
+
+        if (cosTheta2 > 0.0f)
         {
-            R = randomOnHemisphereCosineWeighted(seed, N);
-            U32 lightCount = m_scene.lightCount();
-            F32 cosTheta = N.dot(R);
-            F32 diffusePDF = cosTheta * F32_INV_PI;
-            RgbColor brdf = material->albedo * F32_INV_PI;
+            F32 a = n1 - n2, b = n1 + n2;
+            F32 r0 = (a * a) / (b * b);
+            F32 c = 1.0f - cosI;
+            F32 Fresnel = r0 + (1.0f - r0) * (c * c * c * c * c);
 
-            if (lightCount > 0) // Can only do NEE if there are explicit lights to be sampled
-            {
-                const Instance& light = m_scene.sampleLights(seed);
-                const SamplePoint point = light.samplePoint(seed);
-                
-                Float3 IL = point.position - I;
-                Float3 L = IL.normalize();
-                Float3 LN = point.normal;
-
-                Float3 SO = I + F32_EPSILON * L;
-                Ray sr = Ray(SO, L);
-                sr.depth = IL.magnitude() - 2.0f * F32_EPSILON;
-
-                F32 falloff = 1.0f / IL.dot(IL);
-                F32 cosO = N.dot(L);
-                F32 cosI = LN.dot(-1.0f * L);
-
-                if (cosO > 0.0f && cosI > 0.0f)
-                {
-                    F32 SA = cosI * light.area * falloff;
-                    F32 lightPDF = 1.0f / SA;
+            mustRefract = randomF32(seed) > Fresnel;
+            if (mustRefract)
+                R = iorRatio * ray.direction + ((iorRatio * cosI - sqrtf(fabsf(cosTheta2))) * N);
+        }
 
-                    if (!m_scene.intersectAny(sr))
-                    {
-                        F32 invPdf = 1.0f / lightPDF;
-                        Float3 Ld = light.material->emittance() * invPdf * brdf * cosO * static_cast<F32>(lightCount);
-                        energy += transmission * Ld;
-                    }
-                }
-            }
+        path.lastSpecular = true;
+        path.transmission *= material->albedo * mediumScale;
+        inMedium = mustRefract ? !inMedium : inMedium;
+    }
+    else
+    {
+        R = randomOnHemisphereCosineWeighted(seed, N);
+        F32 cosTheta = N.dot(R);
+        F32 diffusePDF = cosTheta * F32_INV_PI;
+        RgbColor brdf = material->albedo * F32_INV_PI;
 
-            // Calculate termination chance for russian roulette
-            const F32 p = clamp(max(transmission.r, max(transmission.g, transmission.b)), 0.0f, 1.0f);
-            if (p < randomF32(seed))
-                break;
+        EmitterSample point = {};
+        if (m_scene.sampleLights(seed, I, N, point)) // Can only do NEE if there are explicit lights that may reach the hit
+        {
+            Float3 IL = point.position - I;
+            Float3 L = IL.normalize();
+            Float3 LN = point.normal;
+
+            Float3 SO = I + F32_EPSILON * L;
+            lightSample.shadowRay = Ray(SO, L, VISIBILITY_SHADOW);
+            lightSample.shadowRay.depth = IL.magnitude() - 2.0f * F32_EPSILON;
 
-            F32 rrScale = 1.0f / p;
-            F32 invPdf = 1.0f / diffusePDF;
-            lastSpecular = false;
-            transmission *= cosTheta * invPdf * brdf * mediumScale * rrScale;
+            F32 falloff = 1.0f / IL.dot(IL);
+            F32 cosO = N.dot(L);
+            F32 cosI = LN.dot(-1.0f * L);
+
+            if (cosO > 0.0f && cosI > 0.0f)
+            {
+                // Area measure pdf of the light BVH to solid angle
+                F32 lightPDF = point.pdf / (cosI * falloff);
+
+                // Visibility is resolved by the caller, so shadow rays can be traced one at a time or as a stream
+                F32 invPdf = 1.0f / lightPDF;
+                Float3 Ld = point.emittance * invPdf * brdf * cosO;
+                lightSample.contribution = path.transmission * Ld;
+                lightSample.valid = true;
+            }
         }
 
-        Float3 O = I + F32_EPSILON * R;
-        ray = Ray(O, R);
-        ray.inMedium = inMedium;
+        // Calculate termination chance for russian roulette
+        const F32 p = clamp(max(path.transmission.r, max(path.transmission.g, path.transmission.b)), 0.0f, 1.0f);
+        if (p < randomF32(seed))
+            return false;
+
+        F32 rrScale = 1.0f / p;
+        F32 invPdf = 1.0f / diffusePDF;
+        path.lastSpecular = false;
+        path.transmission *= cosTheta * invPdf * brdf * mediumScale * rrScale;
     }
 
-    return energy;
-#endif
+    Float3 O = I + F32_EPSILON * R;
+    ray = Ray(O, R, VISIBILITY_INDIRECT);
+    ray.inMedium = inMedium;
+    return true;
 }
 
 void Renderer::copyBufferToImage(
@@ -751,6 +942,15 @@ WaveFrontRenderer::WaveFrontRenderer(RenderContext* renderContext, UIManager* ui
         0, VK_WHOLE_SIZE
     };
 
+    WriteDescriptorSet blasLinkWriteSet = {};
+    blasLinkWriteSet.set = 2;
+    blasLinkWriteSet.binding = 10;
+    blasLinkWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    blasLinkWriteSet.bufferInfo = VkDescriptorBufferInfo{
+        m_scene.BLASGlobalLinkBuffer.handle(),
+        0, VK_WHOLE_SIZE
+    };
+
     WriteDescriptorSet materialWriteSet = {};
     materialWriteSet.set = 2;
     materialWriteSet.binding = 5;
@@ -787,6 +987,24 @@ WaveFrontRenderer::WaveFrontRenderer(RenderContext* renderContext, UIManager* ui
         0, VK_WHOLE_SIZE
     };
 
+    WriteDescriptorSet tlasLinkWriteSet = {};
+    tlasLinkWriteSet.set = 2;
+    tlasLinkWriteSet.binding = 11;
+    tlasLinkWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    tlasLinkWriteSet.bufferInfo = VkDescriptorBufferInfo{
+        m_scene.TLASLinkBuffer.handle(),
+        0, VK_WHOLE_SIZE
+    };
+
+    WriteDescriptorSet tlasMaskWriteSet = {};
+    tlasMaskWriteSet.set = 2;
+    tlasMaskWriteSet.binding = 14;
+    tlasMaskWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    tlasMaskWriteSet.bufferInfo = VkDescriptorBufferInfo{
+        m_scene.TLASMaskBuffer.handle(),
+        0, VK_WHOLE_SIZE
+    };
+
     WriteDescriptorSet lightDataWriteSet = {};
     lightDataWriteSet.set = 2;
     lightDataWriteSet.binding = 9;
@@ -796,6 +1014,24 @@ WaveFrontRenderer::WaveFrontRenderer(RenderContext* renderContext, UIManager* ui
         0, VK_WHOLE_SIZE
     };
 
+    WriteDescriptorSet lightDataAliasWriteSet = {};
+    lightDataAliasWriteSet.set = 2;
+    lightDataAliasWriteSet.binding = 12;
+    lightDataAliasWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    lightDataAliasWriteSet.bufferInfo = VkDescriptorBufferInfo{
+        m_scene.lightDataBuffer.handle(),
+        0, VK_WHOLE_SIZE
+    };
+
+    WriteDescriptorSet triAliasWriteSet = {};
+    triAliasWriteSet.set = 2;
+    triAliasWriteSet.binding = 13;
+    triAliasWriteSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    triAliasWriteSet.bufferInfo = VkDescriptorBufferInfo{
+        m_scene.triangleAliasBuffer.handle(),
+        0, VK_WHOLE_SIZE
+    };
+
     // Wavefront data
     WriteDescriptorSet rayCounterWriteSet = {};
     rayCounterWriteSet.set = 1;
@@ -842,9 +1078,9 @@ WaveFrontRenderer::WaveFrontRenderer(RenderContext* renderContext, UIManager* ui
         matEvalRayBufferWriteSet,
         sceneDataWriteSet,
         triBufWriteset,
-        blasIdxWriteSet, blasNodeWriteSet,
+        blasIdxWriteSet, blasNodeWriteSet, blasLinkWriteSet,
         instanceWriteSet,
-        tlasIdxWriteSet, tlasNodeWriteSet,
+        tlasIdxWriteSet, tlasNodeWriteSet, tlasLinkWriteSet, tlasMaskWriteSet,
     });
 
     m_rayShadePipeline.updateDescriptorSets({
@@ -859,7 +1095,7 @@ WaveFrontRenderer::WaveFrontRenderer(RenderContext* renderContext, UIManager* ui
         triExtBufWriteset,
         materialWriteSet,
         instanceWriteSet,
-        lightDataWriteSet,
+        lightDataWriteSet, lightDataAliasWriteSet, triAliasWriteSet,
     });
 
     m_rayConnectPipeline.updateDescriptorSets({
@@ -870,11 +1106,10 @@ WaveFrontRenderer::WaveFrontRenderer(RenderContext* renderContext, UIManager* ui
         sceneDataWriteSet,
         triBufWriteset,
         triExtBufWriteset,
-        blasIdxWriteSet, blasNodeWriteSet,
+        blasIdxWriteSet, blasNodeWriteSet, blasLinkWriteSet,
         materialWriteSet,
         instanceWriteSet,
-        tlasIdxWriteSet, tlasNodeWriteSet,
-        lightDataWriteSet,
+        tlasIdxWriteSet, tlasNodeWriteSet, tlasLinkWriteSet, tlasMaskWriteSet,
     });
 
     m_wfFinalizePipeline.updateDescriptorSets({
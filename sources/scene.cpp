@@ -14,6 +14,8 @@
 #include "vk_layer/buffer.h"
 #include "vk_layer/vk_check.h"
 
+#define TLAS_ROTATION_BUDGET	0.0005f	// Seconds per update spent on TLAS tree rotations, undoing the decay of refits
+
 Scene::Scene(SceneBackground background, std::vector<Instance> instances)
 	:
 	m_background(background),
@@ -23,13 +25,37 @@ Scene::Scene(SceneBackground background, std::vector<Instance> instances)
 	SizeType idx = 0;
 	for (auto const& instance : instances)
 	{
-		if (instance.material->isLight())
+		if (instance.isEmitter())
 		{
 			m_lightIndices.push_back(static_cast<U32>(idx));
 		}
 
 		idx++;
 	}
+
+	buildLightSamplers();
+}
+
+bool Scene::sampleLights(U32& seed, const Float3& position, const Float3& normal, EmitterSample& sample) const
+{
+#if NEE_LIGHT_BVH == 1
+	return m_lightBvh.sample(seed, position, normal, sample);
+#else
+	if (m_lightTable.size() == 0)
+		return false;
+
+	// Light by power, then triangle by area, both in constant time
+	const U32 lightIndex = m_lightTable.sample(seed);
+	const Instance& light = m_sceneTlas.instances()[m_lightIndices[lightIndex]];
+	const SamplePoint point = light.samplePoint(seed, position);
+
+	sample.position = point.position;
+	sample.normal = point.normal;
+	sample.emittance = light.material->emittance();
+	sample.pdf = m_lightTable.probability(lightIndex) * point.pdf;
+	sample.instanceIndex = m_lightIndices[lightIndex];
+	return true;
+#endif
 }
 
 RgbColor Scene::sampleBackground(const Ray& ray) const
@@ -52,10 +78,35 @@ RgbColor Scene::sampleBackground(const Ray& ray) const
 
 void Scene::update(F32 deltaTime)
 {
-	Instance& instance = m_sceneTlas.instance(3);
-	instance.setTransform(glm::rotate(instance.transform(), 1.0f * deltaTime, static_cast<glm::vec3>(WORLD_UP)));
+	for (SizeType i = 0; i < m_sceneTlas.instances().size(); i++)
+	{
+		Instance& instance = m_sceneTlas.instance(i);
+		if (instance.animated)
+			instance.setTransform(glm::rotate(instance.transform(), 1.0f * deltaTime, static_cast<glm::vec3>(WORLD_UP)));
+	}
+
+	// Refitting clears the dirty flags, so moved lights are found before it
+	bool lightsMoved = false;
+	for (U32 lightIndex : m_lightIndices)
+		lightsMoved |= m_sceneTlas.instance(lightIndex).isDirty();
 
 	m_sceneTlas.refit();
+	m_sceneTlas.optimize(TLAS_ROTATION_BUDGET);
+
+	if (lightsMoved)
+		buildLightSamplers();
+}
+
+void Scene::buildLightSamplers()
+{
+	const std::vector<Instance>& instances = m_sceneTlas.instances();
+	m_lightBvh.build(instances);
+
+	std::vector<F32> lightPowers;
+	for (U32 lightIndex : m_lightIndices)
+		lightPowers.push_back(luminance(instances[lightIndex].material->emittance()) * instances[lightIndex].area);
+
+	m_lightTable.build(lightPowers.data(), static_cast<U32>(lightPowers.size()));
 }
 
 const GPUBatchInfo GPUBatcher::createBatchInfo(const std::vector<Instance>& instances)
@@ -67,18 +118,56 @@ const GPUBatchInfo GPUBatcher::createBatchInfo(const std::vector<Instance>& inst
 	std::map<const BvhBLAS*, SizeType> sceneBVHNodes;
 	std::set<const Material*> sceneMaterials;
 
+	// Assemblies are batched once however often they are placed, their members follow the scene instances in the instance buffer
+	std::vector<const BvhTLAS*> assemblies;
+	std::map<const BvhTLAS*, SizeType> assemblyMembers;	// Instance buffer index of the first member of every assembly
+	std::vector<const Instance*> meshInstances;
+	SizeType memberCount = 0;
 	for (auto const& instance : instances)
 	{
-		const Mesh* mesh = instance.bvh->mesh();
+		if (!instance.isAssembly())
+		{
+			meshInstances.push_back(&instance);
+			continue;
+		}
+
+		if (assemblyMembers.count(instance.assembly) != 0)
+			continue;
+
+		assemblies.push_back(instance.assembly);
+		assemblyMembers[instance.assembly] = instances.size() + memberCount;
+		memberCount += instance.assembly->instances().size();
+		for (auto const& member : instance.assembly->instances())
+			meshInstances.push_back(&member);
+	}
+
+	for (const Instance* instance : meshInstances)
+	{
+		// The kernels only traverse BVHs
+		assert(instance->bvh != nullptr);
+
+		const Mesh* mesh = instance->bvh->mesh();
 		assert(mesh->triangles.size() == mesh->triExtensions.size());
-		sceneMeshes.insert(std::make_pair(mesh, mesh->triangles.size()));
-		sceneBVHIndices.insert(std::make_pair(instance.bvh, mesh->triangles.size()));
-		sceneBVHNodes.insert(std::make_pair(instance.bvh, static_cast<SizeType>(instance.bvh->nodesUsed())));
-		sceneMaterials.insert(instance.material);
+		sceneMeshes.insert(std::make_pair(mesh, mesh->primitiveCount()));
+		sceneBVHIndices.insert(std::make_pair(instance->bvh, instance->bvh->indexCount()));
+		sceneBVHNodes.insert(std::make_pair(instance->bvh, static_cast<SizeType>(instance->bvh->nodesUsed())));
+		sceneMaterials.insert(instance->material);
+	}
+
+	for (auto const& [ bvh, size ] : sceneBVHIndices)
+	{
+		batchInfo.BLASIndexCapacity += bvh->maxIndexCount();
+		batchInfo.BLASNodeCapacity += bvh->maxNodeCount();
 	}
 
 	for (auto const& [ mesh, size ] : sceneMeshes)
 	{
+		// Analytic primitives are stored as (origin, u, v) triangles, their extensions are unused but keep both arrays indexed alike
+		for (auto const& primitive : mesh->analyticPrimitives)
+			batchInfo.triBuffer.push_back(Triangle(primitive.u, primitive.origin, primitive.v));
+
+		batchInfo.triExtBuffer.insert(batchInfo.triExtBuffer.end(), mesh->analyticPrimitives.size(), TriExtension{});
+
 		batchInfo.triBuffer.insert(
 			batchInfo.triBuffer.end(),
 			mesh->triangles.begin(),
@@ -108,6 +197,9 @@ const GPUBatchInfo GPUBatcher::createBatchInfo(const std::vector<Instance>& inst
 			bvh->nodePool(),
 			bvh->nodePool() + size
 		);
+
+		const std::vector<U32> links = createNodeLinks(bvh->nodePool(), static_cast<U32>(size));
+		batchInfo.BLASLinks.insert(batchInfo.BLASLinks.end(), links.begin(), links.end());
 	}
 
 	for (auto const& material : sceneMaterials)
@@ -115,8 +207,33 @@ const GPUBatchInfo GPUBatcher::createBatchInfo(const std::vector<Instance>& inst
 		batchInfo.materials.push_back(*material);
 	}
 
-	for (auto const& instance : instances)
+	// Assembly TLASses follow the scene TLAS in the TLAS buffers, past the index & node capacity of the scene TLAS.
+	// Their child indices & node links are local to the assembly, like those of the BLASses
+	std::map<const BvhTLAS*, SizeType> assemblyIndexOffsets;
+	std::map<const BvhTLAS*, SizeType> assemblyNodeOffsets;
+	for (const BvhTLAS* assembly : assemblies)
 	{
+		assemblyIndexOffsets[assembly] = instances.size() + batchInfo.assemblyIndices.size();
+		assemblyNodeOffsets[assembly] = 2 * instances.size() + batchInfo.assemblyNodes.size();
+
+		batchInfo.assemblyIndices.insert(
+			batchInfo.assemblyIndices.end(),
+			assembly->indices(),
+			assembly->indices() + assembly->instances().size()
+		);
+
+		batchInfo.assemblyNodes.insert(
+			batchInfo.assemblyNodes.end(),
+			assembly->nodePool(),
+			assembly->nodePool() + assembly->nodesUsed()
+		);
+
+		const std::vector<U32> links = createNodeLinks(assembly->nodePool(), assembly->nodesUsed());
+		batchInfo.assemblyLinks.insert(batchInfo.assemblyLinks.end(), links.begin(), links.end());
+		batchInfo.assemblyMasks.insert(batchInfo.assemblyMasks.end(), assembly->nodeMasks().begin(), assembly->nodeMasks().end());
+	}
+
+	auto meshGPUInstance = [&](const Instance& instance) {
 		GPUInstance gpuInstance = instance.toGPUInstance();
 		for (auto const& [ mesh, size ] : sceneMeshes)
 		{
@@ -142,26 +259,99 @@ const GPUBatchInfo GPUBatcher::createBatchInfo(const std::vector<Instance>& inst
 			gpuInstance.materialOffset++;
 		}
 
-		if (instance.material->isLight())
+		return gpuInstance;
+	};
+
+	std::vector<F32> lightPowers;
+	for (auto const& instance : instances)
+	{
+		if (instance.isAssembly())
+		{
+			GPUInstance gpuInstance = instance.toGPUInstance();
+			gpuInstance.triOffset = static_cast<U32>(assemblyMembers[instance.assembly]);
+			gpuInstance.bvhIdxOffset = static_cast<U32>(assemblyIndexOffsets[instance.assembly]);
+			gpuInstance.bvhNodeOffset = static_cast<U32>(assemblyNodeOffsets[instance.assembly]);
+			batchInfo.gpuInstances.push_back(gpuInstance);
+			continue;
+		}
+
+		GPUInstance gpuInstance = meshGPUInstance(instance);
+		if (instance.isEmitter())
 		{
 			batchInfo.lights.push_back(GPULightData{
 				static_cast<U32>(batchInfo.gpuInstances.size()),
 				static_cast<U32>(instance.bvh->triCount()),
+				static_cast<U32>(batchInfo.triangleAliases.size()),
+				AliasEntry{},
 			});
+
+			const std::vector<AliasEntry>& triangleTable = instance.triangleTable().entries();
+			batchInfo.triangleAliases.insert(batchInfo.triangleAliases.end(), triangleTable.begin(), triangleTable.end());
+			lightPowers.push_back(luminance(instance.material->emittance()) * instance.area);
 		}
 
 		batchInfo.gpuInstances.push_back(gpuInstance);
 	}
 
+	for (const BvhTLAS* assembly : assemblies)
+	{
+		for (auto const& member : assembly->instances())
+			batchInfo.gpuInstances.push_back(meshGPUInstance(member));
+	}
+
+	AliasTable lightTable;
+	lightTable.build(lightPowers.data(), static_cast<U32>(lightPowers.size()));
+	for (U32 i = 0; i < lightTable.size(); i++)
+		batchInfo.lights[i].power = lightTable.entries()[i];
+
 	return batchInfo;
 }
 
+std::vector<U32> GPUBatcher::createNodeLinks(const BvhNode* nodePool, U32 nodesUsed)
+{
+	assert(nodePool != nullptr);
+	assert(nodesUsed <= BVH_LINK_PARENT_MASK);
+
+	// Unreachable nodes keep a zero link, they are never visited by the kernels
+	std::vector<U32> links(nodesUsed, 0);
+	std::vector<U32> stack = { BVH_ROOT_INDEX };
+	while (!stack.empty())
+	{
+		const U32 nodeIndex = stack.back();
+		stack.pop_back();
+
+		const BvhNode& node = nodePool[nodeIndex];
+		if (node.isLeaf())
+			continue;
+
+		const BvhNode& left = nodePool[node.left()];
+		const BvhNode& right = nodePool[node.right()];
+		const Float3 separation = (right.bbMin + right.bbMax) - (left.bbMin + left.bbMax);
+
+		U32 axis = 0;
+		if (fabsf(separation.y) > fabsf(separation.xyz[axis])) axis = 1;
+		if (fabsf(separation.z) > fabsf(separation.xyz[axis])) axis = 2;
+
+		// Kernels visit the child on the side the ray comes from first, picked by the direction sign along the axis
+		links[nodeIndex] |= (axis << BVH_LINK_AXIS_SHIFT) | (separation.xyz[axis] < 0.0f ? BVH_LINK_FLIP_CHILDREN : 0);
+		links[node.left()] |= nodeIndex;
+		links[node.right()] |= nodeIndex | BVH_LINK_RIGHT_CHILD;
+
+		stack.push_back(node.left());
+		stack.push_back(node.right());
+	}
+
+	return links;
+}
+
 GPUScene::GPUScene(RenderContext* renderContext, SceneBackground background, std::vector<Instance> instances)
 	:
 	m_background(background),
 	m_sceneTlas(instances),
 	m_renderContext(renderContext),
 	m_batchInfo(GPUBatcher::createBatchInfo(instances)),
+	m_tlasLinks(GPUBatcher::createNodeLinks(m_sceneTlas.nodePool(), m_sceneTlas.nodesUsed())),
+	m_lightBvh(m_sceneTlas.instances()),
 	globalTriBuffer(
 		renderContext->allocator, m_batchInfo.triBuffer.size() * sizeof(Triangle),
 		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
@@ -177,14 +367,21 @@ GPUScene::GPUScene(RenderContext* renderContext, SceneBackground background, std
 		0
 	),
 	BLASGlobalIndexBuffer(
-		renderContext->allocator, m_batchInfo.BLASIndices.size() * sizeof(U32),
+		renderContext->allocator, m_batchInfo.BLASIndexCapacity * sizeof(U32),	// Index capacity, rebuilt BLASses may use more indices
 		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
 		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		0
 	),
 	BLASGlobalNodeBuffer(
-		renderContext->allocator, m_batchInfo.BLASNodes.size() * sizeof(BvhNode),
+		renderContext->allocator, m_batchInfo.BLASNodeCapacity * sizeof(BvhNode),	// Node capacity, rebuilt BLASses may use more nodes
+		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		0
+	),
+	BLASGlobalLinkBuffer(
+		renderContext->allocator, m_batchInfo.BLASNodeCapacity * sizeof(U32),	// Same capacity as the node buffer
 		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
 		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
@@ -205,25 +402,53 @@ GPUScene::GPUScene(RenderContext* renderContext, SceneBackground background, std
 		0
 	),
 	TLASIndexBuffer(
-		renderContext->allocator, instances.size() * sizeof(U32),
+		renderContext->allocator, (instances.size() + m_batchInfo.assemblyIndices.size()) * sizeof(U32),
 		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
 		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		0
 	),
 	TLASNodeBuffer(
-		renderContext->allocator, m_sceneTlas.nodesUsed() * sizeof(BvhNode),
+		renderContext->allocator, (2 * instances.size() + m_batchInfo.assemblyNodes.size()) * sizeof(BvhNode),	// Node capacity, refits may rebuild into more nodes
+		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		0
+	),
+	TLASLinkBuffer(
+		renderContext->allocator, (2 * instances.size() + m_batchInfo.assemblyLinks.size()) * sizeof(U32),	// Same capacity as the node buffer
+		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		0
+	),
+	TLASMaskBuffer(
+		renderContext->allocator, (2 * instances.size() + m_batchInfo.assemblyMasks.size()) * sizeof(U32),	// Same capacity as the node buffer
 		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
 		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		0
 	),
 	lightBuffer(
+		renderContext->allocator, m_lightBvh.nodes().size() * sizeof(LightBvhNode),
+		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		0
+	),
+	lightDataBuffer(
 		renderContext->allocator, m_batchInfo.lights.size() * sizeof(GPULightData),
 		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
 		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		0
+	),
+	triangleAliasBuffer(
+		renderContext->allocator, m_batchInfo.triangleAliases.size() * sizeof(AliasEntry),
+		VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+		| VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VkMemoryPropertyFlagBits::VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		0
 	)
 {
 	assert(renderContext != nullptr);
@@ -240,21 +465,43 @@ GPUScene::GPUScene(RenderContext* renderContext, SceneBackground background, std
 	SizeType triExtBufSize = m_batchInfo.triExtBuffer.size() * sizeof(TriExtension);
 	SizeType blasIndexBufSize = m_batchInfo.BLASIndices.size() * sizeof(U32);
 	SizeType blasNodeBufSize = m_batchInfo.BLASNodes.size() * sizeof(BvhNode);
+	SizeType blasLinkBufSize = m_batchInfo.BLASLinks.size() * sizeof(U32);
 	SizeType materialBufSize = m_batchInfo.materials.size() * sizeof(Material);
 	SizeType instanceBufSize = m_batchInfo.gpuInstances.size() * sizeof(GPUInstance);
-	SizeType tlasIndexBufSize = m_batchInfo.gpuInstances.size() * sizeof(U32);
+	SizeType tlasIndexBufSize = m_sceneTlas.instances().size() * sizeof(U32);
 	SizeType tlasNodeBufSize = m_sceneTlas.nodesUsed() * sizeof(BvhNode);
-	SizeType lightBufSize = m_batchInfo.lights.size() * sizeof(GPULightData);
+	SizeType tlasLinkBufSize = m_tlasLinks.size() * sizeof(U32);
+	SizeType tlasMaskBufSize = m_sceneTlas.nodeMasks().size() * sizeof(U32);
+	SizeType lightBufSize = m_lightBvh.nodes().size() * sizeof(LightBvhNode);
+	SizeType lightDataBufSize = m_batchInfo.lights.size() * sizeof(GPULightData);
+	SizeType triAliasBufSize = m_batchInfo.triangleAliases.size() * sizeof(AliasEntry);
 
 	uploadToGPU(m_batchInfo.triBuffer.data(), triBufSize, globalTriBuffer);
 	uploadToGPU(m_batchInfo.triExtBuffer.data(), triExtBufSize, globalTriExtBuffer);
 	uploadToGPU(m_batchInfo.BLASIndices.data(), blasIndexBufSize, BLASGlobalIndexBuffer);
 	uploadToGPU(m_batchInfo.BLASNodes.data(), blasNodeBufSize, BLASGlobalNodeBuffer);
+	uploadToGPU(m_batchInfo.BLASLinks.data(), blasLinkBufSize, BLASGlobalLinkBuffer);
 	uploadToGPU(m_batchInfo.materials.data(), materialBufSize, materialBuffer);
 	uploadToGPU(m_batchInfo.gpuInstances.data(), instanceBufSize, instanceBuffer);
 	uploadToGPU(m_sceneTlas.indices(), tlasIndexBufSize, TLASIndexBuffer);
 	uploadToGPU(m_sceneTlas.nodePool(), tlasNodeBufSize, TLASNodeBuffer);
-	uploadToGPU(m_batchInfo.lights.data(), lightBufSize, lightBuffer);
+	uploadToGPU(m_tlasLinks.data(), tlasLinkBufSize, TLASLinkBuffer);
+	uploadToGPU(m_sceneTlas.nodeMasks().data(), tlasMaskBufSize, TLASMaskBuffer);
+	uploadToGPU(m_lightBvh.nodes().data(), lightBufSize, lightBuffer);
+	uploadToGPU(m_batchInfo.lights.data(), lightDataBufSize, lightDataBuffer);
+	uploadToGPU(m_batchInfo.triangleAliases.data(), triAliasBufSize, triangleAliasBuffer);
+
+	// Assemblies are never refitted, their TLASses are uploaded once past the scene TLAS capacity
+	if (!m_batchInfo.assemblyNodes.empty())
+	{
+		SizeType tlasIndexCapacity = instances.size();
+		SizeType tlasNodeCapacity = 2 * instances.size();
+
+		uploadToGPU(m_batchInfo.assemblyIndices.data(), m_batchInfo.assemblyIndices.size() * sizeof(U32), TLASIndexBuffer, tlasIndexCapacity * sizeof(U32));
+		uploadToGPU(m_batchInfo.assemblyNodes.data(), m_batchInfo.assemblyNodes.size() * sizeof(BvhNode), TLASNodeBuffer, tlasNodeCapacity * sizeof(BvhNode));
+		uploadToGPU(m_batchInfo.assemblyLinks.data(), m_batchInfo.assemblyLinks.size() * sizeof(U32), TLASLinkBuffer, tlasNodeCapacity * sizeof(U32));
+		uploadToGPU(m_batchInfo.assemblyMasks.data(), m_batchInfo.assemblyMasks.size() * sizeof(U32), TLASMaskBuffer, tlasNodeCapacity * sizeof(U32));
+	}
 }
 
 GPUScene::~GPUScene()
@@ -266,22 +513,57 @@ GPUScene::~GPUScene()
 
 void GPUScene::update(F32 deltaTime)
 {
-	Instance& instance = m_sceneTlas.instance(3);
-	instance.setTransform(glm::rotate(instance.transform(), 1.0f * deltaTime, static_cast<glm::vec3>(WORLD_UP)));
+	for (SizeType i = 0; i < m_sceneTlas.instances().size(); i++)
+	{
+		Instance& instance = m_sceneTlas.instance(i);
+		if (instance.animated)
+			instance.setTransform(glm::rotate(instance.transform(), 1.0f * deltaTime, static_cast<glm::vec3>(WORLD_UP)));
+	}
+
+	// Refitting clears the dirty flags, so moved lights are found before it
+	bool lightsMoved = false;
+	for (auto const& sceneInstance : m_sceneTlas.instances())
+		lightsMoved |= sceneInstance.isEmitter() && sceneInstance.isDirty();
 
 	m_sceneTlas.refit();
+	m_sceneTlas.optimize(TLAS_ROTATION_BUDGET);
 	m_batchInfo = GPUBatcher::createBatchInfo(m_sceneTlas.instances());	// XXX: is rebatching fast enough for realtime use with larger scenes?
+	m_tlasLinks = GPUBatcher::createNodeLinks(m_sceneTlas.nodePool(), m_sceneTlas.nodesUsed());
 
 	SizeType instanceBufSize = m_batchInfo.gpuInstances.size() * sizeof(GPUInstance);
-	SizeType tlasIndexBufSize = m_batchInfo.gpuInstances.size() * sizeof(U32);
+	SizeType tlasIndexBufSize = m_sceneTlas.instances().size() * sizeof(U32);
 	SizeType tlasNodeBufSize = m_sceneTlas.nodesUsed() * sizeof(BvhNode);
 
 	uploadToGPU(m_batchInfo.gpuInstances.data(), instanceBufSize, instanceBuffer);
 	uploadToGPU(m_sceneTlas.indices(), tlasIndexBufSize, TLASIndexBuffer);
 	uploadToGPU(m_sceneTlas.nodePool(), tlasNodeBufSize, TLASNodeBuffer);
+	uploadToGPU(m_tlasLinks.data(), m_tlasLinks.size() * sizeof(U32), TLASLinkBuffer);
+	uploadToGPU(m_sceneTlas.nodeMasks().data(), m_sceneTlas.nodeMasks().size() * sizeof(U32), TLASMaskBuffer);
+
+	// The emitter count stays the same, so the rebuilt nodes & tables fit the light buffers
+	if (lightsMoved)
+	{
+		m_lightBvh.build(m_sceneTlas.instances());
+		uploadToGPU(m_lightBvh.nodes().data(), m_lightBvh.nodes().size() * sizeof(LightBvhNode), lightBuffer);
+		uploadToGPU(m_batchInfo.lights.data(), m_batchInfo.lights.size() * sizeof(GPULightData), lightDataBuffer);
+		uploadToGPU(m_batchInfo.triangleAliases.data(), m_batchInfo.triangleAliases.size() * sizeof(AliasEntry), triangleAliasBuffer);
+	}
+}
+
+void GPUScene::refreshBlasData()
+{
+	// Rebuilt BLASses change size, which moves the BLAS offsets of the instances as well
+	m_batchInfo = GPUBatcher::createBatchInfo(m_sceneTlas.instances());
+	assert(m_batchInfo.BLASIndices.size() <= m_batchInfo.BLASIndexCapacity);
+	assert(m_batchInfo.BLASNodes.size() <= m_batchInfo.BLASNodeCapacity);
+
+	uploadToGPU(m_batchInfo.BLASIndices.data(), m_batchInfo.BLASIndices.size() * sizeof(U32), BLASGlobalIndexBuffer);
+	uploadToGPU(m_batchInfo.BLASNodes.data(), m_batchInfo.BLASNodes.size() * sizeof(BvhNode), BLASGlobalNodeBuffer);
+	uploadToGPU(m_batchInfo.BLASLinks.data(), m_batchInfo.BLASLinks.size() * sizeof(U32), BLASGlobalLinkBuffer);
+	uploadToGPU(m_batchInfo.gpuInstances.data(), m_batchInfo.gpuInstances.size() * sizeof(GPUInstance), instanceBuffer);
 }
 
-void GPUScene::uploadToGPU(const void* data, SizeType size, Buffer& target)
+void GPUScene::uploadToGPU(const void* data, SizeType size, Buffer& target, SizeType targetOffset)
 {
 	VkCommandBufferAllocateInfo allocInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
 	allocInfo.commandPool = m_uploadOneshotPool;
@@ -308,7 +590,7 @@ void GPUScene::uploadToGPU(const void* data, SizeType size, Buffer& target)
 
 	VkBufferCopy copyRegion = {};
 	copyRegion.srcOffset = 0;
-	copyRegion.dstOffset = 0;
+	copyRegion.dstOffset = targetOffset;
 	copyRegion.size = size;
 	vkCmdCopyBuffer(oneshot, cpuBuffer.handle(), target.handle(), 1, &copyRegion);
 
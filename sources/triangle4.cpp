@@ -0,0 +1,39 @@
+#include "triangle4.h"
+
+#include <cassert>
+
+#include "mesh.h"
+#include "ray.h"
+#include "surf_math.h"
+#include "types.h"
+
+void Triangle4::clear()
+{
+	// Zero edges make every lane degenerate, which the determinant test rejects
+	for (U32 i = 0; i < TRIANGLE4_WIDTH; i++)
+	{
+		v0X[i] = v0Y[i] = v0Z[i] = 0.0f;
+		e1X[i] = e1Y[i] = e1Z[i] = 0.0f;
+		e2X[i] = e2Y[i] = e2Z[i] = 0.0f;
+		primitiveIndex[i] = UNSET_INDEX;
+	}
+}
+
+void Triangle4::setTriangle(U32 lane, const Triangle& triangle, U32 primitive)
+{
+	assert(lane < TRIANGLE4_WIDTH);
+
+	const Float3 e1 = triangle.v1 - triangle.v0;
+	const Float3 e2 = triangle.v2 - triangle.v0;
+
+	v0X[lane] = triangle.v0.x;
+	v0Y[lane] = triangle.v0.y;
+	v0Z[lane] = triangle.v0.z;
+	e1X[lane] = e1.x;
+	e1Y[lane] = e1.y;
+	e1Z[lane] = e1.z;
+	e2X[lane] = e2.x;
+	e2Y[lane] = e2.y;
+	e2Z[lane] = e2.z;
+	primitiveIndex[lane] = primitive;
+}
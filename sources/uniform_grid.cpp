@@ -0,0 +1,342 @@
+#include "uniform_grid.h"
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "bvh.h"
+#include "mesh.h"
+#include "ray.h"
+#include "surf_math.h"
+#include "types.h"
+
+// Cells per axis of a grid over the extent with about cellCount cells, cubic where the extent allows it
+static void gridResolution(const Float3& extent, F32 cellCount, U32 maxResolution, U32 (&resolution)[3])
+{
+	const F32 maxExtent = max(extent.x, max(extent.y, extent.z));
+	resolution[0] = resolution[1] = resolution[2] = 1;
+	if (maxExtent <= 0.0f)
+		return;
+
+	// Flat extents are padded for the volume only, they keep a single cell
+	const F32 minExtent = maxExtent * 0.01f;
+	const F32 volume = max(extent.x, minExtent) * max(extent.y, minExtent) * max(extent.z, minExtent);
+	const F32 cellsPerUnit = cbrtf(cellCount / volume);
+	for (U32 axis = 0; axis < 3; axis++)
+		resolution[axis] = min(max(static_cast<U32>(extent.xyz[axis] * cellsPerUnit), 1u), maxResolution);
+}
+
+// Range of the cells overlapping a box, clamped to the grid
+static void gridCellRange(const AABB& box, const Float3& gridMin, const Float3& cellSize, const U32 (&resolution)[3], U32 (&first)[3], U32 (&last)[3])
+{
+	for (U32 axis = 0; axis < 3; axis++)
+	{
+		const F32 lo = floorf((box.bbMin.xyz[axis] - gridMin.xyz[axis]) / cellSize.xyz[axis]);
+		const F32 hi = floorf((box.bbMax.xyz[axis] - gridMin.xyz[axis]) / cellSize.xyz[axis]);
+		first[axis] = static_cast<U32>(min(max(lo, 0.0f), static_cast<F32>(resolution[axis] - 1)));
+		last[axis] = static_cast<U32>(min(max(hi, 0.0f), static_cast<F32>(resolution[axis] - 1)));
+	}
+}
+
+// Walks the cells of a grid pierced by the ray between tEnter & tExit front to back with a 3D-DDA,
+// calling visitCell(cell, tCellEnter, tCellExit) until it returns true. Returns true if a visit did.
+template <typename CellFunc>
+static bool walkGridCells(const Ray& ray, const Float3& gridMin, const Float3& cellSize, const U32 (&resolution)[3], F32 tEnter, F32 tExit, CellFunc visitCell)
+{
+	const Float3 entry = ray.origin + ray.direction * tEnter;
+
+	I32 cell[3];
+	I32 step[3];
+	F32 tNext[3];
+	F32 tDelta[3];
+	for (U32 axis = 0; axis < 3; axis++)
+	{
+		const F32 position = floorf((entry.xyz[axis] - gridMin.xyz[axis]) / cellSize.xyz[axis]);
+		cell[axis] = static_cast<I32>(min(max(position, 0.0f), static_cast<F32>(resolution[axis] - 1)));
+
+		const F32 direction = ray.direction.xyz[axis];
+		if (direction == 0.0f)
+		{
+			step[axis] = 0;
+			tNext[axis] = F32_INF;
+			tDelta[axis] = F32_INF;
+			continue;
+		}
+
+		// Distance to the cell boundary the ray leaves through along the axis
+		step[axis] = direction > 0.0f ? 1 : -1;
+		const F32 boundary = gridMin.xyz[axis] + static_cast<F32>(cell[axis] + (direction > 0.0f ? 1 : 0)) * cellSize.xyz[axis];
+		tNext[axis] = (boundary - ray.origin.xyz[axis]) / direction;
+		tDelta[axis] = cellSize.xyz[axis] / fabsf(direction);
+	}
+
+	F32 tCellEnter = tEnter;
+	while (true)
+	{
+		U32 axis = tNext[0] < tNext[1] ? 0 : 1;
+		if (tNext[2] < tNext[axis]) axis = 2;
+
+		const F32 tCellExit = min(tNext[axis], tExit);
+		if (visitCell(cell, tCellEnter, tCellExit))
+			return true;
+
+		if (tNext[axis] >= tExit)
+			return false;
+
+		cell[axis] += step[axis];
+		if (cell[axis] < 0 || cell[axis] >= static_cast<I32>(resolution[axis]))
+			return false;
+
+		tCellEnter = tNext[axis];
+		tNext[axis] += tDelta[axis];
+	}
+}
+
+UniformGrid::UniformGrid(Mesh* mesh, bool deferBuild)
+	:
+	m_mesh(mesh),
+	m_bounds(),
+	m_cellSize(0.0f),
+	m_resolution{ 1, 1, 1 },
+	m_cells(),
+	m_leaves(),
+	m_indices(),
+	m_buildTime(0.0f)
+{
+	assert(mesh != nullptr);
+
+	if (!deferBuild)
+		build();
+}
+
+void UniformGrid::build()
+{
+	const std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+
+	const U32 triCount = static_cast<U32>(m_mesh->primitiveCount());
+
+	std::vector<AABB> triangleBounds(triCount);
+	m_bounds = AABB();
+	for (U32 i = 0; i < triCount; i++)
+	{
+		m_mesh->bounds(i, triangleBounds[i].bbMin, triangleBounds[i].bbMax);
+		m_bounds.grow(triangleBounds[i]);
+	}
+
+	// Padded, so flat meshes get a cell size above 0 & triangles on the bounds stay inside the outer cells
+	const Float3 extent = m_bounds.bbMax - m_bounds.bbMin;
+	const F32 padding = max(max(extent.x, max(extent.y, extent.z)), 1.0f) * 1e-4f;
+	m_bounds.bbMin = m_bounds.bbMin - Float3(padding);
+	m_bounds.bbMax = m_bounds.bbMax + Float3(padding);
+
+	gridResolution(extent, GRID_TOP_DENSITY * static_cast<F32>(triCount), GRID_MAX_RESOLUTION, m_resolution);
+	const Float3 gridExtent = m_bounds.bbMax - m_bounds.bbMin;
+	m_cellSize = Float3(gridExtent.x / m_resolution[0], gridExtent.y / m_resolution[1], gridExtent.z / m_resolution[2]);
+
+	// Triangles of every top level cell, bucketed with a counting sort over the cells their bounds overlap
+	const U32 cellCount = m_resolution[0] * m_resolution[1] * m_resolution[2];
+	std::vector<U32> cellOffsets(cellCount + 1, 0);
+	std::vector<U32> cellTriangles;
+	for (U32 pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			for (U32 i = 0; i < cellCount; i++)
+				cellOffsets[i + 1] += cellOffsets[i];
+
+			cellTriangles.resize(cellOffsets[cellCount]);
+		}
+
+		for (U32 i = 0; i < triCount; i++)
+		{
+			U32 first[3], last[3];
+			gridCellRange(triangleBounds[i], m_bounds.bbMin, m_cellSize, m_resolution, first, last);
+
+			for (U32 z = first[2]; z <= last[2]; z++)
+				for (U32 y = first[1]; y <= last[1]; y++)
+					for (U32 x = first[0]; x <= last[0]; x++)
+					{
+						const U32 cellIndex = x + m_resolution[0] * (y + m_resolution[1] * z);
+						if (pass == 0)
+							cellOffsets[cellIndex + 1]++;
+						else
+							cellTriangles[cellOffsets[cellIndex]++] = i;
+					}
+		}
+
+		// Filling advanced every offset to the start of the next cell
+		if (pass == 1)
+		{
+			for (U32 i = cellCount; i > 0; i--)
+				cellOffsets[i] = cellOffsets[i - 1];
+
+			cellOffsets[0] = 0;
+		}
+	}
+
+	// Nested grids are sized per cell, every cell buckets its triangles into its leaves independently
+	m_cells.assign(cellCount, GridCell{ 0, { 0, 0, 0 } });
+	std::vector<std::vector<GridLeaf>> cellLeaves(cellCount);
+	std::vector<std::vector<U32>> cellIndices(cellCount);
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (I32 c = 0; c < static_cast<I32>(cellCount); c++)
+	{
+		const U32 cellIndex = static_cast<U32>(c);
+		const U32 firstTriangle = cellOffsets[cellIndex];
+		const U32 count = cellOffsets[cellIndex + 1] - firstTriangle;
+		if (count == 0)
+			continue;
+
+		const U32 x = cellIndex % m_resolution[0];
+		const U32 y = (cellIndex / m_resolution[0]) % m_resolution[1];
+		const U32 z = cellIndex / (m_resolution[0] * m_resolution[1]);
+		const Float3 cellMin = m_bounds.bbMin + Float3(static_cast<F32>(x), static_cast<F32>(y), static_cast<F32>(z)) * m_cellSize;
+
+		U32 resolution[3];
+		gridResolution(m_cellSize, GRID_CELL_DENSITY * static_cast<F32>(count), GRID_MAX_CELL_RESOLUTION, resolution);
+		const Float3 leafSize = Float3(m_cellSize.x / resolution[0], m_cellSize.y / resolution[1], m_cellSize.z / resolution[2]);
+
+		GridCell& cell = m_cells[cellIndex];
+		for (U32 axis = 0; axis < 3; axis++)
+			cell.resolution[axis] = static_cast<U8>(resolution[axis]);
+
+		const U32 leafCount = resolution[0] * resolution[1] * resolution[2];
+		std::vector<GridLeaf>& leaves = cellLeaves[cellIndex];
+		std::vector<U32>& indices = cellIndices[cellIndex];
+		leaves.assign(leafCount, GridLeaf{ 0, 0 });
+
+		for (U32 pass = 0; pass < 2; pass++)
+		{
+			if (pass == 1)
+			{
+				U32 offset = 0;
+				for (GridLeaf& leaf : leaves)
+				{
+					leaf.first = offset;
+					offset += leaf.count;
+					leaf.count = 0;
+				}
+
+				indices.resize(offset);
+			}
+
+			for (U32 i = firstTriangle; i < firstTriangle + count; i++)
+			{
+				const U32 primitiveIndex = cellTriangles[i];
+				U32 first[3], last[3];
+				gridCellRange(triangleBounds[primitiveIndex], cellMin, leafSize, resolution, first, last);
+
+				for (U32 lz = first[2]; lz <= last[2]; lz++)
+					for (U32 ly = first[1]; ly <= last[1]; ly++)
+						for (U32 lx = first[0]; lx <= last[0]; lx++)
+						{
+							GridLeaf& leaf = leaves[lx + resolution[0] * (ly + resolution[1] * lz)];
+							if (pass == 1)
+								indices[leaf.first + leaf.count] = primitiveIndex;
+
+							leaf.count++;
+						}
+			}
+		}
+	}
+
+	// Leaves & indices of all cells back to back, in cell order
+	m_leaves.clear();
+	m_indices.clear();
+	for (U32 cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		m_cells[cellIndex].firstLeaf = static_cast<U32>(m_leaves.size());
+
+		const U32 indexOffset = static_cast<U32>(m_indices.size());
+		for (GridLeaf leaf : cellLeaves[cellIndex])
+		{
+			leaf.first += indexOffset;
+			m_leaves.push_back(leaf);
+		}
+
+		m_indices.insert(m_indices.end(), cellIndices[cellIndex].begin(), cellIndices[cellIndex].end());
+	}
+
+	m_buildTime = std::chrono::duration<F32>(std::chrono::steady_clock::now() - buildStart).count();
+}
+
+void UniformGrid::refit()
+{
+	build();
+}
+
+bool UniformGrid::intersect(Ray& ray) const
+{
+	return traverse<false>(ray);
+}
+
+bool UniformGrid::intersectAny(Ray& ray) const
+{
+	return traverse<true>(ray);
+}
+
+template <bool AnyHit>
+bool UniformGrid::traverse(Ray& ray) const
+{
+	// Clip the ray to the grid bounds, rays parallel to a slab miss unless they start inside it
+	F32 tEnter = 0.0f;
+	F32 tExit = ray.depth;
+	for (U32 axis = 0; axis < 3; axis++)
+	{
+		const F32 origin = ray.origin.xyz[axis];
+		const F32 direction = ray.direction.xyz[axis];
+		if (direction == 0.0f)
+		{
+			if (origin < m_bounds.bbMin.xyz[axis] || origin > m_bounds.bbMax.xyz[axis])
+				return false;
+
+			continue;
+		}
+
+		const F32 t1 = (m_bounds.bbMin.xyz[axis] - origin) / direction;
+		const F32 t2 = (m_bounds.bbMax.xyz[axis] - origin) / direction;
+		tEnter = max(tEnter, min(t1, t2));
+		tExit = min(tExit, max(t1, t2));
+	}
+
+	if (tEnter > tExit)
+		return false;
+
+	bool intersected = false;
+	const bool stopped = walkGridCells(ray, m_bounds.bbMin, m_cellSize, m_resolution, tEnter, tExit,
+		[&](const I32 (&cellCoordinates)[3], F32 tCellEnter, F32 tCellExit) {
+			const GridCell& cell = m_cells[cellCoordinates[0] + m_resolution[0] * (cellCoordinates[1] + m_resolution[1] * cellCoordinates[2])];
+			if (cell.resolution[0] == 0)
+				return false;
+
+			const U32 resolution[3] = { cell.resolution[0], cell.resolution[1], cell.resolution[2] };
+			const Float3 cellMin = m_bounds.bbMin + Float3(static_cast<F32>(cellCoordinates[0]), static_cast<F32>(cellCoordinates[1]), static_cast<F32>(cellCoordinates[2])) * m_cellSize;
+			const Float3 leafSize = Float3(m_cellSize.x / resolution[0], m_cellSize.y / resolution[1], m_cellSize.z / resolution[2]);
+
+			return walkGridCells(ray, cellMin, leafSize, resolution, tCellEnter, tCellExit,
+				[&](const I32 (&leafCoordinates)[3], F32 /*tLeafEnter*/, F32 tLeafExit) {
+					const GridLeaf& leaf = m_leaves[cell.firstLeaf + leafCoordinates[0] + resolution[0] * (leafCoordinates[1] + resolution[1] * leafCoordinates[2])];
+					for (U32 i = 0; i < leaf.count; i++)
+					{
+						const U32 primitiveIndex = m_indices[leaf.first + i];
+						if (m_mesh->intersect(primitiveIndex, ray))
+						{
+							if (AnyHit)
+								return true;
+
+							intersected = true;
+							ray.metadata.primitiveIndex = primitiveIndex;
+						}
+					}
+
+					// Hits behind the leaf may still be beaten by triangles in the leaves after it
+					return intersected && ray.depth <= tLeafExit;
+				}
+			);
+		}
+	);
+
+	return AnyHit ? stopped : intersected;
+}
@@ -0,0 +1,182 @@
+#include "wide_bvh.h"
+
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+#include "bvh.h"
+#include "surf.h"
+#include "surf_math.h"
+#include "types.h"
+
+U32 gatherWideChildren(const BvhNode* nodePool, U32 nodeIndex, U32 (&children)[WIDE_BVH_WIDTH])
+{
+	const BvhNode& node = nodePool[nodeIndex];
+	U32 childCount = 0;
+
+	if (node.isLeaf())
+	{
+		// Only happens for a leaf root, which becomes the single child of the wide root
+		children[childCount++] = nodeIndex;
+	}
+	else
+	{
+		children[childCount++] = node.left();
+		children[childCount++] = node.right();
+	}
+
+	// Pull up grandchildren by repeatedly opening the interior child with the largest surface area
+	while (childCount < WIDE_BVH_WIDTH)
+	{
+		I32 bestChild = -1;
+		F32 bestArea = F32_NEG_INF;
+		for (U32 i = 0; i < childCount; i++)
+		{
+			const BvhNode& child = nodePool[children[i]];
+			if (child.isLeaf())
+				continue;
+
+			F32 area = child.bounds().area();
+			if (area > bestArea)
+			{
+				bestArea = area;
+				bestChild = static_cast<I32>(i);
+			}
+		}
+
+		if (bestChild < 0)
+			break;
+
+		const BvhNode& opened = nodePool[children[bestChild]];
+		children[bestChild] = opened.left();
+		children[childCount++] = opened.right();
+	}
+
+	return childCount;
+}
+
+WideBvh::WideBvh()
+	:
+	m_nodeCapacity(0),
+	m_nodesUsed(0),
+	m_nodePool(nullptr)
+{
+	//
+}
+
+WideBvh::~WideBvh()
+{
+	release();
+}
+
+WideBvh::WideBvh(const WideBvh& other) noexcept
+	:
+	m_nodeCapacity(other.m_nodeCapacity),
+	m_nodesUsed(other.m_nodesUsed),
+	m_nodePool(nullptr)
+{
+	if (m_nodeCapacity == 0)
+		return;
+
+	m_nodePool = static_cast<WideBvhNode*>(MALLOC64(m_nodeCapacity * sizeof(WideBvhNode)));
+	assert(m_nodePool != nullptr);
+	memcpy(m_nodePool, other.m_nodePool, m_nodeCapacity * sizeof(WideBvhNode));
+}
+
+WideBvh& WideBvh::operator=(const WideBvh& other) noexcept
+{
+	if (this == &other)
+	{
+		return *this;
+	}
+
+	release();
+	this->m_nodeCapacity = other.m_nodeCapacity;
+	this->m_nodesUsed = other.m_nodesUsed;
+
+	if (m_nodeCapacity != 0)
+	{
+		this->m_nodePool = static_cast<WideBvhNode*>(MALLOC64(m_nodeCapacity * sizeof(WideBvhNode)));
+		assert(m_nodePool != nullptr);
+		memcpy(m_nodePool, other.m_nodePool, m_nodeCapacity * sizeof(WideBvhNode));
+	}
+
+	return *this;
+}
+
+void WideBvh::swap(WideBvh& other) noexcept
+{
+	std::swap(m_nodeCapacity, other.m_nodeCapacity);
+	std::swap(m_nodesUsed, other.m_nodesUsed);
+	std::swap(m_nodePool, other.m_nodePool);
+}
+
+void WideBvh::collapse(const BvhNode* nodePool, U32 nodesUsed)
+{
+	assert(nodePool != nullptr);
+
+	// Every wide node consumes at least one binary interior node, so half the binary pool is an upper bound
+	U32 requiredCapacity = nodesUsed / 2 + 1;
+	if (requiredCapacity > m_nodeCapacity)
+	{
+		release();
+		m_nodeCapacity = requiredCapacity;
+		m_nodePool = static_cast<WideBvhNode*>(MALLOC64(m_nodeCapacity * sizeof(WideBvhNode)));
+		assert(m_nodePool != nullptr);
+	}
+
+	m_nodesUsed = 0;
+	collapseNode(nodePool, BVH_ROOT_INDEX);
+}
+
+U32 WideBvh::collapseNode(const BvhNode* nodePool, U32 nodeIndex)
+{
+	U32 children[WIDE_BVH_WIDTH] = {};
+	U32 childCount = gatherWideChildren(nodePool, nodeIndex, children);
+
+	U32 wideIndex = m_nodesUsed++;
+	assert(wideIndex < m_nodeCapacity);
+
+	WideBvhNode& wideNode = m_nodePool[wideIndex];
+	for (U32 i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		wideNode.bbMinX[i] = wideNode.bbMinY[i] = wideNode.bbMinZ[i] = F32_INF;
+		wideNode.bbMaxX[i] = wideNode.bbMaxY[i] = wideNode.bbMaxZ[i] = F32_INF;
+		wideNode.leftFirst[i] = 0;
+		wideNode.count[i] = 0;
+	}
+
+	for (U32 i = 0; i < childCount; i++)
+	{
+		const BvhNode& child = nodePool[children[i]];
+		wideNode.bbMinX[i] = child.bbMin.x;
+		wideNode.bbMinY[i] = child.bbMin.y;
+		wideNode.bbMinZ[i] = child.bbMin.z;
+		wideNode.bbMaxX[i] = child.bbMax.x;
+		wideNode.bbMaxY[i] = child.bbMax.y;
+		wideNode.bbMaxZ[i] = child.bbMax.z;
+
+		if (child.isLeaf())
+		{
+			wideNode.leftFirst[i] = child.first();
+			wideNode.count[i] = child.count;
+		}
+		else
+		{
+			wideNode.leftFirst[i] = collapseNode(nodePool, children[i]);
+			wideNode.count[i] = 0;
+		}
+	}
+
+	return wideIndex;
+}
+
+void WideBvh::release()
+{
+	if (m_nodePool != nullptr)
+		FREE64(m_nodePool);
+
+	m_nodePool = nullptr;
+	m_nodeCapacity = 0;
+	m_nodesUsed = 0;
+}